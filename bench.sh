@@ -0,0 +1,60 @@
+#!/bin/sh
+# Time diskput and diskget with the io_uring and the pread/pwrite backends,
+# once with the image in the page cache (warm) and once dropped from it (cold).
+#
+# usage: ./bench.sh [disk.img] [file size in KB]
+# RUNS sets the number of repetitions per case (default 20).
+
+set -e
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+IMAGE=$(cd "$(dirname "${1:-$SRC/disk.IMA}")" && pwd)/$(basename "${1:-$SRC/disk.IMA}")
+SIZE_KB=${2:-1024}
+RUNS=${RUNS:-20}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > blob.bin
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# drop a file from the page cache without needing root
+drop_cache() {
+    dd if="$1" iflag=nocache count=0 status=none
+}
+
+# bench <backend> <warm|cold>
+bench() {
+    put_total=0
+    get_total=0
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        cp "$IMAGE" img.IMA
+        rm -f BLOB.BIN
+        [ "$2" = cold ] && drop_cache blob.bin && drop_cache img.IMA
+        t0=$(now_us)
+        SFS_IO=$1 "$SRC/diskput" img.IMA blob.bin > /dev/null
+        t1=$(now_us)
+        [ "$2" = cold ] && drop_cache img.IMA
+        t2=$(now_us)
+        SFS_IO=$1 "$SRC/diskget" img.IMA blob.bin > /dev/null
+        t3=$(now_us)
+        cmp -s blob.bin BLOB.BIN || { echo "$1/$2: extracted file differs" >&2; exit 1; }
+        put_total=$((put_total + t1 - t0))
+        get_total=$((get_total + t3 - t2))
+        i=$((i + 1))
+    done
+    printf "%-6s %-5s diskput %8d us   diskget %8d us\n" "$1" "$2" \
+        $((put_total / RUNS)) $((get_total / RUNS))
+}
+
+echo "$RUNS runs of a ${SIZE_KB}KB file on $(basename "$IMAGE")"
+for cache in warm cold; do
+    for backend in sync uring; do
+        bench $backend $cache
+    done
+done
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+#include "emalloc.h"
+
+/**
+ * Function:  cache_create
+ * --------------------
+ * @brief create an empty sector cache for a disk image.
+ *
+ * @param fd: the disk image.
+ * @param block_size: the number of bytes per sector.
+ * @param capacity: the number of sectors to keep, at least 1.
+ *
+ * @return The new cache.
+ *
+ */
+cache_t *cache_create(int fd, uint32_t block_size, int capacity) {
+    cache_t *cache = emalloc(sizeof(cache_t));
+    uint32_t buckets = 1;
+    int i;
+
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    while (buckets < (uint32_t)capacity * 2) {
+        buckets <<= 1;
+    }
+
+    cache->fd = fd;
+    cache->read = NULL;
+    cache->write = NULL;
+    cache->source = NULL;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->blocks = emalloc(capacity * sizeof(block_t));
+    cache->buckets = emalloc(buckets * sizeof(block_t *));
+    cache->bucket_mask = buckets - 1;
+    memset(cache->buckets, 0, buckets * sizeof(block_t *));
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->writebacks = 0;
+
+    // chain every block into the LRU list, all of them empty
+    char *data = emalloc((size_t)capacity * block_size);
+    for (i = 0; i < capacity; i++) {
+        block_t *b = &cache->blocks[i];
+        b->valid = 0;
+        b->dirty = 0;
+        b->data = data + (size_t)i * block_size;
+        b->hash_next = NULL;
+        b->prev = i > 0 ? &cache->blocks[i - 1] : NULL;
+        b->next = i < capacity - 1 ? &cache->blocks[i + 1] : NULL;
+    }
+    cache->head = &cache->blocks[0];
+    cache->tail = &cache->blocks[capacity - 1];
+    return cache;
+}
+
+static block_t *lookup(cache_t *cache, uint32_t sector) {
+    block_t *b = cache->buckets[sector & cache->bucket_mask];
+    while (b != NULL && b->sector != sector) {
+        b = b->hash_next;
+    }
+    return b;
+}
+
+static void unhash(cache_t *cache, block_t *b) {
+    block_t **link = &cache->buckets[b->sector & cache->bucket_mask];
+    while (*link != b) {
+        link = &(*link)->hash_next;
+    }
+    *link = b->hash_next;
+}
+
+/* move a block to the most recently used end of the list */
+static void touch(cache_t *cache, block_t *b) {
+    if (cache->head == b) {
+        return;
+    }
+    b->prev->next = b->next;
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    } else {
+        cache->tail = b->prev;
+    }
+    b->prev = NULL;
+    b->next = cache->head;
+    cache->head->prev = b;
+    cache->head = b;
+}
+
+/**
+ * Function:  read_sectors
+ * --------------------
+ * @brief read consecutive sectors from the disk into a buffer. Past the end
+ *        of the image reads as zeros.
+ *
+ */
+static void read_sectors(cache_t *cache, char *buf, uint32_t sector, int count) {
+    size_t length = (size_t)count * cache->block_size;
+    off_t offset = (off_t)sector * cache->block_size;
+    ssize_t got = cache->read != NULL ? cache->read(cache->source, buf, length, offset) :
+                                        pread(cache->fd, buf, length, offset);
+
+    if (got < (ssize_t)length) {
+        memset(buf + (got > 0 ? got : 0), 0, length - (got > 0 ? got : 0));
+    }
+}
+
+static int write_back(cache_t *cache, block_t *b) {
+    off_t offset = (off_t)b->sector * cache->block_size;
+    if ((cache->write != NULL ? cache->write(cache->source, b->data, cache->block_size, offset) :
+                                pwrite(cache->fd, b->data, cache->block_size, offset)) != cache->block_size) {
+        return -1;
+    }
+    b->dirty = 0;
+    cache->writebacks++;
+    return 0;
+}
+
+/**
+ * Function:  get_block
+ * --------------------
+ * @brief find the block holding a sector, loading it over the least recently
+ *        used block on a miss.
+ *
+ * @param cache: the cache.
+ * @param sector: the sector wanted.
+ * @param load: 0 to skip reading the sector because it is about to be overwritten.
+ *
+ * @return The block, or NULL if writing back the evicted block failed.
+ *
+ */
+static block_t *get_block(cache_t *cache, uint32_t sector, int load) {
+    block_t *b = lookup(cache, sector);
+
+    if (b != NULL) {
+        cache->hits++;
+        touch(cache, b);
+        return b;
+    }
+
+    cache->misses++;
+    b = cache->tail;
+    if (b->valid) {
+        if (b->dirty && write_back(cache, b) != 0) {
+            return NULL;
+        }
+        unhash(cache, b);
+    }
+    if (load) {
+        read_sectors(cache, b->data, sector, 1);
+    }
+    b->sector = sector;
+    b->valid = 1;
+    b->dirty = 0;
+    b->hash_next = cache->buckets[sector & cache->bucket_mask];
+    cache->buckets[sector & cache->bucket_mask] = b;
+    touch(cache, b);
+    return b;
+}
+
+/**
+ * Function:  cache_read
+ * --------------------
+ * @brief get the contents of a sector.
+ *
+ * @param cache: the cache.
+ * @param sector: the sector to read.
+ *
+ * @return The sector contents. The pointer stays valid until the next call into the cache.
+ *
+ */
+const char *cache_read(cache_t *cache, uint32_t sector) {
+    block_t *b = get_block(cache, sector, 1);
+    if (b == NULL) {
+        fprintf(stderr, "Failed to write back sector %u\n", cache->tail->sector);
+        exit(-1);
+    }
+    return b->data;
+}
+
+/**
+ * Function:  cache_has
+ * --------------------
+ * @brief check if a sector is in the cache, without counting a hit or miss.
+ *
+ */
+int cache_has(cache_t *cache, uint32_t sector) {
+    return lookup(cache, sector) != NULL;
+}
+
+/**
+ * Function:  cache_prefetch
+ * --------------------
+ * @brief load a run of sectors with one read, so a sequential scan misses
+ *        once per run instead of once per sector. Sectors already cached are
+ *        left as they are.
+ *
+ * @param cache: the cache.
+ * @param sector: the first sector of the run.
+ * @param count: the number of sectors, at most CACHE_PREFETCH and never more
+ *               than half the cache.
+ *
+ */
+void cache_prefetch(cache_t *cache, uint32_t sector, int count) {
+    char buf[CACHE_PREFETCH * 4096];
+    int i;
+
+    if (count > CACHE_PREFETCH) {
+        count = CACHE_PREFETCH;
+    }
+    if (count > cache->capacity / 2) {
+        count = cache->capacity / 2;
+    }
+    if (count < 1 || cache->block_size > 4096) {
+        return;
+    }
+    read_sectors(cache, buf, sector, count);
+    for (i = 0; i < count; i++) {
+        if (lookup(cache, sector + i) != NULL) {
+            continue;
+        }
+        block_t *b = get_block(cache, sector + i, 0);
+        if (b == NULL) {
+            return;
+        }
+        memcpy(b->data, buf + (size_t)i * cache->block_size, cache->block_size);
+    }
+}
+
+/**
+ * Function:  cache_write
+ * --------------------
+ * @brief change part of a sector. The change reaches the disk when the block is
+ *        evicted or the cache is flushed.
+ *
+ * @param cache: the cache.
+ * @param sector: the sector to change.
+ * @param offset: the first byte to change within the sector.
+ * @param data: the new bytes.
+ * @param length: the number of bytes, offset + length must not exceed the sector size.
+ *
+ * @return 0 on success, -1 if an evicted block could not be written back.
+ *
+ */
+int cache_write(cache_t *cache, uint32_t sector, uint32_t offset, const void *data, uint32_t length) {
+    block_t *b = get_block(cache, sector, offset != 0 || length != cache->block_size);
+    if (b == NULL) {
+        return -1;
+    }
+    memcpy(b->data + offset, data, length);
+    b->dirty = 1;
+    return 0;
+}
+
+/**
+ * Function:  cache_discard
+ * --------------------
+ * @brief drop a run of sectors from the cache without writing them back,
+ *        e.g. because their cluster was freed and may be rewritten past the
+ *        cache. The blocks go to the least recently used end to be reused.
+ *
+ * @param cache: the cache.
+ * @param sector: the first sector of the run.
+ * @param count: the number of sectors.
+ *
+ */
+void cache_discard(cache_t *cache, uint32_t sector, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        block_t *b = lookup(cache, sector + i);
+        if (b == NULL) {
+            continue;
+        }
+        unhash(cache, b);
+        b->valid = 0;
+        b->dirty = 0;
+        if (cache->tail == b) {
+            continue;
+        }
+        // unlink, then append after the tail
+        if (b->prev != NULL) {
+            b->prev->next = b->next;
+        } else {
+            cache->head = b->next;
+        }
+        b->next->prev = b->prev;
+        b->prev = cache->tail;
+        b->next = NULL;
+        cache->tail->next = b;
+        cache->tail = b;
+    }
+}
+
+static int by_sector(const void *a, const void *b) {
+    uint32_t x = (*(block_t **)a)->sector, y = (*(block_t **)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function:  cache_flush
+ * --------------------
+ * @brief write every dirty block back to the disk in sector order.
+ *
+ * @param cache: the cache.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int cache_flush(cache_t *cache) {
+    block_t **dirty = emalloc(cache->capacity * sizeof(block_t *));
+    int i, n = 0, ret = 0;
+
+    for (i = 0; i < cache->capacity; i++) {
+        if (cache->blocks[i].valid && cache->blocks[i].dirty) {
+            dirty[n++] = &cache->blocks[i];
+        }
+    }
+    qsort(dirty, n, sizeof(block_t *), by_sector);
+    for (i = 0; i < n; i++) {
+        if (write_back(cache, dirty[i]) != 0) {
+            ret = -1;
+        }
+    }
+    free(dirty);
+    return ret;
+}
+
+/**
+ * Function:  cache_stats
+ * --------------------
+ * @brief print the hit and miss counters, to help size the cache.
+ *
+ */
+void cache_stats(cache_t *cache, FILE *out) {
+    unsigned long lookups = cache->hits + cache->misses;
+    fprintf(out, "cache: %d blocks, %lu hits, %lu misses (%.1f%% hit rate), %lu writebacks\n",
+            cache->capacity, cache->hits, cache->misses,
+            lookups ? 100.0 * cache->hits / lookups : 0.0, cache->writebacks);
+}
+
+/**
+ * Function:  cache_destroy
+ * --------------------
+ * @brief free the cache. Dirty blocks must have been flushed before.
+ *
+ */
+void cache_destroy(cache_t *cache) {
+    free(cache->blocks[0].data);
+    free(cache->blocks);
+    free(cache->buckets);
+    free(cache);
+}
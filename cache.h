@@ -0,0 +1,53 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * One cached sector.
+ */
+typedef struct block {
+    uint32_t  sector;            /* The sector held by this block. */
+    int       valid;             /* Set once the block holds a sector. */
+    int       dirty;             /* Set if the block differs from the disk. */
+    struct block *prev;          /* Towards the most recently used block. */
+    struct block *next;          /* Towards the least recently used block. */
+    struct block *hash_next;     /* Next block in the same hash bucket. */
+    char      *data;             /* The sector contents. */
+} block_t;
+
+/*
+ * LRU cache of sectors with write-back of dirty sectors.
+ */
+typedef struct {
+    int       fd;                /* The disk image. */
+    ssize_t   (*read)(void *source, void *buf, size_t length, off_t offset);  /* Reads sectors in place of pread if set. */
+    ssize_t   (*write)(void *source, const void *buf, size_t length, off_t offset);  /* Writes sectors in place of pwrite if set. */
+    void      *source;           /* What read and write go to. */
+    uint32_t  block_size;        /* The number of bytes per sector. */
+    int       capacity;          /* The number of blocks. */
+    block_t   *blocks;
+    block_t   **buckets;
+    uint32_t  bucket_mask;
+    block_t   *head;             /* Most recently used. */
+    block_t   *tail;             /* Least recently used. */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writebacks;
+} cache_t;
+
+#define CACHE_DEFAULT 64         /* Blocks per cache unless SFS_CACHE says otherwise. */
+#define CACHE_PREFETCH 8         /* The most sectors cache_prefetch reads at once. */
+
+cache_t *cache_create(int fd, uint32_t block_size, int capacity);
+const char *cache_read(cache_t *cache, uint32_t sector);
+int cache_has(cache_t *cache, uint32_t sector);
+void cache_prefetch(cache_t *cache, uint32_t sector, int count);
+int cache_write(cache_t *cache, uint32_t sector, uint32_t offset, const void *data, uint32_t length);
+int cache_flush(cache_t *cache);
+void cache_discard(cache_t *cache, uint32_t sector, int count);
+void cache_stats(cache_t *cache, FILE *out);
+void cache_destroy(cache_t *cache);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "sfs.h"
+#include "volume.h"
+
+/*
+ * Checks of the sector cache against the data paths that bypass it. Each
+ * check works on a fresh copy of an image and exits with -1 on a failure.
+ */
+
+/**
+ * Function:  copy_image
+ * --------------------
+ * @brief copy a disk image to a scratch file.
+ *
+ */
+void copy_image(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    char buf[4096];
+    size_t n;
+
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "Failed to copy %s to %s\n", from, to);
+        exit(-1);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+/**
+ * Function:  check_reuse_freed_dir
+ * --------------------
+ * @brief a directory cluster is written through the cache and freed, then
+ *        taken again for file data written straight to the image, as
+ *        disksync does when a host directory turns into a file. The dirty
+ *        directory sector must not be written back over the data.
+ *
+ * @return 0 if the data survives the close, -1 if not.
+ *
+ */
+int check_reuse_freed_dir(const char *image) {
+    volume_t *vol = vol_open(image, 1);
+    uint16_t cluster = 2;
+    uint32_t size;
+    char *data, *back;
+    int ret;
+
+    if (vol == NULL) {
+        fprintf(stderr, "Failed to open %s\n", image);
+        exit(-1);
+    }
+    while (cluster < vol->fat_size && vol_get_fat(vol, cluster) != 0) {
+        cluster++;
+    }
+    size = vol->cluster_size;
+    data = emalloc(size);
+    back = emalloc(size);
+    memset(data, 0xE5, size);
+    off_t offset = vol_cluster_offset(vol, cluster);
+
+    // a directory in the cluster, with its first entry marked deleted
+    vol_set_fat(vol, cluster, 0xFFF);
+    vol_write(vol, offset, data, 32);
+    vol_set_fat(vol, cluster, 0x000);
+
+    // the cluster taken again for a file, whose data skips the cache
+    vol_set_fat(vol, cluster, 0xFFF);
+    memset(data, 'd', size);
+    if (pwrite(vol->fd, data, size, offset) != (ssize_t)size) {
+        fprintf(stderr, "Failed to write %s\n", image);
+        exit(-1);
+    }
+    vol_close(vol);
+
+    FILE *fp = fopen(image, "rb");
+    fseek(fp, offset, SEEK_SET);
+    ret = fread(back, size, 1, fp) == 1 && memcmp(data, back, size) == 0 ? 0 : -1;
+    fclose(fp);
+    free(data);
+    free(back);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *image = argc > 1 ? argv[1] : "disk.IMA";
+    char scratch[] = "/tmp/cachetestXXXXXX";
+    int fd = mkstemp(scratch), failed = 0;
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create a scratch image\n");
+        exit(-1);
+    }
+    close(fd);
+
+    copy_image(image, scratch);
+    if (check_reuse_freed_dir(scratch) != 0) {
+        printf("FAIL reuse of a freed directory cluster for file data\n");
+        failed++;
+    } else {
+        printf("ok   reuse of a freed directory cluster for file data\n");
+    }
+
+    unlink(scratch);
+    return failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,125 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42 1
+#else
+#define HAVE_SSE42 0
+#endif
+
+/*
+ * Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero
+ * bytes, so eight bytes are folded in with eight lookups and no carried
+ * dependency between them.
+ */
+static uint32_t table[8][256];
+
+/**
+ * Function:  crc32c_sw
+ * --------------------
+ * @brief CRC32C of a buffer, eight bytes per step with slicing-by-8.
+ *
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t length) {
+    while (length > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+    while (length >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if HAVE_SSE42
+/**
+ * Function:  crc32c_hw
+ * --------------------
+ * @brief CRC32C of a buffer with the SSE4.2 crc32 instruction, eight bytes
+ *        per instruction.
+ *
+ */
+__attribute__ ((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t length) {
+    uint64_t crc64;
+
+    while (length > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+    crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t length) = crc32c_sw;
+
+/**
+ * Function:  crc32c_init
+ * --------------------
+ * @brief build the slicing-by-8 tables and pick the crc32 instruction when
+ *        the CPU has it. Runs before main, so threads never race on it.
+ *
+ */
+__attribute__ ((constructor))
+static void crc32c_init(void) {
+    uint32_t crc;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            table[k][i] = table[0][table[k - 1][i] & 0xFF] ^ (table[k - 1][i] >> 8);
+        }
+    }
+#if HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+/**
+ * Function:  crc32c
+ * --------------------
+ * @brief compute the CRC32C (Castagnoli) of a buffer, continuing from a
+ *        previous value so a stream can be checksummed piece by piece.
+ *
+ * @param crc: 0 to start, or the value returned for the bytes before.
+ * @param buf: the bytes.
+ * @param length: the number of bytes.
+ *
+ * @return The CRC32C of everything so far.
+ *
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t length) {
+    return ~crc32c_impl(~crc, buf, length);
+}
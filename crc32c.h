@@ -0,0 +1,10 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_POLY 0x82F63B78   /* Castagnoli polynomial, bit-reversed. */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t length);
+
+#endif
@@ -0,0 +1,752 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dir.h"
+#include "emalloc.h"
+#include "readahead.h"
+
+/**
+ * Function:  short_checksum
+ * --------------------
+ * @brief compute the checksum stored in every long name slot, which ties
+ *        the slots to their short entry.
+ *
+ * @param short_name: the 11 bytes of the 8.3 name, padded with spaces.
+ *
+ */
+uint8_t short_checksum(const char *short_name) {
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+    }
+    return sum;
+}
+
+/**
+ * Function:  format_short_name
+ * --------------------
+ * @brief turn the padded 8.3 name of an entry into NAME.EXT.
+ *
+ */
+static void format_short_name(const entry_t *entry, char *name) {
+    int i, j = 0;
+
+    for (i = 0; i < 8; i++)
+        if (entry->filename[i] != 0x20)
+            name[j++] = entry->filename[i];
+    if ((uint8_t)name[0] == 0x05) {
+        name[0] = (char)0xE5;   // a name really starting with 0xE5 is stored as 0x05
+    }
+
+    // if the file has an extension
+    if (entry->extension[0] != 0x20) {
+        name[j++] = '.';
+        for (i = 0; i < 3; i++)
+            if (entry->extension[i] != 0x20)
+                name[j++] = entry->extension[i];
+    }
+    name[j] = '\0';
+}
+
+/**
+ * Function:  ucs2_to_utf8
+ * --------------------
+ * @brief convert a long name to UTF-8. It ends at its first 0x0000 or
+ *        0xFFFF padding character.
+ *
+ */
+static void ucs2_to_utf8(const uint16_t *chars, int length, char *out) {
+    int i;
+
+    for (i = 0; i < length && chars[i] != 0x0000 && chars[i] != 0xFFFF; i++) {
+        uint16_t c = chars[i];
+        if (c < 0x80) {
+            *out++ = c;
+        } else if (c < 0x800) {
+            *out++ = 0xC0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3F);
+        } else {
+            *out++ = 0xE0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3F);
+            *out++ = 0x80 | (c & 0x3F);
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * Function:  utf8_to_ucs2
+ * --------------------
+ * @brief convert a UTF-8 name to the UCS-2 characters of a long name.
+ *        Characters outside the Basic Multilingual Plane become '_'.
+ *
+ * @return The number of characters, or -1 if there are more than max.
+ *
+ */
+static int utf8_to_ucs2(const char *name, uint16_t *chars, int max) {
+    const uint8_t *p = (const uint8_t *)name;
+    int n = 0;
+
+    while (*p != '\0') {
+        uint32_t c = *p++;
+        int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+
+        c &= more == 3 ? 0x07 : more == 2 ? 0x0F : more == 1 ? 0x1F : 0x7F;
+        for (; more > 0 && (*p & 0xC0) == 0x80; more--) {
+            c = (c << 6) | (*p++ & 0x3F);
+        }
+        if (n == max) {
+            return -1;
+        }
+        chars[n++] = c > 0xFFFF ? '_' : c;
+    }
+    return n;
+}
+
+/**
+ * Function:  collect_lfn
+ * --------------------
+ * @brief add a long name slot to the name being collected. Slots come last
+ *        first; one out of sequence drops what was collected so far.
+ *
+ * @param slot: the slot.
+ * @param address: where the slot is stored.
+ *
+ */
+static void collect_lfn(dir_t *dir, const lfn_t *slot, off_t address) {
+    int n = slot->order & 0x1F;
+
+    if (slot->order & 0x40) {   // the last slot starts a new name
+        if (n < 1 || n > DIR_LFN_SLOTS) {
+            dir->lfn_slots = 0;
+            return;
+        }
+        dir->lfn_slots = 0;
+        dir->lfn_next = n;
+        dir->lfn_length = n * 13;
+        dir->lfn_checksum = slot->checksum;
+    } else if (dir->lfn_slots == 0 || n != dir->lfn_next || slot->checksum != dir->lfn_checksum) {
+        dir->lfn_slots = 0;     // orphaned slot
+        return;
+    }
+
+    uint16_t *chars = dir->lfn + (n - 1) * 13;
+    memcpy(chars, slot->name1, sizeof(slot->name1));
+    memcpy(chars + 5, slot->name2, sizeof(slot->name2));
+    memcpy(chars + 11, slot->name3, sizeof(slot->name3));
+    dir->lfn_address[dir->lfn_slots++] = address;
+    dir->lfn_next = n - 1;
+}
+
+/**
+ * Function:  dir_open
+ * --------------------
+ * @brief start reading a directory. The clusters of a subdirectory are
+ *        hinted to the kernel a readahead window at a time as the read
+ *        goes along.
+ *
+ * @param dir: the reader to set up.
+ * @param vol: the disk.
+ * @param dir_cluster: the first cluster of the directory, 0 for the root directory.
+ *
+ */
+void dir_open(dir_t *dir, volume_t *vol, uint16_t dir_cluster) {
+    dir->vol = vol;
+    dir->cluster = dir_cluster;
+    dir->sector = vol_dir_start(vol, dir_cluster);
+    dir->buf = emalloc(vol->bytes_per_sector);
+    dir->window = readahead_window();
+    dir->walked = 0;
+    dir->lfn_slots = 0;
+    dir->scan_next = 0;
+    dir->pending = 0;
+
+    vol_hint_dir(vol, dir_cluster, dir->window);
+    memcpy(dir->buf, vol_read_sector(vol, dir->sector), vol->bytes_per_sector);
+}
+
+/**
+ * Function:  dir_read
+ * --------------------
+ * @brief get the next live entry of a directory. Free entries and long
+ *        name slots are skipped; the long name is attached to the entry.
+ *        The . and .. entries and the volume label are returned as well.
+ *
+ * @param dir: the reader.
+ * @param out: the entry.
+ *
+ * @return 1 if an entry was read, 0 at the end of the directory.
+ *
+ */
+int dir_read(dir_t *dir, dir_entry_t *out) {
+    volume_t *vol = dir->vol;
+
+    while (dir->sector != 0) {
+        if (dir->pending == 0) {
+            uint32_t per_sector = vol->bytes_per_sector / sizeof(entry_t);
+            if (dir->scan_next == per_sector) {
+                uint16_t prev_cluster = dir->cluster;
+                dir->sector = vol_dir_next(vol, &dir->cluster, dir->sector);
+                dir->scan_next = 0;
+                if (dir->sector == 0) {
+                    break;
+                }
+                if (dir->cluster != prev_cluster && ++dir->walked == dir->window) {   // slide the readahead window forward
+                    vol_hint_dir(vol, dir->cluster, dir->window);
+                    dir->walked = 0;
+                }
+                memcpy(dir->buf, vol_read_sector(vol, dir->sector), vol->bytes_per_sector);
+            }
+
+            // classify the next run of entries at once; only the ones that matter are visited
+            uint32_t count = per_sector - dir->scan_next < DIRSCAN_MAX ? per_sector - dir->scan_next : DIRSCAN_MAX;
+            dirscan_t *scan = &dir->scan;
+            dirscan(dir->buf + dir->scan_next * sizeof(entry_t), count, scan);
+            dir->scan_base = dir->scan_next;
+            dir->scan_next += count;
+            // a deleted entry only matters if it orphans long name slots in front of it
+            uint64_t orphaning = scan->deleted & ((scan->lfn << 1) | 1);
+            dir->pending = ((scan->lfn | scan->live | orphaning) & dirscan_before_end(scan)) | (scan->end & -scan->end);
+            continue;
+        }
+
+        int bit = __builtin_ctzll(dir->pending);
+        uint64_t kind = dir->pending & -dir->pending;
+        uint32_t offset = (dir->scan_base + bit) * sizeof(entry_t);
+        dir->pending &= dir->pending - 1;
+
+        const char *raw = dir->buf + offset;
+        off_t address = (off_t)dir->sector * vol->bytes_per_sector + offset;
+
+        if (dir->scan.end & kind) {
+            dir->sector = 0;
+            break; // free entry & no more
+        }
+        if (dir->scan.deleted & kind) {
+            dir->lfn_slots = 0;
+            continue; // this entry is free
+        }
+        if (dir->scan.lfn & kind) {
+            collect_lfn(dir, (const lfn_t *)raw, address);
+            continue; // long file name slot
+        }
+
+        memcpy(&out->entry, raw, sizeof(entry_t));
+        out->address = address;
+        format_short_name(&out->entry, out->short_name);
+        out->lfn_slots = 0;
+        if (dir->lfn_slots > 0 && dir->lfn_next == 0 && dir->lfn_checksum == short_checksum(raw)) {
+            ucs2_to_utf8(dir->lfn, dir->lfn_length < DIR_NAME_MAX ? dir->lfn_length : DIR_NAME_MAX, out->name);
+            out->lfn_slots = dir->lfn_slots;
+            memcpy(out->lfn_address, dir->lfn_address, dir->lfn_slots * sizeof(off_t));
+        } else {
+            strcpy(out->name, out->short_name);
+        }
+        dir->lfn_slots = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Function:  dir_close
+ * --------------------
+ * @brief release a directory reader.
+ *
+ */
+void dir_close(dir_t *dir) {
+    free(dir->buf);
+}
+
+/**
+ * Function:  dir_match
+ * --------------------
+ * @brief check if an entry goes by a name, long or short, ignoring case.
+ *        Most names differ in their first few letters, where the compare
+ *        stops, so nothing is computed per entry ahead of it.
+ *
+ * @param e: the entry.
+ * @param name: the name to look for.
+ *
+ */
+int dir_match(const dir_entry_t *e, const char *name) {
+    return strcasecmp(e->name, name) == 0 ||
+           (e->lfn_slots > 0 && strcasecmp(e->short_name, name) == 0);
+}
+
+/**
+ * Function:  dir_find
+ * --------------------
+ * @brief look up a file or directory by name, long or short, ignoring case.
+ *
+ * @param vol: the disk.
+ * @param dir_cluster: the first cluster of the directory, 0 for the root directory.
+ * @param name: the name to look for.
+ * @param out: the entry found.
+ *
+ * @return 1 if found, 0 if not.
+ *
+ */
+int dir_find(volume_t *vol, uint16_t dir_cluster, const char *name, dir_entry_t *out) {
+    dir_t dir;
+
+    dir_open(&dir, vol, dir_cluster);
+    while (dir_read(&dir, out)) {
+        if ((out->entry.attributes & 0x08) || out->short_name[0] == '.') {
+            continue; // the volume label and . & .. entries
+        }
+        if (dir_match(out, name)) {
+            dir_close(&dir);
+            return 1;
+        }
+    }
+    dir_close(&dir);
+    return 0;
+}
+
+/**
+ * Function:  dir_resolve
+ * --------------------
+ * @brief look up a file or directory by its path from the root directory,
+ *        e.g. SUB1/SUB2/C.DAT. Each component is matched as by dir_find.
+ *
+ * @param vol: the disk.
+ * @param path: the path; leading, trailing and repeated '/' are ignored.
+ * @param out: the entry found.
+ *
+ * @return 1 if found, 0 if not or if the path names the root directory.
+ *
+ */
+int dir_resolve(volume_t *vol, const char *path, dir_entry_t *out) {
+    char name[DIR_NAME_MAX * 3 + 1];
+    uint16_t dir_cluster = 0;
+    int found = 0;
+
+    while (*path != '\0') {
+        size_t length = strcspn(path, "/");
+        if (length == 0) {
+            path++;
+            continue;
+        }
+        if (length >= sizeof(name) || (found && !(out->entry.attributes & 0x10))) {
+            return 0; // too long, or a file in the middle of the path
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        if (!dir_find(vol, dir_cluster, name, out)) {
+            return 0;
+        }
+        found = 1;
+        dir_cluster = out->entry.cluster;
+        path += length;
+    }
+    return found;
+}
+
+/**
+ * Function:  dir_free_slots
+ * --------------------
+ * @brief find a run of consecutive free entries in a directory, for a short
+ *        entry and the long name slots in front of it. The run may cross
+ *        sectors and clusters, so each slot gets its own address.
+ *
+ * @param vol: the disk.
+ * @param dir_cluster: the first cluster of the directory, 0 for the root directory.
+ * @param count: the number of entries needed.
+ * @param addresses: where the entries of the run are stored, in order.
+ *
+ * @return 0 on success, -1 if the directory has no such run.
+ *
+ */
+int dir_free_slots(volume_t *vol, uint16_t dir_cluster, int count, off_t *addresses) {
+    uint16_t local_dir_cluster = dir_cluster;
+    uint32_t sector;
+    uint32_t j;
+    int run = 0;
+    int end = 0;
+
+    for (sector = vol_dir_start(vol, dir_cluster); sector != 0; sector = vol_dir_next(vol, &local_dir_cluster, sector)) {
+        const char *buf = vol_read_sector(vol, sector);
+        for (j = 0; j < vol->bytes_per_sector; j += DIRSCAN_MAX * sizeof(entry_t)) {
+            int entries = (vol->bytes_per_sector - j) / sizeof(entry_t);
+            dirscan_t scan;
+            uint64_t free_mask;
+            int i;
+
+            entries = entries < DIRSCAN_MAX ? entries : DIRSCAN_MAX;
+            dirscan(buf + j, entries, &scan);
+            free_mask = scan.deleted;
+            if (end || scan.end != 0) {
+                free_mask |= end ? ~(uint64_t)0 : ~dirscan_before_end(&scan);
+                end = 1; // free entry & no more, everything after it is free too
+            }
+            if (free_mask == 0) {
+                run = 0;
+                continue;
+            }
+            for (i = 0; i < entries; i++) {
+                if (free_mask & ((uint64_t)1 << i)) {
+                    addresses[run++] = (off_t)sector * vol->bytes_per_sector + j + i * sizeof(entry_t);
+                    if (run == count) {
+                        return 0;
+                    }
+                } else {
+                    run = 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Function:  dir_grow
+ * --------------------
+ * @brief add zeroed clusters to the end of a subdirectory's chain. A
+ *        directory grows by as many clusters as it already has, up to
+ *        DIR_GROW_MAX, so filling a big directory takes few FAT updates.
+ *        The root directory of FAT12 has a fixed size and can't grow.
+ *
+ * @param vol: the disk.
+ * @param dir_cluster: the first cluster of the directory.
+ * @param count: the number of entries that must fit in the new clusters.
+ * @param reserve: the number of free clusters to leave for other use.
+ *
+ * @return 0 on success, -1 if there isn't enough free space.
+ *
+ */
+int dir_grow(volume_t *vol, uint16_t dir_cluster, int count, int reserve) {
+    int per_cluster = vol->cluster_size / sizeof(entry_t);
+    int needed = (count + per_cluster - 1) / per_cluster;
+    int spare = vol_free_clusters(vol) - reserve;
+    uint16_t last = dir_cluster, next, cluster = 2;
+    int length = 1, grow, i;
+
+    if (dir_cluster < 2 || spare < needed) {
+        return -1;
+    }
+    while ((next = vol_get_fat(vol, last)) >= 2 && next < 0x0FF8 && length < vol->fat_size) {
+        last = next;
+        length++;
+    }
+    grow = length < DIR_GROW_MAX ? length : DIR_GROW_MAX;
+    grow = grow < needed ? needed : grow > spare ? spare : grow;
+
+    char *zero = emalloc(vol->cluster_size);
+    memset(zero, 0, vol->cluster_size);
+    for (i = 0; i < grow; i++) {
+        cluster = vol_find_free(vol, cluster);
+        if (vol_write(vol, vol_cluster_offset(vol, cluster), zero, vol->cluster_size) != 0) {
+            free(zero);
+            return -1;
+        }
+        vol_set_fat(vol, last, cluster);
+        vol_set_fat(vol, cluster, 0xFFF);   // end of chain until the next link is made
+        last = cluster++;
+    }
+    free(zero);
+    return 0;
+}
+
+/**
+ * Function:  short_char
+ * --------------------
+ * @brief check if a character may appear in an 8.3 name as it is.
+ *
+ */
+static int short_char(int c) {
+    return isalnum(c) || (c != '\0' && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+/**
+ * Function:  make_alias
+ * --------------------
+ * @brief write NAME~N over the 8 name bytes of a short name, cutting the
+ *        basis so the tail fits.
+ *
+ */
+static void make_alias(const char *base, int base_length, int n, char *short_name) {
+    char tail[8];
+    int tail_length = snprintf(tail, sizeof(tail), "~%d", n);
+    int keep = base_length < 8 - tail_length ? base_length : 8 - tail_length;
+
+    memset(short_name, ' ', 8);
+    memcpy(short_name, base, keep);
+    memcpy(short_name + keep, tail, tail_length);
+}
+
+/**
+ * Function:  used_aliases
+ * --------------------
+ * @brief mark the N of every NAME~N.EXT alias of this basis and extension
+ *        already in a directory, in one pass over it.
+ *
+ * @param used: DIR_ALIAS_MAX + 1 bits, cleared by the caller.
+ *
+ */
+static void used_aliases(volume_t *vol, uint16_t dir_cluster, const char *base, int base_length,
+                         const char *short_name, uint8_t *used) {
+    char alias[11];
+    dir_entry_t e;
+    dir_t dir;
+
+    memcpy(alias + 8, short_name + 8, 3);
+    dir_open(&dir, vol, dir_cluster);
+    while (dir_read(&dir, &e)) {
+        const char *tilde = memchr(e.entry.filename, '~', 8);
+        int n = 0, i;
+
+        if (tilde == NULL || memcmp(e.entry.extension, short_name + 8, 3) != 0) {
+            continue;
+        }
+        for (i = tilde - e.entry.filename + 1; i < 8 && isdigit((uint8_t)e.entry.filename[i]); i++) {
+            n = n * 10 + e.entry.filename[i] - '0';
+        }
+        if (n < 1 || n > DIR_ALIAS_MAX) {
+            continue;
+        }
+        // the alias this basis would get for n, so ~01 or another basis doesn't count
+        make_alias(base, base_length, n, alias);
+        if (dirscan_name_equal(e.entry.filename, alias)) {
+            used[n / 8] |= 1 << (n % 8);
+        }
+    }
+    dir_close(&dir);
+}
+
+/**
+ * Function:  dir_short_name
+ * --------------------
+ * @brief make the 8.3 name of a new entry. A name that fits 8.3 once in
+ *        uppercase is stored as it is; any other name gets a NAME~N.EXT
+ *        alias not yet used in the directory, and needs a long name.
+ *
+ * @param vol: the disk.
+ * @param dir_cluster: the directory the entry goes into, 0 for the root directory.
+ * @param name: the name of the new entry.
+ * @param short_name: 11 bytes for the 8.3 name, padded with spaces.
+ *
+ * @return 0 if the 8.3 name is enough, 1 if a long name is needed, -1 if
+ *         every alias of the name is taken.
+ *
+ */
+int dir_short_name(volume_t *vol, uint16_t dir_cluster, const char *name, char *short_name) {
+    const char *dot = strrchr(name, '.');
+    int base_length = dot != NULL ? dot - name : strlen(name);
+    int ext_length = dot != NULL ? strlen(dot + 1) : 0;
+    int fits = base_length >= 1 && base_length <= 8 && ext_length <= 3 &&
+               (dot == NULL || (ext_length > 0 && strchr(name, '.') == dot));
+    char base[8];
+    uint8_t *used;
+    int i, j, n;
+
+    memset(short_name, ' ', 11);
+    for (i = 0; fits && name[i] != '\0'; i++) {
+        fits = name[i] == '.' || short_char((uint8_t)name[i]);
+    }
+    if (fits) {
+        for (i = 0; i < base_length; i++) {
+            short_name[i] = toupper((uint8_t)name[i]);
+        }
+        for (i = 0; i < ext_length; i++) {
+            short_name[8 + i] = toupper((uint8_t)dot[1 + i]);
+        }
+        return 0;
+    }
+
+    // leading dots don't count, and a dot there doesn't start the extension
+    while (*name == '.') {
+        name++;
+    }
+    if (dot != NULL && dot < name) {
+        dot = NULL;
+    }
+
+    // the basis: uppercase, without spaces and dots, other odd characters as '_'
+    for (i = 0, j = 0; name[i] != '\0' && name + i != dot && j < 8; i++) {
+        int c = (uint8_t)name[i];
+        if (c == ' ' || c == '.') {
+            continue;
+        }
+        base[j++] = short_char(c) ? toupper(c) : '_';
+    }
+    if (j == 0) {
+        base[j++] = '_';
+    }
+    for (i = 0, n = 0; dot != NULL && dot[1 + i] != '\0' && n < 3; i++) {
+        int c = (uint8_t)dot[1 + i];
+        if (c != ' ') {
+            short_name[8 + n++] = short_char(c) ? toupper(c) : '_';
+        }
+    }
+
+    // the first NAME~N not taken yet
+    used = emalloc(DIR_ALIAS_MAX / 8 + 1);
+    memset(used, 0, DIR_ALIAS_MAX / 8 + 1);
+    used_aliases(vol, dir_cluster, base, j, short_name, used);
+    n = 1;
+    while (n <= DIR_ALIAS_MAX && (used[n / 8] & (1 << (n % 8)))) {
+        n++;
+    }
+    free(used);
+    if (n > DIR_ALIAS_MAX) {
+        return -1;
+    }
+    make_alias(base, j, n, short_name);
+    return 1;
+}
+
+/**
+ * Function:  dir_make_lfn
+ * --------------------
+ * @brief build the long name slots of a new entry, in the order they are
+ *        stored: the last part of the name first.
+ *
+ * @param name: the long name in UTF-8.
+ * @param short_name: the 11 bytes of the 8.3 alias of the entry.
+ * @param slots: room for DIR_LFN_SLOTS slots.
+ *
+ * @return The number of slots, or -1 if the name is too long.
+ *
+ */
+int dir_make_lfn(const char *name, const char *short_name, lfn_t *slots) {
+    uint16_t chars[DIR_LFN_SLOTS * 13];
+    uint8_t checksum = short_checksum(short_name);
+    int length = utf8_to_ucs2(name, chars, DIR_NAME_MAX);
+    int count, i;
+
+    if (length <= 0) {
+        return -1;
+    }
+    count = (length + 12) / 13;
+    // a name that doesn't fill its last slot ends with 0x0000, then 0xFFFF padding
+    for (i = length; i < count * 13; i++) {
+        chars[i] = i == length ? 0x0000 : 0xFFFF;
+    }
+
+    for (i = 0; i < count; i++) {
+        int n = count - i;
+        lfn_t *slot = &slots[i];
+        const uint16_t *part = chars + (n - 1) * 13;
+
+        memset(slot, 0, sizeof(lfn_t));
+        slot->order = n | (i == 0 ? 0x40 : 0);
+        slot->attributes = 0x0F;
+        slot->checksum = checksum;
+        memcpy(slot->name1, part, sizeof(slot->name1));
+        memcpy(slot->name2, part + 5, sizeof(slot->name2));
+        memcpy(slot->name3, part + 11, sizeof(slot->name3));
+    }
+    return count;
+}
+
+/**
+ * Function:  dir_add
+ * --------------------
+ * @brief add an entry to a directory under a given name. The 8.3 name of
+ *        the entry is made from it, with long name slots in front when it
+ *        doesn't fit, and a full subdirectory grows to make room.
+ *
+ * @param vol: the disk.
+ * @param dir_cluster: the first cluster of the directory, 0 for the root directory.
+ * @param name: the name of the new entry.
+ * @param entry: the new entry, filled in but for its 8.3 name, which is set here.
+ * @param reserve: the number of free clusters the directory must not grow into.
+ *
+ * @return 0 on success, -1 if the directory is full or every alias of the
+ *         name is taken.
+ *
+ */
+int dir_add(volume_t *vol, uint16_t dir_cluster, const char *name, entry_t *entry, int reserve) {
+    char short_name[11];
+    lfn_t slots[DIR_LFN_SLOTS];
+    off_t addresses[DIR_LFN_SLOTS + 1];
+    int slot_count = 0, i;
+    int long_name = dir_short_name(vol, dir_cluster, name, short_name);
+
+    if (long_name < 0 || (long_name && (slot_count = dir_make_lfn(name, short_name, slots)) < 0)) {
+        return -1;
+    }
+    if (dir_free_slots(vol, dir_cluster, slot_count + 1, addresses) != 0 &&
+        (dir_cluster == 0 || dir_grow(vol, dir_cluster, slot_count + 1, reserve) != 0 ||
+         dir_free_slots(vol, dir_cluster, slot_count + 1, addresses) != 0)) {
+        return -1;
+    }
+
+    memcpy(entry->filename, short_name, 8);
+    memcpy(entry->extension, short_name + 8, 3);
+    for (i = 0; i < slot_count; i++) {
+        vol_write(vol, addresses[i], &slots[i], sizeof(lfn_t));
+    }
+    return vol_write(vol, addresses[slot_count], entry, sizeof(entry_t));
+}
+
+/**
+ * Function:  dir_remove
+ * --------------------
+ * @brief mark an entry and its long name slots free. Its clusters are left
+ *        to the caller.
+ *
+ * @param vol: the disk.
+ * @param e: the entry.
+ *
+ */
+void dir_remove(volume_t *vol, const dir_entry_t *e) {
+    uint8_t free_mark = 0xE5;
+    int i;
+
+    for (i = 0; i < e->lfn_slots; i++) {
+        vol_write(vol, e->lfn_address[i], &free_mark, 1);
+    }
+    vol_write(vol, e->address, &free_mark, 1);
+}
+
+/**
+ * Function:  dir_mkdir
+ * --------------------
+ * @brief create an empty subdirectory with its . and .. entries.
+ *
+ * @param vol: the disk.
+ * @param parent: the first cluster of the parent directory, 0 for the root directory.
+ * @param name: the name of the new directory.
+ * @param entry: the new entry, with its times filled in.
+ *
+ * @return The first cluster of the new directory, or 0 if there is no room.
+ *
+ */
+uint16_t dir_mkdir(volume_t *vol, uint16_t parent, const char *name, entry_t *entry) {
+    uint16_t *chain = vol_alloc_chain(vol, 1);
+    uint16_t cluster;
+    entry_t dot;
+
+    if (chain == NULL) {
+        return 0;
+    }
+    cluster = chain[0];
+    free(chain);
+
+    char *zero = emalloc(vol->cluster_size);
+    memset(zero, 0, vol->cluster_size);
+    vol_write(vol, vol_cluster_offset(vol, cluster), zero, vol->cluster_size);
+    free(zero);
+
+    entry->attributes = 0x10;
+    entry->cluster = cluster;
+    entry->size = 0;
+    dot = *entry;
+    memcpy(dot.filename, ".       ", 8);
+    memcpy(dot.extension, "   ", 3);
+    vol_write(vol, vol_cluster_offset(vol, cluster), &dot, sizeof(entry_t));
+    memcpy(dot.filename, "..      ", 8);
+    dot.cluster = parent;
+    vol_write(vol, vol_cluster_offset(vol, cluster) + sizeof(entry_t), &dot, sizeof(entry_t));
+
+    if (dir_add(vol, parent, name, entry, 0) != 0) {
+        vol_set_fat(vol, cluster, 0x000);
+        return 0;
+    }
+    return cluster;
+}
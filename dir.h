@@ -0,0 +1,66 @@
+#ifndef _DIR_H_
+#define _DIR_H_
+#include <stdint.h>
+#include <sys/types.h>
+#include "dirscan.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define DIR_NAME_MAX  255        /* The longest long name, in characters. */
+#define DIR_LFN_SLOTS 20         /* The most slots a long name can take. */
+#define DIR_GROW_MAX  16         /* The most clusters a directory grows by at once. */
+#define DIR_ALIAS_MAX 999999     /* The highest N of a NAME~N.EXT alias, the most the 8 bytes hold. */
+
+/*
+ * One live directory entry with its names resolved.
+ */
+typedef struct {
+    entry_t   entry;             /* The short entry. */
+    char      name[DIR_NAME_MAX * 3 + 1];  /* The long name in UTF-8, or the short name if there is none. */
+    char      short_name[13];    /* The 8.3 name as NAME.EXT. */
+    off_t     address;           /* Where the short entry is stored. */
+    off_t     lfn_address[DIR_LFN_SLOTS];  /* Where each long name slot is stored, in order on disk. */
+    int       lfn_slots;         /* The number of long name slots, 0 if none. */
+} dir_entry_t;
+
+/*
+ * A directory being read entry by entry. Long name slots are collected as
+ * they go by and attached to the short entry that follows them.
+ */
+typedef struct {
+    volume_t  *vol;
+    uint16_t  cluster;           /* The cluster being read, 0 for the root directory. */
+    uint32_t  sector;            /* The sector being read, 0 at the end. */
+    char      *buf;              /* Copy of the sector being read. */
+    dirscan_t scan;              /* Kinds of the run of entries of buf scanned last. */
+    uint32_t  scan_base;         /* The first entry of the run. */
+    uint32_t  scan_next;         /* The entry after the run. */
+    uint64_t  pending;           /* Entries of the run still to visit. */
+    int       window;            /* Readahead window in clusters. */
+    int       walked;            /* Clusters walked since the last hint. */
+    uint16_t  lfn[DIR_LFN_SLOTS * 13];  /* UCS-2 long name collected so far. */
+    off_t     lfn_address[DIR_LFN_SLOTS];
+    int       lfn_slots;         /* Slots collected, 0 if none. */
+    int       lfn_next;          /* The slot number expected next. */
+    int       lfn_length;        /* Characters the long name can hold. */
+    uint8_t   lfn_checksum;
+} dir_t;
+
+uint8_t short_checksum(const char *short_name);
+
+void dir_open(dir_t *dir, volume_t *vol, uint16_t dir_cluster);
+int dir_read(dir_t *dir, dir_entry_t *out);
+void dir_close(dir_t *dir);
+
+int dir_match(const dir_entry_t *e, const char *name);
+int dir_find(volume_t *vol, uint16_t dir_cluster, const char *name, dir_entry_t *out);
+int dir_resolve(volume_t *vol, const char *path, dir_entry_t *out);
+int dir_free_slots(volume_t *vol, uint16_t dir_cluster, int count, off_t *addresses);
+int dir_grow(volume_t *vol, uint16_t dir_cluster, int count, int reserve);
+int dir_short_name(volume_t *vol, uint16_t dir_cluster, const char *name, char *short_name);
+int dir_make_lfn(const char *name, const char *short_name, lfn_t *slots);
+int dir_add(volume_t *vol, uint16_t dir_cluster, const char *name, entry_t *entry, int reserve);
+void dir_remove(volume_t *vol, const dir_entry_t *e);
+uint16_t dir_mkdir(volume_t *vol, uint16_t parent, const char *name, entry_t *entry);
+
+#endif
@@ -0,0 +1,221 @@
+#include <string.h>
+#include "dirscan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD 1
+#else
+#define HAVE_SIMD 0
+#endif
+
+/*
+ * What the kernels find: one bit per entry for each test of the first
+ * byte and of the attributes, before they are combined into kinds.
+ */
+typedef struct {
+    uint64_t  zero;              /* First byte 0x00. */
+    uint64_t  e5;                /* First byte 0xE5. */
+    uint64_t  dot;               /* First byte 0x2E. */
+    uint64_t  lfn;               /* Attributes exactly 0x0F. */
+    uint64_t  dir;               /* Attribute 0x10 set. */
+    uint64_t  label;             /* Attribute 0x08 set. */
+} raw_t;
+
+/**
+ * Function:  raw_scalar
+ * --------------------
+ * @brief test the entries from first to count one at a time.
+ *
+ */
+static void raw_scalar(const unsigned char *buf, int first, int count, raw_t *raw) {
+    raw_t r = *raw;     // kept in registers, the buffer may alias anything
+    int i;
+
+    for (i = first; i < count; i++) {
+        const unsigned char *p = buf + i * 32;
+        uint64_t bit = (uint64_t)1 << i;
+        r.zero |= p[0] == 0x00 ? bit : 0;
+        r.e5 |= p[0] == 0xE5 ? bit : 0;
+        r.dot |= p[0] == 0x2E ? bit : 0;
+        r.lfn |= p[11] == 0x0F ? bit : 0;
+        r.dir |= p[11] & 0x10 ? bit : 0;
+        r.label |= p[11] & 0x08 ? bit : 0;
+    }
+    *raw = r;
+}
+
+#if HAVE_SIMD
+/**
+ * Function:  raw_bytes
+ * --------------------
+ * @brief test sixteen entries from the vectors of their first bytes and
+ *        of their attributes, one byte per entry, in order.
+ *
+ */
+static inline void raw_bytes(__m128i first, __m128i attr, int i, raw_t *r) {
+    const __m128i dir = _mm_set1_epi8(0x10), label = _mm_set1_epi8(0x08);
+
+#define MASK(v) ((uint64_t)(uint16_t)_mm_movemask_epi8(v) << i)
+    r->zero |= MASK(_mm_cmpeq_epi8(first, _mm_setzero_si128()));
+    r->e5 |= MASK(_mm_cmpeq_epi8(first, _mm_set1_epi8((char)0xE5)));
+    r->dot |= MASK(_mm_cmpeq_epi8(first, _mm_set1_epi8(0x2E)));
+    r->lfn |= MASK(_mm_cmpeq_epi8(attr, _mm_set1_epi8(0x0F)));
+    r->dir |= MASK(_mm_cmpeq_epi8(_mm_and_si128(attr, dir), dir));
+    r->label |= MASK(_mm_cmpeq_epi8(_mm_and_si128(attr, label), label));
+#undef MASK
+}
+
+/**
+ * Function:  raw_sse2
+ * --------------------
+ * @brief test sixteen entries per step. The dword at byte 0 and the dword
+ *        at byte 8, whose top byte is the attributes, of four entries at a
+ *        time are brought together with unpacks, then the bytes that matter
+ *        of all sixteen are packed into one vector each.
+ *
+ */
+static void raw_sse2(const unsigned char *buf, int count, raw_t *raw) {
+    const __m128i low = _mm_set1_epi32(0xFF);
+    raw_t r = {0};
+    int i, k;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i first[4], attr[4];
+        for (k = 0; k < 4; k++) {
+            const unsigned char *p = buf + (i + k * 4) * 32;
+            __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 32));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 64));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(p + 96));
+            __m128i lo01 = _mm_unpacklo_epi32(v0, v1), lo23 = _mm_unpacklo_epi32(v2, v3);
+            __m128i hi01 = _mm_unpackhi_epi32(v0, v1), hi23 = _mm_unpackhi_epi32(v2, v3);
+            first[k] = _mm_and_si128(_mm_unpacklo_epi64(lo01, lo23), low);
+            attr[k] = _mm_srli_epi32(_mm_unpacklo_epi64(hi01, hi23), 24);
+        }
+        raw_bytes(_mm_packus_epi16(_mm_packs_epi32(first[0], first[1]), _mm_packs_epi32(first[2], first[3])),
+                  _mm_packus_epi16(_mm_packs_epi32(attr[0], attr[1]), _mm_packs_epi32(attr[2], attr[3])), i, &r);
+    }
+    *raw = r;
+    raw_scalar(buf, i, count, raw);
+}
+
+/**
+ * Function:  raw_avx2
+ * --------------------
+ * @brief test sixteen entries per step as raw_sse2 does, eight at a time:
+ *        entries k and k+4 share a register, one per lane, so the in-lane
+ *        unpacks put all eight in order.
+ *
+ */
+__attribute__ ((target("avx2")))
+static void raw_avx2(const unsigned char *buf, int count, raw_t *raw) {
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    raw_t r = {0};
+    int i, h;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m256i first[2], attr[2];
+        for (h = 0; h < 2; h++) {
+            const unsigned char *p = buf + (i + h * 8) * 32;
+#define PAIR(k) _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + (k) * 32))), \
+                                        _mm_loadu_si128((const __m128i *)(p + ((k) + 4) * 32)), 1)
+            __m256i v0 = PAIR(0), v1 = PAIR(1), v2 = PAIR(2), v3 = PAIR(3);
+#undef PAIR
+            __m256i lo01 = _mm256_unpacklo_epi32(v0, v1), lo23 = _mm256_unpacklo_epi32(v2, v3);
+            __m256i hi01 = _mm256_unpackhi_epi32(v0, v1), hi23 = _mm256_unpackhi_epi32(v2, v3);
+            first[h] = _mm256_and_si256(_mm256_unpacklo_epi64(lo01, lo23), low);
+            attr[h] = _mm256_srli_epi32(_mm256_unpacklo_epi64(hi01, hi23), 24);
+        }
+        // the in-lane packs leave the quarters as 0-3, 8-11, 4-7, 12-15
+        __m256i f = _mm256_permute4x64_epi64(_mm256_packs_epi32(first[0], first[1]), 0xD8);
+        __m256i a = _mm256_permute4x64_epi64(_mm256_packs_epi32(attr[0], attr[1]), 0xD8);
+        raw_bytes(_mm_packus_epi16(_mm256_castsi256_si128(f), _mm256_extracti128_si256(f, 1)),
+                  _mm_packus_epi16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)), i, &r);
+    }
+    *raw = r;
+    _mm256_zeroupper();     // the scalar tail and the callers run legacy SSE code
+    raw_scalar(buf, i, count, raw);
+}
+
+static void (*raw_impl)(const unsigned char *buf, int count, raw_t *raw) = raw_sse2;
+
+/**
+ * Function:  dirscan_init
+ * --------------------
+ * @brief pick the AVX2 kernel when the CPU has it; SSE2 is always there
+ *        on x86-64. Runs before main, so threads never race on it.
+ *
+ */
+__attribute__ ((constructor))
+static void dirscan_init(void) {
+    if (__builtin_cpu_supports("avx2")) {
+        raw_impl = raw_avx2;
+    }
+}
+#else
+static void raw_all(const unsigned char *buf, int count, raw_t *raw) {
+    raw_scalar(buf, 0, count, raw);
+}
+
+static void (*raw_impl)(const unsigned char *buf, int count, raw_t *raw) = raw_all;
+#endif
+
+/**
+ * Function:  dirscan
+ * --------------------
+ * @brief classify a run of directory entries, such as a sector of them.
+ *        Walkers then visit the set bits of the kinds they want instead of
+ *        testing every entry.
+ *
+ * @param buf: the entries.
+ * @param count: the number of entries, at most DIRSCAN_MAX.
+ * @param out: the kinds of the entries; bits from count up are clear.
+ *
+ */
+void dirscan(const char *buf, int count, dirscan_t *out) {
+    raw_t raw = {0};
+
+    raw_impl((const unsigned char *)buf, count, &raw);
+    uint64_t all = count < 64 ? ((uint64_t)1 << count) - 1 : ~(uint64_t)0;
+
+    // a free entry is free whatever its attributes say
+    out->end = raw.zero;
+    out->deleted = raw.e5;
+    out->lfn = raw.lfn & ~raw.zero & ~raw.e5;
+    out->live = all & ~raw.zero & ~raw.e5 & ~raw.lfn;
+    out->dot = out->live & raw.dot;
+    out->label = out->live & raw.label & ~raw.dot;
+    out->dir = out->live & raw.dir & ~raw.dot & ~raw.label;
+    out->file = out->live & ~out->dot & ~out->dir & ~out->label;
+}
+
+/**
+ * Function:  dirscan_before_end
+ * --------------------
+ * @brief get the mask of the entries in front of the first end marker, or
+ *        of all of them if there is none.
+ *
+ */
+uint64_t dirscan_before_end(const dirscan_t *scan) {
+    return scan->end != 0 ? (scan->end & -scan->end) - 1 : ~(uint64_t)0;
+}
+
+/**
+ * Function:  dirscan_name_equal
+ * --------------------
+ * @brief compare two 11-byte 8.3 names with two overlapping word loads,
+ *        bytes 0-7 and 7-10, so neither name is read past its end.
+ *
+ * @return 1 if the names are the same, 0 if not.
+ *
+ */
+int dirscan_name_equal(const char *a, const char *b) {
+    uint64_t a8, b8;
+    uint32_t a4, b4;
+
+    memcpy(&a8, a, 8);
+    memcpy(&b8, b, 8);
+    memcpy(&a4, a + 7, 4);
+    memcpy(&b4, b + 7, 4);
+    return ((a8 ^ b8) | (a4 ^ b4)) == 0;
+}
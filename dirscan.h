@@ -0,0 +1,28 @@
+#ifndef _DIRSCAN_H_
+#define _DIRSCAN_H_
+#include <stdint.h>
+
+#define DIRSCAN_MAX 64           /* The most entries classified at once, one bit each. */
+
+/*
+ * The entries of a run classified by kind, bit i for entry i. Every entry
+ * is in exactly one of end, deleted, lfn and live; entries past the first
+ * end marker are classified as they are, so walkers stop at the lowest
+ * bit of end. dot, dir, label and file split live.
+ */
+typedef struct {
+    uint64_t  end;               /* First byte 0x00: free, and nothing after it is used. */
+    uint64_t  deleted;           /* First byte 0xE5: free. */
+    uint64_t  lfn;               /* Attributes 0x0F: a long name slot. */
+    uint64_t  live;              /* Any other entry. */
+    uint64_t  dot;               /* The . and .. entries. */
+    uint64_t  dir;               /* Subdirectories, other than . and .. */
+    uint64_t  label;             /* The volume label. */
+    uint64_t  file;              /* Everything else that is live. */
+} dirscan_t;
+
+void dirscan(const char *buf, int count, dirscan_t *out);
+uint64_t dirscan_before_end(const dirscan_t *scan);
+int dirscan_name_equal(const char *a, const char *b);
+
+#endif
@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dirscan.h"
+#include "emalloc.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * State of one check. Every cluster is claimed by at most one chain, so the
+ * whole check is one walk over the directory tree plus one pass over the FAT.
+ */
+typedef struct {
+    volume_t  *vol;
+    int       repair;            /* 1 to fix what is found. */
+    uint32_t  *owner;            /* The chain that claimed each cluster, 0 for none. */
+    char      **names;           /* The path of each chain, by chain number. */
+    int       chains;            /* The number of chains claimed so far. */
+    int       capacity;          /* The size of names. */
+    int       problems;          /* The number of problems found. */
+} check_t;
+
+/**
+ * Function:  fat_entry
+ * --------------------
+ * @brief decode a FAT12 entry from a raw FAT copy.
+ *
+ */
+static uint16_t fat_entry(const uint8_t *table, uint16_t i) {
+    uint32_t j = i * 3 / 2;
+    if (i & 0x01) {
+        return ((table[j] & 0xF0) >> 4) + (table[j + 1] << 4);
+    }
+    return ((table[j + 1] & 0x0F) << 8) + table[j];
+}
+
+/**
+ * Function:  check_fat_copies
+ * --------------------
+ * @brief compare every FAT copy against the first one, entry by entry.
+ *
+ */
+void check_fat_copies(check_t *chk) {
+    volume_t *vol = chk->vol;
+    uint32_t fat_bytes = vol->boot.sectors_per_fat * vol->bytes_per_sector;
+    uint8_t *copy = emalloc(fat_bytes);
+    int i, k, differ;
+
+    for (k = 1; k < vol->boot.fats; k++) {
+        for (i = 0; i < vol->boot.sectors_per_fat; i++) {
+            memcpy(copy + i * vol->bytes_per_sector,
+                   vol_read_sector(vol, vol->fat_sector + k * vol->boot.sectors_per_fat + i), vol->bytes_per_sector);
+        }
+        differ = 0;
+        for (i = 0; i < vol->fat_size; i++) {
+            if (fat_entry(copy, i) != vol_get_fat(vol, i)) {
+                differ++;
+            }
+        }
+        if (differ > 0) {
+            printf("FATCOPY    FAT copy %d differs from copy 1 in %d entries\n", k + 1, differ);
+            chk->problems++;
+            if (chk->repair) {
+                // every FAT sector is rewritten to every copy on flush
+                memset(vol->fat_dirty, 1, vol->boot.sectors_per_fat);
+            }
+        }
+    }
+    free(copy);
+}
+
+/**
+ * Function:  cut_chain
+ * --------------------
+ * @brief end a chain after the given cluster.
+ *
+ * @param last: the cluster to become the end of the chain, 0 if the chain becomes empty.
+ *
+ */
+static void cut_chain(check_t *chk, uint16_t last) {
+    if (chk->repair && last != 0) {
+        vol_set_fat(chk->vol, last, 0xFFF);
+    }
+}
+
+/**
+ * Function:  claim_chain
+ * --------------------
+ * @brief follow a chain from its first cluster and claim each cluster for it.
+ *        The walk stops at the first cluster that is out of range, free, bad,
+ *        already in this chain (a cycle) or claimed by another chain (a cross-link).
+ *
+ * @param chk: the check.
+ * @param path: the file or directory the chain belongs to.
+ * @param first: the first cluster of the chain.
+ * @param len: set to the number of clusters claimed.
+ *
+ * @return The clusters claimed, in chain order.
+ *
+ */
+uint16_t *claim_chain(check_t *chk, const char *path, uint16_t first, int *len) {
+    volume_t *vol = chk->vol;
+    int capacity = 16, n = 0;
+    uint16_t *clusters = emalloc(capacity * sizeof(uint16_t));
+    uint16_t prev = 0, c = first;
+    uint32_t id;
+
+    if (chk->chains + 1 == chk->capacity) {
+        chk->capacity *= 2;
+        chk->names = realloc(chk->names, chk->capacity * sizeof(char *));
+        if (chk->names == NULL) {
+            printf("Failed to malloc.\n");
+            exit(-1);
+        }
+    }
+    id = ++chk->chains;
+    chk->names[id] = strdup(path);
+
+    while (c < 0xFF8) {
+        uint16_t next = c >= 2 && c < vol->fat_size ? vol_get_fat(vol, c) : 0;
+        if (next == 0 || next == 1 || next == 0xFF7) {
+            printf("BROKEN     %s: chain reaches %s cluster %u\n", path,
+                   c < 2 || c >= vol->fat_size ? "invalid" : next == 0xFF7 ? "bad" : "free", c);
+            chk->problems++;
+            cut_chain(chk, prev);
+            break;
+        }
+        if (chk->owner[c] == id) {
+            printf("CYCLE      %s: chain loops back to cluster %u\n", path, c);
+            chk->problems++;
+            cut_chain(chk, prev);
+            break;
+        }
+        if (chk->owner[c] != 0) {
+            printf("CROSSLINK  %s and %s share cluster %u\n", path, chk->names[chk->owner[c]], c);
+            chk->problems++;
+            cut_chain(chk, prev);
+            break;
+        }
+        chk->owner[c] = id;
+        if (n == capacity) {
+            capacity *= 2;
+            clusters = realloc(clusters, capacity * sizeof(uint16_t));
+            if (clusters == NULL) {
+                printf("Failed to malloc.\n");
+                exit(-1);
+            }
+        }
+        clusters[n++] = c;
+        prev = c;
+        c = next;
+    }
+    *len = n;
+    return clusters;
+}
+
+/**
+ * Function:  check_file
+ * --------------------
+ * @brief claim the chain of a file and compare its length with the file size.
+ *        Repair frees clusters past the size, or shrinks the size to the chain.
+ *
+ * @param entry: the directory entry of the file, updated on repair.
+ * @param address: where the entry is stored on the disk.
+ * @param path: the path of the file.
+ *
+ */
+void check_file(check_t *chk, entry_t *entry, off_t address, const char *path) {
+    volume_t *vol = chk->vol;
+    uint32_t needed = entry->size / vol->cluster_size + (entry->size % vol->cluster_size != 0);
+    int i, len = 0;
+    uint16_t *clusters = entry->cluster != 0 ? claim_chain(chk, path, entry->cluster, &len) : NULL;
+
+    if ((uint32_t)len != needed) {
+        printf("SIZE       %s: size %u needs %u clusters, chain has %d\n", path, entry->size, needed, len);
+        chk->problems++;
+        if (chk->repair) {
+            if ((uint32_t)len > needed) {
+                cut_chain(chk, needed > 0 ? clusters[needed - 1] : 0);
+                for (i = needed; i < len; i++) {
+                    vol_set_fat(vol, clusters[i], 0);
+                    chk->owner[clusters[i]] = 0;
+                }
+            } else {
+                entry->size = len * vol->cluster_size;
+            }
+            if (needed == 0 || len == 0) {
+                entry->cluster = 0;
+            }
+            vol_write(vol, address, entry, sizeof(entry_t));
+        }
+    }
+    free(clusters);
+}
+
+/**
+ * Function:  check_dir
+ * --------------------
+ * @brief check every entry of a directory and, through recursion, of every
+ *        directory below it. A subdirectory is only entered through the
+ *        clusters it claimed, so directory loops can't trap the walk.
+ *
+ * @param clusters: the clusters of the directory, NULL for the root directory.
+ * @param len: the number of clusters.
+ * @param path: the path of the directory, "" for the root directory.
+ *
+ */
+void check_dir(check_t *chk, uint16_t *clusters, int len, const char *path) {
+    volume_t *vol = chk->vol;
+    int sectors = clusters == NULL ? vol->root_sectors : len * vol->boot.sectors_per_cluster;
+    char *buf = emalloc(vol->bytes_per_sector);
+    entry_t entry;
+    dirscan_t scan;
+    uint64_t visit = 0;
+    uint32_t base = 0;
+    int s, j;
+
+    for (s = 0; s < sectors; s++) {
+        uint32_t sector = clusters == NULL ? vol->root_sector + s :
+                          vol_cluster_sector(vol, clusters[s / vol->boot.sectors_per_cluster]) + s % vol->boot.sectors_per_cluster;
+        memcpy(buf, vol_read_sector(vol, sector), vol->bytes_per_sector);
+        for (j = 0; j < vol->bytes_per_sector; j += sizeof(entry_t)) {
+            // free entries, long file names, . & .. and the volume label are skipped a run at a time
+            if (j % (DIRSCAN_MAX * sizeof(entry_t)) == 0) {
+                int entries = (vol->bytes_per_sector - j) / sizeof(entry_t);
+                dirscan(buf + j, entries < DIRSCAN_MAX ? entries : DIRSCAN_MAX, &scan);
+                visit = (scan.dir | scan.file) & dirscan_before_end(&scan);
+                base = j;
+            }
+            if (visit == 0) {
+                if (scan.end != 0) {
+                    free(buf);
+                    return; // free entry & no more
+                }
+                j = base + (DIRSCAN_MAX - 1) * sizeof(entry_t);
+                continue;
+            }
+            j = base + __builtin_ctzll(visit) * sizeof(entry_t);
+            visit &= visit - 1;
+            memcpy(&entry, buf + j, sizeof(entry_t));
+
+            char name[13];
+            int i, k = 0;
+            for (i = 0; i < 8 && entry.filename[i] != ' '; i++)
+                name[k++] = entry.filename[i];
+            if (entry.extension[0] != ' ') {
+                name[k++] = '.';
+                for (i = 0; i < 3 && entry.extension[i] != ' '; i++)
+                    name[k++] = entry.extension[i];
+            }
+            name[k] = '\0';
+            char *entry_path = emalloc(strlen(path) + k + 2);
+            sprintf(entry_path, "%s%s%s", path, path[0] != '\0' ? "/" : "", name);
+            off_t address = (off_t)sector * vol->bytes_per_sector + j;
+
+            if (entry.attributes & 0x10) { // Subdirectory
+                int dir_len = 0;
+                uint16_t *dir_clusters = claim_chain(chk, entry_path, entry.cluster, &dir_len);
+                if (dir_len > 0) {
+                    check_dir(chk, dir_clusters, dir_len, entry_path);
+                } else if (chk->repair) {
+                    // nothing of the directory can be reached, drop the entry
+                    entry.filename[0] = (char)0xE5;
+                    vol_write(vol, address, &entry, sizeof(entry_t));
+                }
+                free(dir_clusters);
+            } else {
+                check_file(chk, &entry, address, entry_path);
+            }
+            free(entry_path);
+        }
+    }
+    free(buf);
+}
+
+/**
+ * Function:  check_lost
+ * --------------------
+ * @brief one pass over the FAT: allocated clusters no chain claimed are lost.
+ *        A lost cluster no other lost cluster points to starts a lost chain.
+ *        Repair frees them.
+ *
+ */
+void check_lost(check_t *chk) {
+    volume_t *vol = chk->vol;
+    uint8_t *lost = emalloc(vol->fat_size / 8 + 1);
+    uint8_t *pointed = emalloc(vol->fat_size / 8 + 1);
+    int c, lost_clusters = 0, lost_chains = 0;
+
+    memset(lost, 0, vol->fat_size / 8 + 1);
+    memset(pointed, 0, vol->fat_size / 8 + 1);
+    for (c = 2; c < vol->fat_size; c++) {
+        uint16_t next = vol_get_fat(vol, c);
+        if (next == 0 || next == 0xFF7 || chk->owner[c] != 0) {
+            continue;
+        }
+        BIT_SET(lost, c);
+        lost_clusters++;
+        if (next >= 2 && next < vol->fat_size) {
+            BIT_SET(pointed, next);
+        }
+    }
+    for (c = 2; c < vol->fat_size; c++) {
+        if (BIT_TEST(lost, c)) {
+            if (!BIT_TEST(pointed, c)) {
+                lost_chains++;
+            }
+            if (chk->repair) {
+                vol_set_fat(vol, c, 0);
+            }
+        }
+    }
+    if (lost_clusters > 0) {
+        printf("LOST       %d clusters in %d chains belong to no file\n", lost_clusters, lost_chains);
+        chk->problems++;
+    }
+    free(lost);
+    free(pointed);
+}
+
+int main(int argc, char *argv[]) {
+    check_t chk;
+    int i;
+
+    chk.repair = argc == 3 && strcmp(argv[1], "-r") == 0;
+    if (argc != 2 && !chk.repair) {
+        fprintf(stderr, "usage: diskcheck [-r] <disk.img>\n");
+        exit(-1);
+    }
+
+    if ((chk.vol = vol_open(argv[argc - 1], chk.repair)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[argc - 1]);
+        exit(-1);
+    }
+    chk.owner = emalloc(chk.vol->fat_size * sizeof(uint32_t));
+    memset(chk.owner, 0, chk.vol->fat_size * sizeof(uint32_t));
+    chk.capacity = 64;
+    chk.names = emalloc(chk.capacity * sizeof(char *));
+    chk.chains = 0;
+    chk.problems = 0;
+
+    check_fat_copies(&chk);
+    check_dir(&chk, NULL, 0, "");
+    check_lost(&chk);
+
+    if (vol_close(chk.vol) != 0) {
+        printf("Failed to write the repairs to the disk image.\n");
+        exit(-1);
+    }
+    for (i = 1; i <= chk.chains; i++) {
+        free(chk.names[i]);
+    }
+    free(chk.names);
+    free(chk.owner);
+
+    if (chk.problems == 0) {
+        printf("The disk image is consistent.\n");
+        return 0;
+    }
+    printf("%d problems %s.\n", chk.problems, chk.repair ? "repaired" : "found");
+    return chk.repair ? 0 : 1;
+}
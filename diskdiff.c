@@ -0,0 +1,386 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "dir.h"
+#include "emalloc.h"
+#include "file.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define HASH_RUN  (1024 * 1024)  /* Bytes of clusters a hashing thread reads at once. */
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * A file or directory of one image, with its path from the root directory.
+ */
+typedef struct {
+    char      *path;
+    entry_t   entry;
+} node_t;
+
+/*
+ * One image being compared: its tree and a hash of every data cluster.
+ */
+typedef struct {
+    volume_t  *vol;
+    node_t    *nodes;
+    int       count;
+    int       capacity;
+    uint8_t   *visited;          /* One bit per directory cluster entered, against loops. */
+    uint32_t  *hashes;           /* CRC32C of each cluster, indexed by cluster number. */
+} side_t;
+
+/*
+ * A run of clusters hashed by one thread.
+ */
+typedef struct {
+    side_t    *side;
+    uint16_t  first;
+    uint16_t  end;               /* One past the last cluster. */
+    int       failed;
+} hash_job_t;
+
+/**
+ * Function:  hash_worker
+ * --------------------
+ * @brief hash the clusters of one run, reading many at a time.
+ *
+ */
+static void *hash_worker(void *arg) {
+    hash_job_t *job = arg;
+    volume_t *vol = job->side->vol;
+    uint32_t per_read = HASH_RUN / vol->cluster_size > 0 ? HASH_RUN / vol->cluster_size : 1;
+    char *buf = emalloc((size_t)per_read * vol->cluster_size);
+    uint32_t cluster, i;
+
+    for (cluster = job->first; cluster < job->end; cluster += per_read) {
+        uint32_t count = job->end - cluster < per_read ? job->end - cluster : per_read;
+        size_t length = (size_t)count * vol->cluster_size;
+        if (vol_read(vol, buf, length, vol_cluster_offset(vol, cluster)) != (ssize_t)length) {
+            job->failed = 1;
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            job->side->hashes[cluster + i] = crc32c(0, buf + (size_t)i * vol->cluster_size, vol->cluster_size);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Function:  hash_clusters
+ * --------------------
+ * @brief hash every data cluster of both images, each image split into one
+ *        run per thread. A compressed image or an overlay is hashed on one
+ *        thread, since its reads share state.
+ *
+ * @return 0 on success, -1 if an image can't be read.
+ *
+ */
+int hash_clusters(side_t *sides, int threads) {
+    hash_job_t *jobs = emalloc(2 * threads * sizeof(hash_job_t));
+    pthread_t *workers = emalloc(2 * threads * sizeof(pthread_t));
+    int *started = emalloc(2 * threads * sizeof(int));
+    int n = 0, s, i, ret = 0;
+
+    for (s = 0; s < 2; s++) {
+        volume_t *vol = sides[s].vol;
+        int runs = vol->direct ? threads : 1;
+        uint32_t clusters = vol->fat_size - 2;
+
+        sides[s].hashes = emalloc(vol->fat_size * sizeof(uint32_t));
+        memset(sides[s].hashes, 0, vol->fat_size * sizeof(uint32_t));
+        for (i = 0; i < runs; i++) {
+            jobs[n].side = &sides[s];
+            jobs[n].first = 2 + (uint64_t)clusters * i / runs;
+            jobs[n].end = 2 + (uint64_t)clusters * (i + 1) / runs;
+            jobs[n].failed = 0;
+            n++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        started[i] = pthread_create(&workers[i], NULL, hash_worker, &jobs[i]) == 0;
+        if (!started[i]) {
+            hash_worker(&jobs[i]);  // no thread available, hash it on this one
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+        ret |= jobs[i].failed ? -1 : 0;
+    }
+    free(jobs);
+    free(workers);
+    free(started);
+    return ret;
+}
+
+/**
+ * Function:  collect
+ * --------------------
+ * @brief add every file and directory below a directory to the side's tree.
+ *
+ * @param side: the image.
+ * @param dir_cluster: the directory, 0 for the root directory.
+ * @param prefix: the path of the directory with a trailing '/', "" for the root.
+ *
+ */
+void collect(side_t *side, uint16_t dir_cluster, const char *prefix) {
+    dir_entry_t e;
+    dir_t dir;
+
+    dir_open(&dir, side->vol, dir_cluster);
+    while (dir_read(&dir, &e)) {
+        if ((uint8_t)e.entry.filename[0] == 0x2E || (e.entry.attributes & 0x08)) {
+            continue; // skip . & .. entries and the volume label
+        }
+        if (side->count == side->capacity) {
+            side->capacity = side->capacity == 0 ? 64 : side->capacity * 2;
+            node_t *grown = emalloc(side->capacity * sizeof(node_t));
+            memcpy(grown, side->nodes, side->count * sizeof(node_t));
+            free(side->nodes);
+            side->nodes = grown;
+        }
+        node_t *node = &side->nodes[side->count++];
+        node->path = emalloc(strlen(prefix) + strlen(e.name) + 2);
+        sprintf(node->path, "%s%s", prefix, e.name);
+        node->entry = e.entry;
+
+        uint16_t cluster = e.entry.cluster;
+        if ((e.entry.attributes & 0x10) && cluster >= 2 && cluster < side->vol->fat_size &&
+            !BIT_TEST(side->visited, cluster)) {
+            BIT_SET(side->visited, cluster);
+            char *path = emalloc(strlen(node->path) + 2);
+            sprintf(path, "%s/", node->path);
+            collect(side, cluster, path);
+            free(path);
+        }
+    }
+    dir_close(&dir);
+}
+
+static int by_path(const void *a, const void *b) {
+    return strcasecmp(((const node_t *)a)->path, ((const node_t *)b)->path);
+}
+
+/**
+ * Function:  file_crc
+ * --------------------
+ * @brief get the CRC32C of a file's data, read along its chain.
+ *
+ */
+uint32_t file_crc(volume_t *vol, const entry_t *entry) {
+    char *buf = emalloc(vol->cluster_size);
+    uint32_t crc = 0;
+    int count, i;
+
+    extent_t *extents = file_chain_extents(vol, entry->cluster, entry->size, &count);
+    for (i = 0; i < count; i++) {
+        uint32_t done;
+        for (done = 0; done < extents[i].length; done += vol->cluster_size) {
+            uint32_t length = extents[i].length - done < vol->cluster_size ? extents[i].length - done : vol->cluster_size;
+            ssize_t got = vol_read(vol, buf, length, extents[i].src_offset + done);
+            crc = crc32c(crc, buf, got > 0 ? got : 0);
+        }
+    }
+    free(extents);
+    free(buf);
+    return crc;
+}
+
+/**
+ * Function:  same_data
+ * --------------------
+ * @brief check if two files of the same size hold the same data. With the
+ *        same cluster size the chains are compared by cluster hash, and only
+ *        the used part of the last cluster is read; otherwise both files are
+ *        read whole.
+ *
+ */
+int same_data(side_t *a, side_t *b, const entry_t *x, const entry_t *y) {
+    volume_t *va = a->vol, *vb = b->vol;
+    uint16_t ca = x->cluster, cb = y->cluster;
+    uint32_t left = x->size;
+
+    if (va->cluster_size != vb->cluster_size) {
+        return file_crc(va, x) == file_crc(vb, y);
+    }
+    while (left > 0) {
+        if (ca < 2 || ca >= va->fat_size || cb < 2 || cb >= vb->fat_size) {
+            return ca == cb;    // both chains cut short at the same point, or not
+        }
+        if (left < va->cluster_size) {
+            // bytes past the end of the file may differ
+            char *pa = emalloc(left), *pb = emalloc(left);
+            int same = vol_read(va, pa, left, vol_cluster_offset(va, ca)) == left &&
+                       vol_read(vb, pb, left, vol_cluster_offset(vb, cb)) == left && memcmp(pa, pb, left) == 0;
+            free(pa);
+            free(pb);
+            return same;
+        }
+        if (a->hashes[ca] != b->hashes[cb]) {
+            return 0;
+        }
+        left -= va->cluster_size;
+        ca = vol_get_fat(va, ca);
+        cb = vol_get_fat(vb, cb);
+    }
+    return 1;
+}
+
+/**
+ * Function:  diff_trees
+ * --------------------
+ * @brief print the files and directories added to, removed from and changed
+ *        between the two trees, in path order.
+ *
+ * @return The number of differences printed.
+ *
+ */
+int diff_trees(side_t *a, side_t *b) {
+    int i = 0, k = 0, changes = 0;
+
+    qsort(a->nodes, a->count, sizeof(node_t), by_path);
+    qsort(b->nodes, b->count, sizeof(node_t), by_path);
+    while (i < a->count || k < b->count) {
+        int order = i == a->count ? 1 : k == b->count ? -1 : strcasecmp(a->nodes[i].path, b->nodes[k].path);
+        if (order < 0) {
+            printf("- %s%s\n", a->nodes[i].path, (a->nodes[i].entry.attributes & 0x10) ? "/" : "");
+            changes++;
+            i++;
+            continue;
+        }
+        if (order > 0) {
+            printf("+ %s%s\n", b->nodes[k].path, (b->nodes[k].entry.attributes & 0x10) ? "/" : "");
+            changes++;
+            k++;
+            continue;
+        }
+
+        const entry_t *x = &a->nodes[i].entry, *y = &b->nodes[k].entry;
+        char why[64] = "";
+        if ((x->attributes & 0x10) != (y->attributes & 0x10)) {
+            strcat(why, ", type");
+        } else if (!(x->attributes & 0x10)) {
+            if (x->size != y->size) {
+                strcat(why, ", size");
+            } else if (!same_data(a, b, x, y)) {
+                strcat(why, ", data");
+            }
+        }
+        if ((x->attributes & ~0x20) != (y->attributes & ~0x20)) {
+            strcat(why, ", attributes");    // the archive bit comes and goes
+        }
+        if (x->last_modified_date != y->last_modified_date || x->last_modified_time != y->last_modified_time) {
+            strcat(why, ", time");
+        }
+        if (why[0] != '\0') {
+            printf("M %s (%s)\n", b->nodes[k].path, why + 2);
+            changes++;
+        }
+        i++;
+        k++;
+    }
+    return changes;
+}
+
+/**
+ * Function:  diff_clusters
+ * --------------------
+ * @brief print the runs of clusters whose data or FAT entries differ
+ *        between two images of the same geometry.
+ *
+ * @return The number of runs printed.
+ *
+ */
+int diff_clusters(side_t *a, side_t *b) {
+    const char *what[2] = {"data", "FAT"};
+    int runs = 0, kind;
+
+    for (kind = 0; kind < 2; kind++) {
+        uint32_t cluster, start = 0;
+        for (cluster = 2; cluster <= a->vol->fat_size; cluster++) {
+            int differs = cluster < a->vol->fat_size &&
+                          (kind == 0 ? a->hashes[cluster] != b->hashes[cluster] :
+                                       vol_get_fat(a->vol, cluster) != vol_get_fat(b->vol, cluster));
+            if (differs && start == 0) {
+                start = cluster;
+            } else if (!differs && start != 0) {
+                if (cluster - 1 == start) {
+                    printf("cluster %u: %s differs\n", start, what[kind]);
+                } else {
+                    printf("clusters %u-%u: %s differs\n", start, cluster - 1, what[kind]);
+                }
+                runs++;
+                start = 0;
+            }
+        }
+    }
+    return runs;
+}
+
+int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    side_t sides[2];
+    int s, i;
+
+    if (argc == 5 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0) {
+        threads = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "usage: diskdiff [-j threads] <a.img> <b.img>\n");
+        exit(-1);
+    }
+    memset(sides, 0, sizeof(sides));
+    for (s = 0; s < 2; s++) {
+        if ((sides[s].vol = vol_open(argv[1 + s], 0)) == NULL) {
+            fprintf(stderr, "Failed to open %s\n", argv[1 + s]);
+            exit(-1);
+        }
+        sides[s].visited = emalloc(sides[s].vol->fat_size / 8 + 1);
+        memset(sides[s].visited, 0, sides[s].vol->fat_size / 8 + 1);
+    }
+    volume_t *va = sides[0].vol, *vb = sides[1].vol;
+    int same_geometry = va->bytes_per_sector == vb->bytes_per_sector && va->cluster_size == vb->cluster_size &&
+                        va->data_sector == vb->data_sector && va->fat_size == vb->fat_size;
+
+    if (hash_clusters(sides, threads > 0 ? threads : 1) != 0) {
+        fprintf(stderr, "Failed to read the disk images.\n");
+        exit(-1);
+    }
+    for (s = 0; s < 2; s++) {
+        collect(&sides[s], 0, "");
+    }
+
+    int changes = diff_trees(&sides[0], &sides[1]);
+    int runs = 0;
+    if (same_geometry) {
+        runs = diff_clusters(&sides[0], &sides[1]);
+    } else {
+        printf("The disk images have different geometry; their clusters aren't compared.\n");
+    }
+    if (changes == 0 && runs == 0 && same_geometry) {
+        printf("The disk images are identical.\n");
+    }
+
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < sides[s].count; i++) {
+            free(sides[s].nodes[i].path);
+        }
+        free(sides[s].nodes);
+        free(sides[s].visited);
+        free(sides[s].hashes);
+        vol_close(sides[s].vol);
+    }
+    return changes == 0 && runs == 0 && same_geometry ? 0 : 1;
+}
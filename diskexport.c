@@ -0,0 +1,240 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dir.h"
+#include "dostime.h"
+#include "emalloc.h"
+#include "file.h"
+#include "sfs.h"
+#include "tar.h"
+#include "volume.h"
+
+#define EXPORT_REORDER (8 * 1024 * 1024)  /* Largest file gathered in memory so its clusters are read in disk order. */
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * A file to export, with its path in the archive.
+ */
+typedef struct {
+    char      *path;
+    entry_t   entry;
+} member_t;
+
+/*
+ * State of one export. Directories go out as they are found; files are
+ * collected, then sent in the order their first clusters lie on the disk.
+ */
+typedef struct {
+    volume_t  *vol;
+    member_t  *files;
+    int       count;
+    int       capacity;
+    uint8_t   *visited;          /* One bit per directory cluster entered, against loops. */
+    int       failed;            /* Set if a directory header couldn't be written. */
+} export_t;
+
+/**
+ * Function:  entry_mtime
+ * --------------------
+ * @brief get the modification time of an entry as a host time.
+ *
+ */
+time_t entry_mtime(const entry_t *entry) {
+    struct timespec ts;
+
+    dos_to_timespec(entry->last_modified_date, entry->last_modified_time, 0, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Function:  collect
+ * --------------------
+ * @brief write the headers of the directories below a directory and collect
+ *        its files, depth first.
+ *
+ * @param ex: the export.
+ * @param dir_cluster: the directory, 0 for the root directory.
+ * @param prefix: the archive path of the directory with a trailing '/', "" at the top.
+ *
+ */
+void collect(export_t *ex, uint16_t dir_cluster, const char *prefix) {
+    dir_entry_t e;
+    dir_t dir;
+
+    dir_open(&dir, ex->vol, dir_cluster);
+    while (dir_read(&dir, &e)) {
+        if ((uint8_t)e.entry.filename[0] == 0x2E || (e.entry.attributes & 0x08)) {
+            continue; // skip . & .. entries and the volume label
+        }
+
+        char *path = emalloc(strlen(prefix) + strlen(e.name) + 2);
+        sprintf(path, "%s%s", prefix, e.name);
+        if (!(e.entry.attributes & 0x10)) {
+            if (ex->count == ex->capacity) {
+                ex->capacity = ex->capacity == 0 ? 64 : ex->capacity * 2;
+                member_t *grown = emalloc(ex->capacity * sizeof(member_t));
+                memcpy(grown, ex->files, ex->count * sizeof(member_t));
+                free(ex->files);
+                ex->files = grown;
+            }
+            ex->files[ex->count].path = path;
+            ex->files[ex->count].entry = e.entry;
+            ex->count++;
+            continue;
+        }
+
+        strcat(path, "/");
+        if (tar_write_header(STDOUT_FILENO, path, TAR_DIR, 0, entry_mtime(&e.entry)) != 0) {
+            ex->failed = 1;
+        }
+        uint16_t cluster = e.entry.cluster;
+        if (cluster >= 2 && cluster < ex->vol->fat_size && !BIT_TEST(ex->visited, cluster)) {
+            BIT_SET(ex->visited, cluster);
+            collect(ex, cluster, path);
+        }
+        free(path);
+    }
+    dir_close(&dir);
+}
+
+static int by_cluster(const void *a, const void *b) {
+    const member_t *x = a, *y = b;
+
+    if (x->entry.cluster != y->entry.cluster) {
+        return x->entry.cluster < y->entry.cluster ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static int by_disk_offset(const void *a, const void *b) {
+    const extent_t *x = a, *y = b;
+
+    return x->src_offset < y->src_offset ? -1 : x->src_offset > y->src_offset;
+}
+
+/**
+ * Function:  export_file
+ * --------------------
+ * @brief write one file to the archive. A file that fits the reorder buffer
+ *        has its extents read in disk order and sent in file order; a bigger
+ *        one is streamed in chain order. Bytes past the end of a chain that
+ *        is shorter than the size say are sent as zeros.
+ *
+ * @param vol: the disk.
+ * @param m: the file.
+ *
+ * @return 0 on success, -1 on a read or write error.
+ *
+ */
+int export_file(volume_t *vol, const member_t *m) {
+    uint32_t size = m->entry.size, covered = 0;
+    int count, i, ret = 0;
+
+    if (tar_write_header(STDOUT_FILENO, m->path, TAR_FILE, size, entry_mtime(&m->entry)) != 0) {
+        return -1;
+    }
+    extent_t *extents = file_chain_extents(vol, m->entry.cluster, size, &count);
+
+    if (size <= EXPORT_REORDER) {
+        char *buf = emalloc(size + 1);
+        memset(buf, 0, size);
+        qsort(extents, count, sizeof(extent_t), by_disk_offset);
+        for (i = 0; i < count && ret == 0; i++) {
+            if (vol_read(vol, buf + extents[i].dst_offset, extents[i].length, extents[i].src_offset) !=
+                extents[i].length) {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            ret = tar_write_full(STDOUT_FILENO, buf, size);
+        }
+        free(buf);
+    } else {
+        char *buf = emalloc(XFER_CHUNK);
+        for (i = 0; i < count && ret == 0; i++) {
+            uint32_t done;
+            for (done = 0; done < extents[i].length && ret == 0; done += XFER_CHUNK) {
+                uint32_t length = extents[i].length - done < XFER_CHUNK ? extents[i].length - done : XFER_CHUNK;
+                if (vol_read(vol, buf, length, extents[i].src_offset + done) != length ||
+                    tar_write_full(STDOUT_FILENO, buf, length) != 0) {
+                    ret = -1;
+                }
+            }
+            covered += extents[i].length;
+        }
+        memset(buf, 0, XFER_CHUNK);
+        while (ret == 0 && covered < size) {
+            uint32_t length = size - covered < XFER_CHUNK ? size - covered : XFER_CHUNK;
+            ret = tar_write_full(STDOUT_FILENO, buf, length);
+            covered += length;
+        }
+        free(buf);
+    }
+    free(extents);
+    return ret == 0 ? tar_write_padding(STDOUT_FILENO, size) : -1;
+}
+
+int main(int argc, char *argv[]) {
+    export_t ex = {0};
+    const char *start = argc == 3 ? argv[2] : "";
+    int i;
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: diskexport <disk.img> [directory] > archive.tar\n");
+        exit(-1);
+    }
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "The archive goes to stdout, which is a terminal.\n");
+        exit(-1);
+    }
+    if ((ex.vol = vol_open(argv[1], 0)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        exit(-1);
+    }
+    volume_t *vol = ex.vol;
+    ex.visited = emalloc(vol->fat_size / 8 + 1);
+    memset(ex.visited, 0, vol->fat_size / 8 + 1);
+
+    // the archive holds what is below the directory named, under relative paths
+    uint16_t start_cluster = 0;
+    if (strspn(start, "/") != strlen(start)) {
+        dir_entry_t e;
+        if (!dir_resolve(vol, start, &e) || !(e.entry.attributes & 0x10)) {
+            fprintf(stderr, "%s: Directory not found.\n", start);
+            exit(-1);
+        }
+        start_cluster = e.entry.cluster;
+        BIT_SET(ex.visited, start_cluster);
+    }
+
+    // the whole data area is read in one pass, so share-lock it once
+    off_t data_start = (off_t)vol->data_sector * vol->bytes_per_sector;
+    vol_lock(vol, F_RDLCK, data_start, (off_t)vol->total_sectors * vol->bytes_per_sector - data_start);
+    if (vol->direct) {
+        posix_fadvise(vol->fd, data_start, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    collect(&ex, start_cluster, "");
+    qsort(ex.files, ex.count, sizeof(member_t), by_cluster);
+    for (i = 0; i < ex.count && !ex.failed; i++) {
+        if (export_file(vol, &ex.files[i]) != 0) {
+            fprintf(stderr, "%s: Failed to export the file.\n", ex.files[i].path);
+            ex.failed = 1;
+        }
+    }
+    if (!ex.failed && tar_write_end(STDOUT_FILENO) != 0) {
+        ex.failed = 1;
+    }
+
+    for (i = 0; i < ex.count; i++) {
+        free(ex.files[i].path);
+    }
+    free(ex.files);
+    free(ex.visited);
+    vol_close(vol);
+    return ex.failed ? -1 : 0;
+}
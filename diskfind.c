@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dir.h"
+#include "emalloc.h"
+#include "file.h"
+#include "readahead.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * A query over the directory tree. Every predicate is checked against the
+ * raw fields of the short entry, cheapest first; the name glob, the only
+ * string work, goes last.
+ */
+typedef struct {
+    volume_t  *vol;
+    const char *name;            /* Glob the long or short name must match, NULL for any. */
+    int       type;              /* 'f' for files, 'd' for directories, 0 for both. */
+    uint8_t   attributes;        /* Attribute bits that must all be set. */
+    int64_t   min_size;          /* Smallest size in bytes, -1 for none. */
+    int64_t   max_size;          /* Largest size in bytes, -1 for none. */
+    uint32_t  after;             /* Modified after this DOS date << 16 | time, 0 for none. */
+    uint32_t  before;            /* Modified before this DOS date << 16 | time, UINT32_MAX for none. */
+    int       min_depth;         /* Shallowest depth printed; entries of the start directory are at 1. */
+    int       max_depth;         /* Deepest depth visited, -1 for no limit. */
+    int       get;               /* 1 to copy matching files to the local directory, as diskget does. */
+    uint8_t   *visited;          /* One bit per directory cluster entered, against loops. */
+    int       matches;           /* The number of entries printed. */
+    int       failed;            /* The number of matches that couldn't be copied. */
+} query_t;
+
+/**
+ * Function:  parse_size
+ * --------------------
+ * @brief parse a size with an optional k or M suffix, e.g. 512, 4k or 1M.
+ *
+ * @return The size in bytes, or -1 if it isn't one.
+ *
+ */
+int64_t parse_size(const char *value) {
+    char *end;
+    int64_t size = strtoll(value, &end, 10);
+
+    if (end == value || size < 0) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'M') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+/**
+ * Function:  parse_date
+ * --------------------
+ * @brief parse a local date, with an optional time, into the DOS date and
+ *        time an entry would hold: YYYY-MM-DD or YYYY-MM-DD HH:MM[:SS].
+ *
+ * @param key: set to the DOS date << 16 | time.
+ *
+ * @return 0 on success, -1 if it isn't a date DOS can hold.
+ *
+ */
+int parse_date(const char *value, uint32_t *key) {
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    int n = sscanf(value, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second);
+
+    if ((n != 3 && n != 5 && n != 6) || year < 1980 || year > 2107 || month < 1 || month > 12 || day < 1 ||
+        day > 31 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59) {
+        return -1;
+    }
+    *key = (uint32_t)(((year - 1980) << 9) | (month << 5) | day) << 16 | (hour << 11) | (minute << 5) | (second / 2);
+    return 0;
+}
+
+/**
+ * Function:  entry_matches
+ * --------------------
+ * @brief check an entry against the query.
+ *
+ * @param q: the query.
+ * @param e: the entry.
+ * @param depth: the depth of the entry.
+ *
+ * @return 1 if every predicate holds, 0 if not.
+ *
+ */
+int entry_matches(const query_t *q, const dir_entry_t *e, int depth) {
+    const entry_t *entry = &e->entry;
+    int is_dir = (entry->attributes & 0x10) != 0;
+
+    if (depth < q->min_depth || (q->type == 'f' && is_dir) || (q->type == 'd' && !is_dir) ||
+        (entry->attributes & q->attributes) != q->attributes) {
+        return 0;
+    }
+    if ((q->min_size >= 0 && entry->size < q->min_size) || (q->max_size >= 0 && entry->size > q->max_size)) {
+        return 0;
+    }
+    uint32_t modified = (uint32_t)entry->last_modified_date << 16 | entry->last_modified_time;
+    if (modified <= q->after || modified >= q->before) {
+        return 0;
+    }
+    // FAT names are case-insensitive, and either name finds a file
+    return q->name == NULL || fnmatch(q->name, e->name, FNM_CASEFOLD) == 0 ||
+           fnmatch(q->name, e->short_name, FNM_CASEFOLD) == 0;
+}
+
+/**
+ * Function:  get_file
+ * --------------------
+ * @brief copy a matching file to the local directory under its name on the
+ *        disk, the way diskget does. An existing local file is left alone.
+ *
+ * @param q: the query.
+ * @param e: the entry of the file.
+ * @param path: the path of the file on the disk, for the messages.
+ *
+ */
+void get_file(query_t *q, const dir_entry_t *e, const char *path) {
+    int fd, count, ret;
+
+    if ((fd = open(e->name, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        printf("%s: There is a file of the same name in the local directory.\n", path);
+        q->failed++;
+        return;
+    }
+    extent_t *extents = file_chain_extents(q->vol, e->entry.cluster, e->entry.size, &count);
+    ret = file_read(q->vol, fd, extents, count, (off_t)readahead_window() * q->vol->cluster_size, XFER_SPARSE);
+    if (ret != 0 || ftruncate(fd, e->entry.size) != 0) {
+        printf("%s: Failed to copy the file.\n", path);
+        unlink(e->name);
+        q->failed++;
+    }
+    free(extents);
+    close(fd);
+}
+
+/**
+ * Function:  find_in_dir
+ * --------------------
+ * @brief print the entries of a directory that match the query, and search
+ *        its subdirectories. A subdirectory past the depth limit, or one
+ *        entered already, isn't read at all.
+ *
+ * @param q: the query.
+ * @param dir_cluster: the directory, 0 for the root directory.
+ * @param path: the path of the directory, "" for the root directory.
+ * @param depth: the depth of the directory's entries.
+ *
+ */
+void find_in_dir(query_t *q, uint16_t dir_cluster, const char *path, int depth) {
+    dir_entry_t e;
+    dir_t dir;
+
+    dir_open(&dir, q->vol, dir_cluster);
+    while (dir_read(&dir, &e)) {
+        if ((uint8_t)e.entry.filename[0] == 0x2E || (e.entry.attributes & 0x08)) {
+            continue; // skip . & .. entries and the volume label
+        }
+
+        char *entry_path = emalloc(strlen(path) + strlen(e.name) + 2);
+        sprintf(entry_path, "%s/%s", path, e.name);
+        if (entry_matches(q, &e, depth)) {
+            q->matches++;
+            printf("%s%s\n", entry_path, (e.entry.attributes & 0x10) ? "/" : "");
+            if (q->get && !(e.entry.attributes & 0x10)) {
+                get_file(q, &e, entry_path);
+            }
+        }
+
+        uint16_t cluster = e.entry.cluster;
+        if ((e.entry.attributes & 0x10) && (q->max_depth < 0 || depth < q->max_depth) && cluster >= 2 &&
+            cluster < q->vol->fat_size && !BIT_TEST(q->visited, cluster)) {
+            BIT_SET(q->visited, cluster);
+            find_in_dir(q, cluster, entry_path, depth + 1);
+        }
+        free(entry_path);
+    }
+    dir_close(&dir);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: diskfind <disk.img> [path] [-name glob] [-type f|d] [-attr RHSA] [-size [+|-]N[k|M]]\n"
+                    "                [-after date] [-before date] [-mindepth N] [-maxdepth N] [-get]\n"
+                    "       dates are YYYY-MM-DD or \"YYYY-MM-DD HH:MM[:SS]\", in local time\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    query_t q = {0};
+    const char *start = "";
+    int i;
+
+    if (argc < 2) {
+        usage();
+    }
+    q.min_size = q.max_size = q.max_depth = -1;
+    q.before = UINT32_MAX;
+    i = 2;
+    if (i < argc && argv[i][0] != '-') {
+        start = argv[i++];
+    }
+    for (; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-get") == 0) {
+            q.get = 1;
+            continue;
+        }
+        if (value == NULL) {
+            usage();
+        }
+        if (strcmp(argv[i], "-name") == 0) {
+            q.name = value;
+        } else if (strcmp(argv[i], "-type") == 0 && (strcmp(value, "f") == 0 || strcmp(value, "d") == 0)) {
+            q.type = value[0];
+        } else if (strcmp(argv[i], "-attr") == 0) {
+            for (; *value != '\0'; value++) {
+                const char *bits = "RHS..A", *at = strchr(bits, *value & ~0x20);
+                if (at == NULL || *at == '.') {
+                    usage();
+                }
+                q.attributes |= 1 << (at - bits); // R 0x01, H 0x02, S 0x04, A 0x20
+            }
+        } else if (strcmp(argv[i], "-size") == 0) {
+            int64_t size = parse_size(value[0] == '+' || value[0] == '-' ? value + 1 : value);
+            if (size < 0) {
+                usage();
+            }
+            if (value[0] == '+') {
+                q.min_size = size + 1;
+            } else if (value[0] == '-') {
+                q.max_size = size - 1;
+                if (size == 0) {
+                    q.min_size = 1; // nothing is smaller than 0 bytes
+                    q.max_size = 0;
+                }
+            } else {
+                q.min_size = q.max_size = size;
+            }
+        } else if (strcmp(argv[i], "-after") == 0) {
+            if (parse_date(value, &q.after) != 0) {
+                usage();
+            }
+        } else if (strcmp(argv[i], "-before") == 0) {
+            if (parse_date(value, &q.before) != 0) {
+                usage();
+            }
+        } else if (strcmp(argv[i], "-mindepth") == 0) {
+            q.min_depth = atoi(value);
+        } else if (strcmp(argv[i], "-maxdepth") == 0) {
+            q.max_depth = atoi(value);
+        } else {
+            usage();
+        }
+        i++;
+    }
+
+    if ((q.vol = vol_open(argv[1], 0)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        exit(-1);
+    }
+    q.visited = emalloc(q.vol->fat_size / 8 + 1);
+    memset(q.visited, 0, q.vol->fat_size / 8 + 1);
+
+    // the search starts in the root directory or the directory named
+    uint16_t start_cluster = 0;
+    char *start_path = emalloc(strlen(start) + 2);
+    start_path[0] = '\0';
+    if (strspn(start, "/") != strlen(start)) {
+        dir_entry_t e;
+        if (!dir_resolve(q.vol, start, &e) || !(e.entry.attributes & 0x10)) {
+            printf("%s: Directory not found.\n", start);
+            exit(-1);
+        }
+        start_cluster = e.entry.cluster;
+        sprintf(start_path, "%s%s", start[0] == '/' ? "" : "/", start);
+        while (start_path[1] != '\0' && start_path[strlen(start_path) - 1] == '/') {
+            start_path[strlen(start_path) - 1] = '\0';
+        }
+        BIT_SET(q.visited, start_cluster);
+    }
+
+    find_in_dir(&q, start_cluster, start_path, 1);
+    free(start_path);
+    free(q.visited);
+    vol_close(q.vol);
+    return q.failed > 0 ? -1 : 0;
+}
@@ -0,0 +1,291 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dir.h"
+#include "dostime.h"
+#include "emalloc.h"
+#include "file.h"
+#include "sfs.h"
+#include "tar.h"
+#include "volume.h"
+
+/*
+ * State of one import. Members are added as they come off the stream; the
+ * directory of the last one is remembered, since an archive lists a
+ * directory's files together.
+ */
+typedef struct {
+    volume_t  *vol;
+    uint16_t  base;              /* The directory the archive goes into, 0 for the root directory. */
+    char      last_dir[TAR_PATH_MAX];  /* The archive path of the last directory looked up. */
+    uint16_t  last_cluster;      /* Its cluster. */
+    int       skipped;           /* The number of members that aren't files or directories. */
+} import_t;
+
+/**
+ * Function:  stamp
+ * --------------------
+ * @brief fill in the timestamps of a new entry from an archive member.
+ *
+ */
+void stamp(entry_t *entry, time_t mtime) {
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mtim.tv_sec = mtime;
+    st.st_atim.tv_sec = mtime;
+    dos_stamp_entry(entry, &st, 1);
+}
+
+/**
+ * Function:  clean_path
+ * --------------------
+ * @brief turn an archive path into a relative one in place: "./" and empty
+ *        components and a trailing '/' are dropped.
+ *
+ * @return 0 on success, -1 if the path has a ".." component.
+ *
+ */
+int clean_path(char *path) {
+    char *in = path, *out = path;
+
+    while (*in != '\0') {
+        size_t length = strcspn(in, "/");
+        if (length == 2 && strncmp(in, "..", 2) == 0) {
+            return -1;
+        }
+        if (length > 0 && !(length == 1 && in[0] == '.')) {
+            if (out != path) {
+                *out++ = '/';
+            }
+            memmove(out, in, length);
+            out += length;
+        }
+        in += length;
+        in += *in == '/';
+    }
+    *out = '\0';
+    return 0;
+}
+
+/**
+ * Function:  find_dir
+ * --------------------
+ * @brief get the cluster of a directory of the archive, making it and its
+ *        parents in the disk image if they aren't there yet.
+ *
+ * @param imp: the import.
+ * @param path: the clean archive path of the directory, "" for the top.
+ * @param mtime: the time new directories are stamped with.
+ *
+ * @return The cluster of the directory, 0 for the root directory, or -1 if
+ *         a file is in the way or there is no room.
+ *
+ */
+int find_dir(import_t *imp, const char *path, time_t mtime) {
+    char walked[TAR_PATH_MAX];
+    int cluster = imp->base;
+
+    if (strcmp(path, imp->last_dir) == 0) {
+        return imp->last_cluster;
+    }
+    strcpy(walked, path);
+    for (char *name = walked; *name != '\0'; ) {
+        char *slash = strchr(name, '/');
+        dir_entry_t e;
+
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (dir_find(imp->vol, cluster, name, &e)) {
+            if (!(e.entry.attributes & 0x10)) {
+                printf("%s: There is a file of the same name in the disk.\n", path);
+                return -1;
+            }
+            cluster = e.entry.cluster;
+        } else {
+            entry_t entry = {0};
+            stamp(&entry, mtime);
+            if ((cluster = dir_mkdir(imp->vol, cluster, name, &entry)) == 0) {
+                printf("%s: No room for the directory.\n", path);
+                return -1;
+            }
+        }
+        if (slash == NULL) {
+            break;
+        }
+        name = slash + 1;
+    }
+    strcpy(imp->last_dir, path);
+    imp->last_cluster = cluster;
+    return cluster;
+}
+
+/**
+ * Function:  import_file
+ * --------------------
+ * @brief store a file member of the archive, whose data is next on the
+ *        stream, in a new chain of clusters and add its entry.
+ *
+ * @param imp: the import.
+ * @param dir_cluster: the directory the file goes in.
+ * @param name: the name of the file.
+ * @param m: the member.
+ *
+ * @return 0 on success, -1 if it can't be stored, with its clusters freed.
+ *
+ */
+int import_file(import_t *imp, int dir_cluster, const char *name, const tar_entry_t *m) {
+    volume_t *vol = imp->vol;
+    dir_entry_t e;
+    int n, i;
+
+    if (dir_find(vol, dir_cluster, name, &e)) {
+        printf("%s: There is a file of the same name in the disk.\n", m->path);
+        return -1;
+    }
+    if (m->size > UINT32_MAX || m->size > (uint64_t)vol_free_clusters(vol) * vol->cluster_size) {
+        printf("%s: No enough free space in the disk image.\n", m->path);
+        return -1;
+    }
+
+    // the data comes off the stream in file order, straight into the chain
+    int clusters_needed = m->size / vol->cluster_size + (m->size % vol->cluster_size != 0);
+    uint16_t *chain = vol_alloc_chain(vol, clusters_needed);
+    extent_t *extents = file_extents(vol, chain, 0, m->size, &n);
+    char *buf = emalloc(XFER_CHUNK);
+    int ret = 0;
+    for (i = 0; i < n && ret == 0; i++) {
+        uint32_t done;
+        for (done = 0; done < extents[i].length; done += XFER_CHUNK) {
+            uint32_t length = extents[i].length - done < XFER_CHUNK ? extents[i].length - done : XFER_CHUNK;
+            if (tar_read_full(STDIN_FILENO, buf, length) != 0 ||
+                vol_write_data(vol, buf, length, extents[i].dst_offset + done) != length) {
+                printf("%s: Failed to copy the file into the disk image.\n", m->path);
+                ret = -1;
+                break;
+            }
+        }
+    }
+    free(buf);
+    free(extents);
+    if (ret != 0) {
+        vol_free_chain(vol, clusters_needed > 0 ? chain[0] : 0);
+        free(chain);
+        return -1;
+    }
+
+    entry_t entry = {0};
+    entry.size = m->size;
+    entry.cluster = clusters_needed > 0 ? chain[0] : 0;
+    stamp(&entry, m->mtime);
+    free(chain);
+    if (dir_add(vol, dir_cluster, name, &entry, 0) != 0) {
+        vol_free_chain(vol, entry.cluster);
+        printf("%s: The directory is full.\n", m->path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function:  stop_import
+ * --------------------
+ * @brief end a failed import. Evicted cache blocks and FAT pages may have
+ *        reached the disk already, so the members imported so far, whose
+ *        entries, chains and data are all complete, are flushed rather than
+ *        left half written.
+ *
+ */
+void stop_import(import_t *imp) {
+    if (vol_close(imp->vol) != 0) {
+        printf("Failed to write the changes to the disk image.\n");
+    }
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    import_t imp = {0};
+    tar_entry_t m;
+    int ret;
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: diskimport <disk.img> [directory] < archive.tar\n");
+        exit(-1);
+    }
+    if ((imp.vol = vol_open(argv[1], 1)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        exit(-1);
+    }
+    if (argc == 3 && strspn(argv[2], "/") != strlen(argv[2])) {
+        dir_entry_t e;
+        if (!dir_resolve(imp.vol, argv[2], &e) || !(e.entry.attributes & 0x10)) {
+            printf("%s: Directory not found.\n", argv[2]);
+            exit(-1);
+        }
+        imp.base = e.entry.cluster;
+    }
+    imp.last_cluster = imp.base;
+
+    // a failing member leaves nothing allocated; the ones before it are kept
+    memset(&m, 0, sizeof(m));
+    while ((ret = tar_read_header(STDIN_FILENO, &m)) == 1) {
+        uint64_t padding = (TAR_BLOCK - m.size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (clean_path(m.path) != 0) {
+            printf("%s: Paths with .. are not imported.\n", m.path);
+            stop_import(&imp);
+        }
+        char *slash = strrchr(m.path, '/');
+        const char *name = slash != NULL ? slash + 1 : m.path;
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        const char *parent = slash != NULL ? m.path : "";
+
+        if (m.type == TAR_DIR) {
+            if (name[0] != '\0') {
+                if (slash != NULL) {
+                    *slash = '/';
+                }
+                if (find_dir(&imp, m.path, m.mtime) < 0) {
+                    stop_import(&imp);
+                }
+            }
+            ret = tar_skip(STDIN_FILENO, m.size + padding);
+        } else if (m.type == TAR_FILE && name[0] != '\0') {
+            int dir_cluster = find_dir(&imp, parent, m.mtime);
+            if (slash != NULL) {
+                *slash = '/';
+            }
+            if (dir_cluster < 0 || import_file(&imp, dir_cluster, name, &m) != 0) {
+                stop_import(&imp);
+            }
+            ret = tar_skip(STDIN_FILENO, padding);
+        } else {
+            if (slash != NULL) {
+                *slash = '/';
+            }
+            printf("%s: Skipped, only files and directories are imported.\n", m.path);
+            imp.skipped++;
+            ret = tar_skip(STDIN_FILENO, m.size + padding);
+        }
+        if (ret != 0) {
+            break;
+        }
+        memset(&m, 0, sizeof(m));
+    }
+    if (ret != 0) {
+        printf("The archive is damaged or cut short.\n");
+        stop_import(&imp);
+    }
+
+    if (vol_close(imp.vol) != 0) {
+        printf("Failed to write the changes to the disk image.\n");
+        exit(-1);
+    }
+    return 0;
+}
@@ -3,204 +3,230 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <string.h>
+#include "dirscan.h"
 #include "emalloc.h"
+#include "fleet.h"
+#include "readahead.h"
 #include "sfs.h"
+#include "volume.h"
 
-boot_t boot_sector;
-entry_t root_dir;
-fat_entry_t fat;
+#ifdef SFS_MULTICALL
+#define main diskinfo_main    // one of the tools linked into sfs
+#endif
 
-char *fat_table;
-int fat_size = 0;
-int file_count = 0;
+/*
+ * The statistics diskinfo reports for one disk image.
+ */
+typedef struct {
+    char      os_name[9];
+    char      label[9];
+    int       disk_size;
+    int       free_disk_size;
+    int       file_count;
+    int       fat_copies;
+    int       sectors_per_fat;
+} disk_info_t;
 
 /**
- * Function:  get_fat
+ * Function:  count_files_in_dir
  * --------------------
- * @brief get the value of the FAT entry.
+ * @brief: get the number of files in the directory.
  *
- * @param i The index of the FAT entry.
+ * @param vol: the disk containing the directory.
+ * @param  dir_cluster: the first logical cluster of the directory, 0 for the root directory.
  *
- * @return The value of the FAT entry.
+ * @return: The number of files in the directory.
  *
  */
-int get_fat(int i) {
+int count_files_in_dir(volume_t *vol, uint16_t dir_cluster) {
+    int file_count = 0;
+    entry_t entry;
+    char *buf;
     int j;
+    uint16_t local_dir_cluster = dir_cluster;
+    uint32_t sector;
+    int window = readahead_window();
+    int walked = 0;
 
-    if (fat_table == NULL || fat_size == 0) {
-        /* File system data hasn't loaded yet */
-        return -1;
-    }
-    if (i & 0x01) {
-        j = (1 + i * 3) / 2;
-        return ((fat_table[j - 1] & 0xF0) >> 4) + (fat_table[j] << 4);
-    } else {
-        j = i * 3 / 2;
-        return ((fat_table[j + 1] & 0x0F) << 8) + fat_table[j];
+    buf = emalloc(vol->bytes_per_sector);
+    vol_hint_dir(vol, dir_cluster, window);
+    // for each sector
+    for (sector = vol_dir_start(vol, dir_cluster); sector != 0; ) {
+        memcpy(buf, vol_read_sector(vol, sector), vol->bytes_per_sector);
+        // for each run of entries in the sector, visit the live ones but . & ..
+        for (j = 0; j < vol->bytes_per_sector; j += DIRSCAN_MAX * sizeof(entry_t)) {
+            int entries = (vol->bytes_per_sector - j) / sizeof(entry_t);
+            dirscan_t scan;
+
+            dirscan(buf + j, entries < DIRSCAN_MAX ? entries : DIRSCAN_MAX, &scan);
+            uint64_t visit = (scan.live & ~scan.dot) & dirscan_before_end(&scan);
+            for (; visit != 0; visit &= visit - 1) {
+                memcpy(&entry, buf + j + __builtin_ctzll(visit) * sizeof(entry_t), sizeof(entry_t));
+                if (entry.cluster<2){ // skip entry with the first logical sector to be 0 or 1
+                    continue;
+                }
+
+                if (entry.attributes & 0x10) { // Subdirectory
+                    file_count += count_files_in_dir(vol, entry.cluster);
+                } else {
+                    file_count += 1;
+                }
+            }
+            if (scan.end != 0) {
+                free(buf);
+                return file_count; // free entry & no more
+            }
+        }
+        uint16_t prev_cluster = local_dir_cluster;
+        sector = vol_dir_next(vol, &local_dir_cluster, sector);
+        if (local_dir_cluster != prev_cluster && ++walked == window) {   // slide the readahead window forward
+            vol_hint_dir(vol, local_dir_cluster, window);
+            walked = 0;
+        }
     }
+    free(buf);
+    return file_count;
 }
 
 /**
- * Function:  getFreeBlocks
+ * Function:  get_label
  * --------------------
- * @brief get the number of unused sectors by looking at the FAT entries.
+ * @brief find the volume label entry (attribute 0x08) in the root directory.
  *
- * @return: The number of unused sectors.
+ * @param vol: the disk.
+ * @param label: buffer of 9 bytes for the label.
  *
  */
-int getFreeBlocks() {
-    int i, free_blocks = 0;
-
-    if (fat_table == NULL || fat_size == 0) {
-        /* File system data hasn't loaded yet */
-        return -1;
-    }
+void get_label(volume_t *vol, char *label) {
+    entry_t dir;
+    uint32_t sector;
+    int i, j;
 
-    // the first two entries in FAT are reserved
-    for (i = 2; i < fat_size; i++) {
-        if (get_fat(i) == 0) {
-            // 0x000 in an FAT entry means unused
-            free_blocks += 1;
+    label[0] = '\0';
+    for (sector = vol->root_sector; sector < vol->data_sector; sector++) {
+        const char *buf = vol_read_sector(vol, sector);
+        for (j = 0; j < vol->bytes_per_sector; j += sizeof(entry_t)) {
+            // the first entry is never the label
+            if (sector == vol->root_sector && j == 0) {
+                continue;
+            }
+            memcpy(&dir, buf + j, sizeof(entry_t));
+            if (dir.attributes == 0x08) {
+                for (i = 0; i < 8; i++) {
+                    label[i] = dir.filename[i];
+                }
+                label[8] = '\0';
+                return;
+            }
         }
     }
-    return free_blocks;
 }
 
 /**
- * Function:  count_files_in_dir
+ * Function:  get_disk_info
  * --------------------
- * @brief: get the number of files in the directory.
+ * @brief gather the statistics of a disk image.
  *
- * @param fp: a pointer to the disk containing the directory.
- * @param  dir_cluster: the logical sector of the directory.
- * 
- * @return: The number of files in the directory.
+ * @param image: the path of the disk image.
+ * @param info: the statistics to fill in.
+ *
+ * @return 0 on success, -1 if the image can't be opened.
  *
  */
-void count_files_in_dir(FILE *fp, uint16_t dir_cluster) {
-    entry_t entry;
-    char *buf;
-    int i, j;
-    uint16_t local_dir_cluster = dir_cluster;
-    uint32_t address = dir_cluster == 0 ? 0x2600 : (dir_cluster + 33 - 2) * 512;
+int get_disk_info(const char *image, disk_info_t *info) {
+    volume_t *vol;
 
-    buf = emalloc(boot_sector.bytes_per_sector);
-    // for each sector
-    for (;;) {
-        fseek(fp, address, SEEK_SET);
-        fread(buf, boot_sector.bytes_per_sector, 1, fp);
-        // for each entry in the sector
-        for (j = 0; j < boot_sector.bytes_per_sector; j += sizeof(entry_t)) {
-            memcpy(&entry, buf + j, sizeof(entry_t));
-
-            if ((uint8_t)entry.filename[0] == 0x00)
-                return; // free entry & no more
-            if ((uint8_t)entry.filename[0] == 0xE5)
-                continue; // this entry is free
-            if (entry.attributes == 0x0F)
-                continue; // skip long file name
-            if ((uint8_t)entry.filename[0] == 0x2E)
-                continue; // skip . & .. entries
-            if (entry.cluster<2){ // skip entry with the first logical sector to be 0 or 1
-                continue;
-            }
-
-            if (entry.attributes & 0x10) { // Subdirectory
-                count_files_in_dir(fp, entry.cluster);
-            } else {
-                file_count += 1;
-            }
-        }
-        if (local_dir_cluster == 0) { // root directory
-            address += boot_sector.bytes_per_sector;
-        } else {
-            if (get_fat(local_dir_cluster) >= (uint16_t)0x0FF8 || get_fat(local_dir_cluster) == 0xFF) {
-                break; // no more sectors
-            } else {
-                address = (get_fat(local_dir_cluster) + 33 - 2) * 512;
-                local_dir_cluster = get_fat(local_dir_cluster);
-            }
-        }
+    if ((vol = vol_open(image, 0)) == NULL) {
+        return -1;
     }
-}
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: diskinfo <disk.img>\n");
-        exit(-1);
+    for(int i =0;i<8;i++){
+        info->os_name[i] = vol->boot.name[i];
     }
+    info->os_name[8]='\0';
+    info->disk_size = vol->total_sectors * vol->bytes_per_sector;
 
-    FILE *fp;
+    // In the root directory, find the directory entry with attribute 0X08
+    get_label(vol, info->label);
 
-    if ((fp = fopen(argv[1], "r")) == NULL) {
-        fprintf(stderr, "Failed to open %s\n", argv[1]);
-        exit(1);
-    }
+    // get free size of the disk
+    info->free_disk_size = vol_free_clusters(vol) * vol->cluster_size;
 
-    /* Read boot sector */
-    fseek(fp, 0x0, SEEK_SET);
-    fread(&boot_sector, sizeof(boot_sector), 1, fp);
+    // get the number of files
+    info->file_count = count_files_in_dir(vol, 0);
 
-    char os_name[9];
-    for(int i =0;i<8;i++){
-        os_name[i] = boot_sector.name[i];
+    info->fat_copies = vol->boot.fats;
+    info->sectors_per_fat = vol->boot.sectors_per_fat;
+
+    vol_close(vol);
+    return 0;
+}
+
+/**
+ * Function:  info_json
+ * --------------------
+ * @brief scan one image of a fleet and format its statistics as a JSON line.
+ *
+ * @param image: the path of the disk image.
+ *
+ * @return The JSON line.
+ *
+ */
+char *info_json(const char *image) {
+    disk_info_t info;
+    char *line;
+    size_t size;
+    FILE *out = open_memstream(&line, &size);
+
+    fprintf(out, "{\"image\":");
+    json_string(out, image);
+    if (get_disk_info(image, &info) != 0) {
+        fprintf(out, ",\"error\":\"Failed to open\"}");
+        fclose(out);
+        return line;
     }
-    os_name[8]='\0';
-    int disk_size = boot_sector.total_sectors * boot_sector.bytes_per_sector;
+    fprintf(out, ",\"os_name\":");
+    json_string(out, info.os_name);
+    fprintf(out, ",\"label\":");
+    json_string(out, info.label);
+    fprintf(out, ",\"total_size\":%d,\"free_size\":%d,\"files\":%d,\"fat_copies\":%d,\"sectors_per_fat\":%d}",
+            info.disk_size, info.free_disk_size, info.file_count, info.fat_copies, info.sectors_per_fat);
+    fclose(out);
+    return line;
+}
 
-    /* Read root directory */
-    int start_byte_of_root_dir = 19 * boot_sector.bytes_per_sector;
-    int end_byte_of_root_dir = start_byte_of_root_dir + 14 * boot_sector.bytes_per_sector;
-    fseek(fp, start_byte_of_root_dir, SEEK_SET);
-    fread(&root_dir, sizeof(root_dir), 1, fp);
+int main(int argc, char *argv[]) {
+    fleet_opts_t opts;
+    int first = fleet_parse(argc, argv, &opts);
 
-    // In the root directory, find the directory entry with attribute 0X08
-    entry_t dir;
-    dir.attributes = 0;
-    int start_byte_of_entry  = start_byte_of_root_dir;
-    while(dir.attributes!= 0x08 && start_byte_of_entry<end_byte_of_root_dir){
-        start_byte_of_entry += 32;       // go to the next entry
-        fseek(fp, start_byte_of_entry, SEEK_SET);
-        fread(&dir, sizeof(dir), 1, fp);
+    if (first < 0 || first >= argc) {
+        fprintf(stderr, "usage: diskinfo [-j threads] [--unordered] [--json] <disk.img|dir>...\n");
+        exit(-1);
     }
-    char label[9];
-    for(int i =0;i<8;i++){
-        label[i] = dir.filename[i];
+
+    int image_count;
+    char **images = fleet_collect(argv + first, argc - first, &image_count);
+
+    // many images, or a directory of them, are scanned in parallel as JSON lines
+    if (opts.json || image_count != 1 || strcmp(images[0], argv[first]) != 0) {
+        fleet_run(images, image_count, info_json, &opts, stdout);
+        return 0;
     }
-    label[8] = '\0';
 
-    int fat_mem_size;
-    /* Allocate space for memory copy of the FAT */
-    fat_size = boot_sector.total_sectors - 33 + 2;
-    fat_mem_size = (fat_size & 0x01) ? (fat_size*3+1)/2 : fat_size*3/2;
-    fat_table = emalloc(fat_mem_size);
-    /* read a FAT copy */
-    fseek(fp, 0x200, SEEK_SET);
-    fread(fat_table, fat_mem_size, 1, fp);
+    disk_info_t info;
 
-    // get free size of the disk
-    int freeBlocks = getFreeBlocks();
-    if(freeBlocks == -1){
-        printf("File system data hasn't loaded yet");
-        exit(-1);
+    if (get_disk_info(argv[first], &info) != 0) {
+        fprintf(stderr, "Failed to open %s\n", argv[first]);
+        exit(1);
     }
-    int free_disk_size = freeBlocks * boot_sector.bytes_per_sector;
 
-    // get the number of files
-    count_files_in_dir(fp,0);
-
-    int FAT_num = boot_sector.fats;
-    int sectors_per_FAT = boot_sector.sectors_per_fat;
-
-    fclose(fp);
-    
-    // print the statistics of the disk image 
-    printf("OS Name: %s\n", os_name);
-    printf("Label of the disk: %s\n", label);
-    printf("Total size of the disk: %d\n", disk_size);
-    printf("Free size of the disk: %d\n", free_disk_size);
-    printf("The number of files in the disk: %d\n", file_count);
-    printf("Number of FAT copies: %d\n", FAT_num);
-    printf("Sectors per FAT: %d\n", sectors_per_FAT);
-
-}
\ No newline at end of file
+    // print the statistics of the disk image
+    printf("OS Name: %s\n", info.os_name);
+    printf("Label of the disk: %s\n", info.label);
+    printf("Total size of the disk: %d\n", info.disk_size);
+    printf("Free size of the disk: %d\n", info.free_disk_size);
+    printf("The number of files in the disk: %d\n", info.file_count);
+    printf("Number of FAT copies: %d\n", info.fat_copies);
+    printf("Sectors per FAT: %d\n", info.sectors_per_fat);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "overlay.h"
+
+/**
+ * Function:  open_overlay
+ * --------------------
+ * @brief open a delta file and its base image, or exit.
+ *
+ * @param delta: the delta file.
+ * @param writable: 1 to open the delta file for writing as well.
+ *
+ * @return The open overlay.
+ *
+ */
+overlay_t *open_overlay(const char *delta, int writable) {
+    overlay_t *o;
+    int fd;
+
+    if ((fd = open(delta, writable ? O_RDWR : O_RDONLY)) < 0) {
+        fprintf(stderr, "Failed to open %s\n", delta);
+        exit(-1);
+    }
+    if (!overlay_detect(fd)) {
+        printf("%s is not an overlay.\n", delta);
+        exit(-1);
+    }
+    if ((o = overlay_open(fd)) == NULL) {
+        printf("%s: The base image is missing or has changed.\n", delta);
+        exit(-1);
+    }
+    return o;
+}
+
+/**
+ * Function:  commit
+ * --------------------
+ * @brief write the sectors of an overlay into its base image and empty the
+ *        overlay. The delta is only emptied once the base is on disk.
+ *
+ * @return 0 on success, -1 on failure.
+ *
+ */
+int commit(const char *delta) {
+    overlay_t *o = open_overlay(delta, 1);
+    int base_fd, count;
+
+    if ((base_fd = open(o->base_path, O_WRONLY)) < 0) {
+        printf("%s: Failed to open the base image for writing.\n", o->base_path);
+        return -1;
+    }
+    if ((count = overlay_merge(o, base_fd)) < 0 || fsync(base_fd) != 0) {
+        printf("Failed to write %s\n", o->base_path);
+        return -1;
+    }
+    close(base_fd);
+    if (overlay_reset(o) != 0) {
+        printf("Failed to empty %s\n", delta);
+        return -1;
+    }
+    printf("%d sectors written to %s\n", count, o->base_path);
+    close(o->fd);
+    overlay_close(o);
+    return 0;
+}
+
+/**
+ * Function:  flatten
+ * --------------------
+ * @brief write the image an overlay shows to a new raw image, leaving the
+ *        base image and the overlay alone.
+ *
+ * @return 0 on success, -1 on failure.
+ *
+ */
+int flatten(const char *delta, const char *output) {
+    overlay_t *o = open_overlay(delta, 0);
+    char *buf = emalloc(64 * 1024);
+    off_t offset;
+    int fd;
+
+    // never overwrite an existing image
+    if ((fd = open(output, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        printf("%s already exists.\n", output);
+        return -1;
+    }
+    for (offset = 0; (uint64_t)offset < o->header.base_size; offset += 64 * 1024) {
+        ssize_t got = overlay_pread(o, buf, 64 * 1024, offset);
+        if (got <= 0 || pwrite(fd, buf, got, offset) != got) {
+            printf("Failed to write %s\n", output);
+            close(fd);
+            unlink(output);
+            return -1;
+        }
+    }
+    if (fsync(fd) != 0) {
+        printf("Failed to write %s\n", output);
+        close(fd);
+        unlink(output);
+        return -1;
+    }
+    close(fd);
+    free(buf);
+    close(o->fd);
+    overlay_close(o);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        return commit(argv[2]) == 0 ? 0 : -1;
+    }
+    if (argc == 4 && strcmp(argv[1], "-f") == 0) {
+        return flatten(argv[2], argv[3]) == 0 ? 0 : -1;
+    }
+    if (argc != 3 || argv[1][0] == '-') {
+        fprintf(stderr, "usage: diskoverlay <base.img> <delta>\n"
+                        "       diskoverlay -c <delta>\n"
+                        "       diskoverlay -f <delta> <output.img>\n");
+        exit(-1);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        exit(-1);
+    }
+    if (overlay_detect(fd)) {
+        printf("%s is an overlay; overlays can't be stacked.\n", argv[1]);
+        exit(-1);
+    }
+    close(fd);
+    if (access(argv[2], F_OK) == 0) {
+        printf("%s already exists.\n", argv[2]);
+        exit(-1);
+    }
+    if (overlay_create(argv[1], argv[2]) != 0) {
+        printf("Failed to create %s\n", argv[2]);
+        exit(-1);
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
+#include "dir.h"
+#include "dostime.h"
 #include "emalloc.h"
+#include "file.h"
 #include "sfs.h"
-#include <ctype.h>
+#include "volume.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,532 +12,345 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
-boot_t boot_sector;
-char *fat_table;
-int fat_size = 0;
-entry_t root_dir;
+#ifdef SFS_MULTICALL
+#define main diskput_main    // one of the tools linked into sfs
+#endif
 
-FILE *disk;
+volume_t *disk;
 FILE *file;
+int verify = 0;     // XFER_VERIFY to read the written clusters back
 
 /**
- * Function:  trimFileName
- * --------------------
- * @brief Process the file name.
- *
- * @param  filename The unformatted name of the file
- * @param  ext The extension of the file
- *
- * @return The formatted file name with extension (if any)
- *
- */
-char *trimFileName(char *filename, char *ext) {
-    char *new_str;
-    new_str = emalloc(13);
-    int i, j = 0;
-    for (i = 0; i < 8; i++)
-        if (filename[i] != 0x20)
-            new_str[j++] = filename[i];
-
-    // if the file has an extension
-    if (ext[0] != 0x20) {
-        new_str[j++] = '.';
-        for (i = 0; i < 3; i++)
-            if (ext[i] != 0x020)
-                new_str[j++] = ext[i];
-        new_str[j++] = '\0';
-    }
-    return new_str;
-}
-
-
-/**
- * Function:  get_fat
- * --------------------
- * @brief get the value of the FAT entry.
- *
- * @param i The index of the FAT entry.
- *
- * @return The value of the FAT entry.
- *
- */
-uint16_t get_fat(uint16_t i) {
-    uint16_t j;
-
-    if (fat_table == NULL || fat_size == 0) {
-        /* File system data hasn't loaded yet */
-        return 0;
-    }
-    if (i & 0x01) {     // odd
-        j = (1 + i * 3) / 2;
-        return ((fat_table[j - 1] & 0xF0) >> 4) + (fat_table[j] << 4);
-    } else {            // even
-        j = i * 3 / 2;  
-        return ((fat_table[j + 1] & 0x0F) << 8) + (fat_table[j] & 0x0FF);
-    }
-}
-
-
-/**
- * Function:  update_fat
- * --------------------
- * @brief update the FAT entry.
- *
- * @param i The index of the FAT entry to be updated.
- * @param new_val the new value of the FAT entry
- *
- */
-void update_fat(uint16_t i, uint16_t new_val) {
-    new_val = new_val & 0xFFF;
-    uint16_t j;
-
-    if (i & 0x01) {     //odd
-        j = (1 + i * 3) / 2;
-        fat_table[j]= (new_val>> 4) & 0xFF;
-        fat_table[j-1] =  ((new_val & 0x0F) << 4) + (fat_table[j-1]);
-    } else {            //even
-        j = i * 3 / 2;
-        fat_table[j]= new_val & 0xFF;
-        fat_table[j+1]= ((new_val >> 8 ) & 0x0F) + (fat_table[j+1]);
-    }
-}
-
-
-/**
- * Function:  getFreeBlocks
- * --------------------
- * @brief get the number of unused sectors by looking at the FAT entries.
- *
- * @return: The number of unused sectors.
- *
- */
-int getFreeBlocks() {
-    int i, free_blocks = 0;
-
-    if (fat_table == NULL || fat_size == 0) {
-        /* File system data hasn't loaded yet */
-        return -1;
-    }
-
-    // the first two entries in FAT are reserved
-    for (i = 2; i < fat_size; i++) {
-        if (get_fat(i) == 0) {
-            // 0x000 in an FAT entry means unused
-            free_blocks += 1;
-        }
-    }
-    return free_blocks;
-}
-
-
-/**
- * Function:  get_free_entry_in_root_dir
+ * Function:  check_root_dir
  * --------------------
  * @brief Scan through every used entry in the root directory and check if there is a file of 
- *        the same name in the disk. If not, return a free entry in the root directory.
+ *        the same name in the disk, by its long or short name.
  *        
  * @param disk: a pointer the disk 
  * @param file_name: the name of the file to be put in the disk.  
- * @param free_entry_address: the address of the free_entry
  *
  */
-void get_free_entry_in_root_dir (FILE* disk, char* file_name, int* free_entry_address){
-    int start_byte_of_root_dir = 19 * boot_sector.bytes_per_sector;
-    int start_byte = start_byte_of_root_dir;
-    int end_byte_of_root_dir = start_byte_of_root_dir + 14* boot_sector.bytes_per_sector;
-    while (start_byte<end_byte_of_root_dir){    // for every entry in the root directory
-        entry_t cur_entry;
-        fseek(disk, start_byte, SEEK_SET);
-        fread(&cur_entry, sizeof(cur_entry), 1, disk);
-
-        if ((uint8_t)cur_entry.filename[0] == 0x00) { // free entry & no more
-            *free_entry_address = start_byte;
-            return; 
-        }
-        if ((uint8_t)cur_entry.filename[0] == 0xE5){    // this entry is free
-            *free_entry_address = start_byte;
-            start_byte += 32;
-            continue; 
-        }
-        char* cur_file_name = trimFileName(cur_entry.filename, cur_entry.extension);
-        if (strcmp(cur_file_name, file_name)==0) {
-            printf("There is a file of the same name in the disk.\n");
-            fclose(disk);
-            fclose(file);
-            exit(-1);
-        }
-        start_byte += 32;
+void check_root_dir (volume_t* disk, char* file_name){
+    dir_entry_t e;
+
+    if (dir_find(disk, 0, file_name, &e)) {
+        printf("There is a file of the same name in the disk.\n");
+        vol_close(disk);
+        fclose(file);
+        exit(-1);
     }
 }
 
 
 /**
- * Function:  get_free_sub_dir_entries
+ * Function:  find_sub_dir
  * --------------------
  * @brief Scan through every used entry in all directory and check if there is a file of 
- *        the same name in the disk. If not, return a free entry in the destination directory.
+ *        the same name in the disk. If not, find the destination directory.
  *        
- * @param fp: a pointer to the disk
- * @param dir_cluster: the logical sector in the directory.
- * @param destination: the name of the directory to scan for free entry.
- * @param free_entry_address: the address of the free entry.
- * @param file_name: the name of the file to be put into the disk. 
- * @param cur_dir_name: the name of the current scanning directory.
+ * @param disk: the disk
+ * @param dir_cluster: the first logical cluster of the directory, 0 for the root directory.
+ * @param destination: the name of the directory to look for.
+ * @param dest_cluster: set to the first logical cluster of the destination directory.
+ * @param file_name: the name of the file to be put into the disk, NULL to skip the check. 
  *
  */
-void get_free_sub_dir_entries(FILE *fp, uint16_t dir_cluster, char* destination, int* free_entry_address, char* file_name, char* cur_dir_name) {
-    entry_t entry;
-    char *buf;
-    int i, j;
-    uint16_t local_dir_cluster = dir_cluster;
-    uint32_t address = dir_cluster == 0 ? 0x2600 : (dir_cluster + 33 - 2) * 512;
-
-    buf = emalloc(boot_sector.bytes_per_sector);
-    // for each sector
-    for (;;) {
-        fseek(fp, address, SEEK_SET);
-        fread(buf, boot_sector.bytes_per_sector, 1, fp);
-        // for each entry in the sector
-        for (j = 0; j < boot_sector.bytes_per_sector; j += sizeof(entry_t)) {
-            memcpy(&entry, buf + j, sizeof(entry_t));
-
-            if ((uint8_t)entry.filename[0] == 0x00){    // free entry & no more
-                if(strcmp(destination,cur_dir_name) == 0){
-                    *free_entry_address = address + j;
-                }
-                return;
-            }
-            if ((uint8_t)entry.filename[0] == 0xE5){    // this entry is free
-                if(strcmp(destination,cur_dir_name) == 0){
-                    *free_entry_address = address + j;
-                }
-                continue; 
-            }
-            if (entry.attributes == 0x0F){
-                continue; // skip long file name
-            }
-            if ((uint8_t)entry.filename[0] == 0x2E){
-                continue; // skip . & .. entries
-            }
-            
-            if (entry.attributes & 0x10) { // Subdirectory
-                get_free_sub_dir_entries(fp, entry.cluster, destination, free_entry_address, file_name, entry.filename);
-            }
-            else{
-                char* cur_file_name = trimFileName(entry.filename, entry.extension);
-                if (strcmp(cur_file_name, file_name)==0){
-                    printf("There is a file of the same name in the disk.\n");
-                    fclose(disk);
-                    fclose(file);
-                    exit(-1);
-                }
-            }
+void find_sub_dir(volume_t *disk, uint16_t dir_cluster, char* destination, int* dest_cluster, char* file_name) {
+    dir_entry_t e;
+    dir_t dir;
+
+    dir_open(&dir, disk, dir_cluster);
+    while (dir_read(&dir, &e)) {
+        if ((uint8_t)e.entry.filename[0] == 0x2E || (e.entry.attributes & 0x08)){
+            continue; // skip . & .. entries and the volume label
         }
-        if (local_dir_cluster == 0) { // root directory
-            address += boot_sector.bytes_per_sector;
-        } else {
-            if (get_fat(local_dir_cluster) >= (uint16_t)0x0FF8 || get_fat(local_dir_cluster) == 0xFF) {
-                break; // no more sectors
-            } else {
-                address = (get_fat(local_dir_cluster) + 33 - 2) * 512;
-                local_dir_cluster = get_fat(local_dir_cluster);
+
+        if (e.entry.attributes & 0x10) { // Subdirectory
+            if (dir_match(&e, destination)) {
+                *dest_cluster = e.entry.cluster;
             }
+            find_sub_dir(disk, e.entry.cluster, destination, dest_cluster, file_name);
+        }
+        else if (file_name != NULL && dir_match(&e, file_name)){
+            printf("There is a file of the same name in the disk.\n");
+            vol_close(disk);
+            fclose(file);
+            exit(-1);
         }
     }
+    dir_close(&dir);
 }
 
 
 /**
  * Function:  fill_info_to_entry
  * --------------------
- * @brief fill the size of the file, the file name, the file extension and 
- *        the first_physical_sector to the file entry.
+ * @brief fill the size of the file and the first_physical_sector to the 
+ *        file entry. Its name is filled in when it is added to a directory.
  *        
  * @param file: a pointer to the file to be put into the disk
- * @param file_name: the name of the file to be put into the disk. 
- * @param first_physical_sector: the first physical sector of the file data to be put in the disk.
+ * @param first_cluster: the first logical cluster of the file data, 0 for an empty file.
  * 
  * @return The partly filled file entry
  */
-entry_t fill_info_to_entry (FILE* file, char* file_name, int first_physical_sector) {
+entry_t fill_info_to_entry (FILE* file, uint16_t first_cluster) {
     // initialize an entry with the attributes are all 0;
     entry_t entry = {0};
     // get the size of the file
     fseek(file, 0, SEEK_END);
     int file_size = ftell(file);
     entry.size = file_size;
-    
-    int i = 0;
-    // initialize entry.filename and entry.extension with spaces
-    while(i<3){
-        entry.extension[i] = ' ';
-        entry.filename[i] = ' ';
-        i++;
-    }
-    while(i<8){
-        entry.filename[i] = ' ';
-        i++;
-    }
 
-    // store the name and extension to the entry
-    i = 0;
-    int any_extension = 1;  // 0 for False, 1 for True
-    while (file_name[i]!='.'){
-        if(i==8){
-            any_extension = 0;
-            break;
-        }
-        entry.filename[i] = file_name[i];
-        i++;
-    }
-    if(any_extension==1){
-        i++;
-        int j=0;
-        while(file_name[i]!='\0'){
-            entry.extension[j] = file_name[i];
-            i++;
-            j++;
-        }
-    }
-
-    // store the first physical sector
-    entry.cluster = first_physical_sector - 33 +2;
+    // store the first logical cluster
+    entry.cluster = first_cluster;
     return entry;
 }
 
 
 /**
- * Function:  get_free_sector
+ * Function:  update_file
  * --------------------
- * @brief  get a free sector in the data area of the disk.
+ * @brief rewrite a file already in the disk, or add to its end, reusing its 
+ *        chain of clusters. The chain is extended or cut to the new size, and 
+ *        only the bytes that change are written.
  *        
- *
- * @param file_name: the name of the file to be put into the disk. 
- * @param first_physical_sector: the first physical sector of the file data to be put in the disk.
- * 
- * @return the free sector in the data area of the disk.
+ * @param e: the entry of the file in the disk.
+ * @param append: 1 to add the local file at the end, 0 to replace the contents.
+ * @param compare: 1 to skip clusters that already hold the same data, when replacing.
  * 
  */
-int get_free_sector(){
-    int data_area_start_sector = 33;
-    int start_sector = data_area_start_sector;
-    int start_address = 33 * boot_sector.bytes_per_sector;
-    while(get_fat(start_sector+33-2)!=0x00){
-        start_sector+=1;
-        start_address += boot_sector.bytes_per_sector;
-    }
-    return start_sector;
-}
-
+void update_file (dir_entry_t *e, int append, int compare){
+    uint32_t cluster_size = disk->cluster_size;
+    fseek(file, 0, SEEK_END);
+    uint32_t file_size = ftell(file);
+    uint32_t old_size = e->entry.size;
+    uint16_t cluster;
+    int old_count = 0, i;
 
-/**
- * Function:  put_in_data_area
- * --------------------
- * @brief store 512 bytes of data of the file to the sector.
- *        
- * @param cur_physical_sector: the sector to store data in.
- * @param sectors_needed: the number of sectors still needed to store all data of the file.
- * @param total_size: total size of the file to be stored.
- * 
- */
-void put_in_data_area (int cur_physical_sector, int sectors_needed, int total_size){
-    int address = cur_physical_sector * 512;
-    sectors_needed -= 1;
-    char content[512];
-    fseek(disk, address, SEEK_SET);
-
-    if (sectors_needed==0) {    // if putting data to the last sector
-        fread(&content, total_size % 512, 1, file); // only read the remaining file
-        fwrite(&content, total_size%512, 1, disk);
-        update_fat(cur_physical_sector - 33 + 2, 0XFFF);
-    }else{
-        fread(&content, 512, 1, file);
-        fwrite(&content, 512, 1, disk);
-        int next_sector = get_free_sector();
-        int next_address = (next_sector -33 + 2) * boot_sector.bytes_per_sector;
-        update_fat(cur_physical_sector - 33 + 2, next_address);
-        put_in_data_area (next_sector, sectors_needed, total_size);
+    // the clusters the file has now, however many the size says
+    uint16_t *old_chain = emalloc(disk->fat_size * sizeof(uint16_t));
+    for (cluster = e->entry.cluster; cluster >= 2 && cluster < disk->fat_size && old_count < disk->fat_size; cluster = vol_get_fat(disk, cluster)) {
+        old_chain[old_count++] = cluster;
     }
-}
-
-
-/**
- * Function:  getFileCreationTime
- * --------------------
- * @brief get the creation time of the file.
- *        
- * @param filename: the name of the file.
- * @param year, month, day, hour, minute: buffers to store data.
- * 
- */
-void getFileCreationTime(char *filename, char* year, char* month, char* day, char*hour, char*minute) {
-    struct stat attr;
-    stat(filename, &attr);
-
-    int i =0;
-    while(i<4){
-        year[i] = ctime(&attr.st_mtime)[i+20];
-        i++;
+    if (old_size > old_count * cluster_size) {
+        old_size = old_count * cluster_size;    // the chain ends early, append after what is there
     }
-    year[i] = '\0';
 
-    i =0;
-    while(i<3){
-        month[i] = ctime(&attr.st_mtime)[i+4];
-        i++;
+    uint32_t start = append ? old_size : 0;
+    uint32_t new_size = start + file_size;
+    int new_count = new_size / cluster_size + (new_size % cluster_size != 0);
+    if (new_count - old_count > vol_free_clusters(disk)) {
+        printf("No enough free space in the disk image.\n");
+        fclose(file);
+        vol_close(disk);
+        exit(-1);
     }
-    month[i] = '\0';
 
-    i =0;
-    while(i<2){
-        day[i] = ctime(&attr.st_mtime)[i+8];
-        i++;
+    // keep the clusters still needed, then extend the chain or free its tail
+    uint16_t *chain = emalloc((new_count + 1) * sizeof(uint16_t));
+    for (i = 0; i < new_count && i < old_count; i++) {
+        chain[i] = old_chain[i];
     }
-    day[i] = '\0';
-
-    i =0;
-    while(i<2){
-        hour[i] = ctime(&attr.st_mtime)[i+11];
-        i++;
+    if (new_count > old_count) {
+        uint16_t *extra = vol_alloc_chain(disk, new_count - old_count);
+        memcpy(chain + old_count, extra, (new_count - old_count) * sizeof(uint16_t));
+        if (old_count > 0) {
+            vol_set_fat(disk, chain[old_count - 1], extra[0]);
+        }
+        free(extra);
+    }
+    if (new_count > 0 && new_count <= old_count) {
+        vol_set_fat(disk, chain[new_count - 1], 0xFFF);
+    }
+    for (i = new_count; i < old_count; i++) {
+        vol_set_fat(disk, old_chain[i], 0x000);
     }
-    hour[i] = '\0';
 
-    i =0;
-    while(i<2){
-        minute[i] = ctime(&attr.st_mtime)[i+14];
-        i++;
+    int ret = file_write(disk, fileno(file), chain, start, file_size, compare && !append, verify);
+    if (ret != 0) {
+        // exit without flushing, so the image keeps its old FAT
+        printf(ret == XFER_MISMATCH ? "The disk image doesn't read back what was written.\n" :
+                                      "Failed to write the file into the disk image.\n");
+        exit(-1);
     }
-    minute[i] = '\0';
-}
 
+    // the entry keeps its creation time and gets the modification time of the local file
+    struct stat st;
+    fstat(fileno(file), &st);
+    dos_stamp_entry(&e->entry, &st, 0);
+    e->entry.size = new_size;
+    e->entry.cluster = new_count > 0 ? chain[0] : 0;
+    vol_write(disk, e->address, &e->entry, sizeof(entry_t));
 
-/**
- * Function:  process_date
- * --------------------
- * @brief process the create date of the file in order to later store it into a file entry in the disk.
- *        
- * @param year, month, day: the buffers containing the data as strings.
- * @param formatted_date: processed data contains the date and ready to be stored into a file entry.
- * 
- */
-void process_date(char *year, char *month, char* day, uint16_t *formatted_date){
-    int year_int = atoi(year);
-    int month_int;
-    if(strcmp(month, "Jan")==0){
-        month_int = 1;
-    }
-    else if(strcmp(month, "Feb")==0){
-        month_int = 2;
-    }
-    else if(strcmp(month, "Mar")==0){
-        month_int = 3;
-    }
-    else if(strcmp(month, "Apr")==0){
-        month_int = 4;
-    }
-    else if(strcmp(month, "May")==0){
-        month_int = 5;
-    }
-    else if(strcmp(month, "Jun")==0){
-        month_int = 6;
-    }
-    else if(strcmp(month, "Jul")==0){
-        month_int = 7;
-    }
-    else if(strcmp(month, "Aug")==0){
-        month_int = 8;
-    }
-    else if(strcmp(month, "Sep")==0){
-        month_int = 9;
-    }
-    else if(strcmp(month, "Oct")==0){
-        month_int = 10;
-    }
-    else if(strcmp(month, "Nov")==0){
-        month_int = 11;
-    }
-    else{
-        month_int = 12;
-    }
-    int day_int = atoi(day);
-    int data_year = year_int - 1980;
-    *formatted_date = (data_year << 9) + (month_int << 5) + day_int;
+    free(old_chain);
+    free(chain);
 }
 
 
 /**
- * Function:  process_time
+ * Function:  put_stream
  * --------------------
- * @brief process the create time of the file in order to later store it into a file entry in the disk.
- *        
- * @param hour, minute: the buffers containing the data as strings.
- * @param formatted_time: processed data contains the time and ready to be stored into a file entry.
- * 
+ * @brief store stdin as a new file, however long it turns out to be. The
+ *        chain grows as the data comes in, and the entry is added with the
+ *        size reached at the end of the stream, stamped with the time now.
+ *
+ * @param dest_cluster: the directory the file goes in, 0 for the root directory.
+ * @param file_name: the name of the file in the disk.
+ *
  */
-void process_time(char *hour, char *minute, uint16_t *formatted_time){
-    int hour_int = atoi(hour);
-    int minute_int = atoi(minute);
-    *formatted_time = (hour_int << 11) + (minute_int << 5);
+void put_stream(int dest_cluster, char *file_name) {
+    uint16_t first_cluster;
+    uint32_t size;
+    struct stat st;
+
+    // a failed stream frees its clusters again; evicted sectors may have reached
+    // the disk already, so the volume is flushed to leave the FAT as it was
+    int ret = file_write_stream(disk, STDIN_FILENO, &first_cluster, &size, verify);
+    if (ret != 0) {
+        printf(ret == FILE_FULL ? "No enough free space in the disk image.\n" :
+               ret == XFER_MISMATCH ? "The disk image doesn't read back what was written.\n" :
+                                      "Failed to write the file into the disk image.\n");
+        vol_close(disk);
+        exit(-1);
+    }
+
+    entry_t new_entry = {0};
+    new_entry.size = size;
+    new_entry.cluster = first_cluster;
+    memset(&st, 0, sizeof(st));
+    clock_gettime(CLOCK_REALTIME, &st.st_mtim);
+    st.st_atim = st.st_mtim;
+    dos_stamp_entry(&new_entry, &st, 1);
+    if (dir_add(disk, dest_cluster, file_name, &new_entry, 0) != 0) {
+        printf("The directory is full. \n");
+        vol_free_chain(disk, first_cluster);
+        vol_close(disk);
+        exit(-1);
+    }
 }
 
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "usage: diskput <disk.img> [destination] <filename>, where [destination] is optional\n");
+    // an existing file is only touched when asked to
+    int overwrite = 0, append = 0, compare = 0;
+    char *disk_name = NULL;
+    verify = 0;     // a script runs main again for every put
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--overwrite") == 0) {
+            overwrite = 1;
+        } else if (strcmp(argv[1], "--append") == 0) {
+            append = 1;
+        } else if (strcmp(argv[1], "--compare") == 0) {
+            compare = 1;
+        } else if (strcmp(argv[1], "--verify") == 0) {
+            verify = XFER_VERIFY;
+        } else if (strncmp(argv[1], "--name=", 7) == 0 && argv[1][7] != '\0') {
+            disk_name = argv[1] + 7;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc < 3 || argc > 4 || (overwrite && append)) {
+        fprintf(stderr, "usage: diskput [--overwrite [--compare] | --append] [--verify] [--name=<name>] <disk.img> [destination] <filename|->, where [destination] is optional\n");
         exit(-1);
     }
 
-    char* file_name;
+    char* host_name;
     char* destination;
     if(argc == 3){
-        file_name = argv[2];
+        host_name = argv[2];
         destination = "ROOT";
     }else{  // argc == 4
-        file_name = argv[3];
+        host_name = argv[3];
         destination = argv[2];
     }
 
-    if ((disk = fopen(argv[1], "r+")) == NULL) {
+    // "-" reads the file from stdin, which has no name of its own
+    int streaming = strcmp(host_name, "-") == 0;
+    if (streaming && (disk_name == NULL || overwrite || append)) {
+        fprintf(stderr, disk_name == NULL ? "A file read from stdin needs --name=<name>.\n" :
+                                            "--overwrite and --append need a named file.\n");
+        exit(-1);
+    }
+
+    if ((disk = vol_open(argv[1], 1)) == NULL) {
         fprintf(stderr, "Failed to open %s\n", argv[1]);
         exit(-1);
     }
 
-    if ((file = fopen(file_name, "r")) == NULL) {
+    if (streaming) {
+        file = stdin;
+    } else if ((file = fopen(host_name, "r")) == NULL) {
         printf("File not found. \n");
-        fclose(disk);
+        vol_close(disk);
         exit(-1);
     }
 
-    // convert the filename to uppercase
-    int i =0;
-    while (file_name[i] != '\0'){
-        file_name[i] = toupper(file_name[i]);
-        i++;
+    // the file keeps the name it has on the host, without the host directories
+    char* file_name = strrchr(host_name, '/') != NULL ? strrchr(host_name, '/') + 1 : host_name;
+    if (disk_name != NULL) {
+        file_name = disk_name;
     }
 
-    /* Read boot sector */
-    fseek(disk, 0x0, SEEK_SET);
-    fread(&boot_sector, sizeof(boot_sector), 1, disk);
-
-    int fat_mem_size;
-    /* Allocate space for memory copy of the FAT */
-    fat_size = boot_sector.total_sectors - 33 + 2;
-    fat_mem_size = (fat_size & 0x01) ? (fat_size*3+1)/2 : fat_size*3/2;
-    fat_table = emalloc(fat_mem_size);
-    /* read a FAT copy */
-    fseek(disk, 0x200, SEEK_SET);
-    fread(fat_table, fat_mem_size, 1, disk);
+    // only the last component of a destination path names the directory
+    if (strrchr(destination, '/') != NULL) {
+        destination = strrchr(destination, '/') + 1;
+    }
+    if (destination[0] == '\0') {
+        destination = "ROOT";
+    }
 
-    // get free size of the disk
-    int freeBlocks = getFreeBlocks();
-    if(freeBlocks == -1){
-        printf("File system data hasn't loaded yet.\n");
-        fclose(disk);
+    // find the destination directory
+    int dest_cluster = -1;
+    if(strcasecmp(destination, "ROOT")==0){
+        if (!overwrite && !append) {
+            check_root_dir(disk, file_name);
+        }
+        dest_cluster = 0;
+    }else{
+        find_sub_dir(disk, 0, destination, &dest_cluster, overwrite || append ? NULL : file_name);
+    }
+    if(dest_cluster == -1){
+        printf("The directory not found. \n");
+        vol_close(disk);
         fclose(file);
         exit(-1);
     }
-    int free_disk_size = freeBlocks * 512;
+
+    // a file already in the destination is updated in place
+    dir_entry_t existing;
+    if ((overwrite || append) && dir_find(disk, dest_cluster, file_name, &existing)) {
+        if (existing.entry.attributes & 0x10) {
+            printf("There is a directory of the same name in the disk.\n");
+            vol_close(disk);
+            fclose(file);
+            exit(-1);
+        }
+        update_file(&existing, append, compare);
+        fclose(file);
+        if (vol_close(disk) != 0) {
+            printf("Failed to write the file into the disk image.\n");
+            exit(-1);
+        }
+        return 0;
+    }
+
+    if (streaming) {
+        put_stream(dest_cluster, file_name);
+        if (vol_close(disk) != 0) {
+            printf("Failed to write the file into the disk image.\n");
+            exit(-1);
+        }
+        return 0;
+    }
+
+    // get free size of the disk
+    int free_disk_size = vol_free_clusters(disk) * disk->cluster_size;
     
     // get the size of the file
     fseek(file, 0, SEEK_END);
@@ -542,62 +358,41 @@ int main(int argc, char *argv[]) {
     if(file_size>free_disk_size){
         printf("No enough free space in the disk image.\n");
         fclose(file);
-        fclose(disk);
+        vol_close(disk);
         exit(-1);
     }
 
-    // get free entry in the destination directory
-    int free_entry_address = -1;
-    if(strcmp(destination, "ROOT")==0){
-        get_free_entry_in_root_dir(disk, file_name, &free_entry_address);
-    }else{
-        get_free_sub_dir_entries(disk, 0, destination, &free_entry_address, file_name, "ROOT");
-    }
-    if(free_entry_address == -1){
-        printf("The directory not found. \n");
-        fclose(disk);
-        fclose(file);
-        exit(-1);
-    }
-    // overwrite the free entry in the destination directory with the new entry
-    int free_sector = get_free_sector();
+    // reserve the clusters of the file and fill in the new entry
+    uint32_t cluster_size = disk->cluster_size;
+    int clusters_needed = file_size / cluster_size + (file_size % cluster_size != 0);
+    uint16_t *chain = vol_alloc_chain(disk, clusters_needed);
     entry_t new_entry;
-    new_entry = fill_info_to_entry(file, file_name, free_sector);
-    char year[5];
-    char month[4];
-    char day[3];
-    char hour[3];
-    char minute[3];
-    // convert the filename to lowercase
-    int j =0;
-    while (file_name[j] != '\0'){
-        file_name[j] = tolower(file_name[j]);
-        j++;
+    new_entry = fill_info_to_entry(file, clusters_needed > 0 ? chain[0] : 0);
+    struct stat st;
+    fstat(fileno(file), &st);
+    dos_stamp_entry(&new_entry, &st, 1);
+
+    // store the data first, then flush the FAT and the entry that points at it;
+    // in a batch the data is stored with the other new files before the flush
+    int ret = file_queue(disk, fileno(file), chain, file_size, verify);
+    if (ret != 0) {
+        // exit without flushing, so the image keeps its old FAT
+        printf(ret == XFER_MISMATCH ? "The disk image doesn't read back what was written.\n" :
+                                      "Failed to write the file into the disk image.\n");
+        exit(-1);
     }
-    getFileCreationTime(file_name, year, month, day, hour, minute);
-    // convert the filename back to uppercase
-    j =0;
-    while (file_name[j] != '\0'){
-        file_name[j] = toupper(file_name[j]);
-        j++;
+    // a name that doesn't fit 8.3 gets an alias and long name slots in front of it,
+    // and a full subdirectory grows
+    if (dir_add(disk, dest_cluster, file_name, &new_entry, 0) != 0) {
+        printf("The directory is full. \n");
+        exit(-1);
     }
-    uint16_t formatted_date;
-    process_date(year, month, day, &formatted_date);
-    new_entry.create_date = formatted_date;
-    new_entry.last_modified_date = formatted_date;
-    uint16_t formatted_time;
-    process_time(hour, minute, &formatted_time);
-    new_entry.create_time = formatted_time;
-    new_entry.last_modified_time= formatted_time;
-
-    char entry_content[32];
-    memcpy(&entry_content, (const unsigned char*) &new_entry, sizeof(entry_t));
-    fseek(disk, free_entry_address, SEEK_SET);
-    fwrite(&entry_content, sizeof(entry_t), 1, disk);
-    
-    int sectors_needed = file_size / 512 + (file_size % boot_sector.bytes_per_sector != 0);
-    put_in_data_area (free_sector, sectors_needed, file_size);
 
-    fclose(disk);
+    free(chain);
     fclose(file);
-}
\ No newline at end of file
+    if (vol_close(disk) != 0) {
+        printf("Failed to write the file into the disk image.\n");
+        exit(-1);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dir.h"
+#include "emalloc.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * State of one diskrm run. Entries are marked free as they are removed,
+ * while their clusters are only collected; the FAT is updated for all of
+ * them at the end.
+ */
+typedef struct {
+    volume_t  *vol;
+    int       recursive;         /* 1 to remove directories and their contents. */
+    int       punch;             /* 1 to punch holes over the freed clusters. */
+    uint8_t   *freed;            /* One bit per cluster to free. */
+    int       failed;            /* The number of paths that couldn't be removed. */
+} rm_t;
+
+/**
+ * Function:  collect_chain
+ * --------------------
+ * @brief mark every cluster of a chain to be freed. A cluster marked
+ *        already ends the walk, so a looping chain is only walked once.
+ *
+ * @param rm: the run.
+ * @param cluster: the first cluster of the chain.
+ *
+ */
+void collect_chain(rm_t *rm, uint16_t cluster) {
+    while (cluster >= 2 && cluster < rm->vol->fat_size && !BIT_TEST(rm->freed, cluster)) {
+        BIT_SET(rm->freed, cluster);
+        cluster = vol_get_fat(rm->vol, cluster);
+    }
+}
+
+/**
+ * Function:  remove_entry
+ * --------------------
+ * @brief mark an entry and its long name slots free, and collect its
+ *        clusters. The contents of a directory are removed first; its own
+ *        clusters are collected before they are walked, so a directory met
+ *        again through a loop in a damaged tree is only unlinked.
+ *
+ * @param rm: the run.
+ * @param e: the entry.
+ *
+ */
+void remove_entry(rm_t *rm, const dir_entry_t *e) {
+    uint16_t cluster = e->entry.cluster;
+
+    if ((e->entry.attributes & 0x10) && cluster >= 2 && cluster < rm->vol->fat_size &&
+        !BIT_TEST(rm->freed, cluster)) { // Subdirectory, not entered yet
+        dir_entry_t child;
+        dir_t dir;
+
+        collect_chain(rm, cluster);
+        dir_open(&dir, rm->vol, cluster);
+        while (dir_read(&dir, &child)) {
+            if ((uint8_t)child.entry.filename[0] == 0x2E) {
+                continue; // skip . & .. entries
+            }
+            remove_entry(rm, &child);
+        }
+        dir_close(&dir);
+    }
+
+    collect_chain(rm, cluster);
+    dir_remove(rm->vol, e);
+}
+
+/**
+ * Function:  remove_path
+ * --------------------
+ * @brief remove one file, or with -r one directory tree, named by its path.
+ *
+ * @param rm: the run.
+ * @param path: the path from the root directory.
+ *
+ */
+void remove_path(rm_t *rm, const char *path) {
+    dir_entry_t e;
+
+    if (!dir_resolve(rm->vol, path, &e)) {
+        printf("%s: File not found.\n", path);
+        rm->failed++;
+        return;
+    }
+    if ((e.entry.attributes & 0x10) && !rm->recursive) {
+        printf("%s: Is a directory, use -r to remove it.\n", path);
+        rm->failed++;
+        return;
+    }
+    remove_entry(rm, &e);
+}
+
+/**
+ * Function:  free_clusters
+ * --------------------
+ * @brief free every collected cluster in the FAT, in one pass.
+ *
+ * @param rm: the run.
+ *
+ * @return The number of clusters freed.
+ *
+ */
+int free_clusters(rm_t *rm) {
+    int cluster, count = 0;
+
+    for (cluster = 2; cluster < rm->vol->fat_size; cluster++) {
+        if (BIT_TEST(rm->freed, cluster)) {
+            vol_set_fat(rm->vol, cluster, 0x000);
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Function:  punch_clusters
+ * --------------------
+ * @brief give the space of the freed clusters back to the host file system.
+ *        Runs of physically contiguous clusters take one fallocate call.
+ *
+ * @param rm: the run.
+ *
+ * @return 0 on success, -1 if the host file system can't punch holes.
+ *
+ */
+int punch_clusters(rm_t *rm) {
+    volume_t *vol = rm->vol;
+    int cluster, start = 0;
+
+    if (!vol->direct) {
+        return 0; // an overlay's clusters aren't at their offsets in one file
+    }
+    for (cluster = 2; cluster <= vol->fat_size; cluster++) {
+        int freed = cluster < vol->fat_size && BIT_TEST(rm->freed, cluster);
+        if (freed && start == 0) {
+            start = cluster;
+        } else if (!freed && start != 0) {
+            if (fallocate(vol->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, vol_cluster_offset(vol, start),
+                          (off_t)(cluster - start) * vol->cluster_size) != 0) {
+                return -1;
+            }
+            start = 0;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    rm_t rm = {0};
+    int i;
+
+    // options come before the disk image
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            rm.recursive = 1;
+        } else if (strcmp(argv[i], "--punch") == 0) {
+            rm.punch = 1;
+        } else {
+            break;
+        }
+    }
+    if (argc - i < 2 || argv[i][0] == '-') {
+        fprintf(stderr, "usage: diskrm [-r] [--punch] <disk.img> <path>...\n");
+        exit(-1);
+    }
+
+    if ((rm.vol = vol_open(argv[i], 1)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[i]);
+        exit(-1);
+    }
+    rm.freed = emalloc(rm.vol->fat_size / 8 + 1);
+    memset(rm.freed, 0, rm.vol->fat_size / 8 + 1);
+
+    for (i++; i < argc; i++) {
+        remove_path(&rm, argv[i]);
+    }
+
+    // the entries and the FAT reach the disk before the data is punched away
+    free_clusters(&rm);
+    if (vol_flush(rm.vol) != 0) {
+        printf("Failed to write the changes to the disk image.\n");
+        exit(-1);
+    }
+    if (rm.punch && punch_clusters(&rm) != 0) {
+        perror("Failed to punch holes in the disk image");
+    }
+    vol_close(rm.vol);
+    free(rm.freed);
+    return rm.failed > 0 ? -1 : 0;
+}
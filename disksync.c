@@ -0,0 +1,356 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "dir.h"
+#include "dostime.h"
+#include "emalloc.h"
+#include "file.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/*
+ * State of one sync run. Every change goes through the volume's cache and
+ * FAT copy, so the whole run ends with a single metadata flush.
+ */
+typedef struct {
+    volume_t  *vol;
+    int       dry_run;           /* 1 to only print what would change. */
+    int       changes;           /* The number of files and directories changed. */
+} sync_t;
+
+/*
+ * One entry of a host directory and the image entry it goes with.
+ */
+typedef struct {
+    char      *name;
+    struct stat st;
+    int       match;             /* Index of the image entry of the same name, -1 if none. */
+} host_entry_t;
+
+/**
+ * Function:  collect_chain
+ * --------------------
+ * @brief mark every cluster of a chain to be freed. A cluster marked
+ *        already ends the walk, so a looping chain is only walked once.
+ *
+ */
+void collect_chain(volume_t *vol, uint16_t cluster, uint8_t *freed) {
+    while (cluster >= 2 && cluster < vol->fat_size && !BIT_TEST(freed, cluster)) {
+        BIT_SET(freed, cluster);
+        cluster = vol_get_fat(vol, cluster);
+    }
+}
+
+/**
+ * Function:  collect_tree
+ * --------------------
+ * @brief mark the clusters of an entry to be freed, and those of everything
+ *        below it if it is a directory. A directory's own clusters are marked
+ *        before it is walked, so one met again through a loop in a damaged
+ *        tree is not entered twice. The entries below are left as they are,
+ *        since the directory holding them goes too.
+ *
+ */
+void collect_tree(volume_t *vol, const dir_entry_t *e, uint8_t *freed) {
+    uint16_t cluster = e->entry.cluster;
+
+    if ((e->entry.attributes & 0x10) && cluster >= 2 && cluster < vol->fat_size &&
+        !BIT_TEST(freed, cluster)) { // Subdirectory, not entered yet
+        dir_entry_t child;
+        dir_t dir;
+
+        collect_chain(vol, cluster, freed);
+        dir_open(&dir, vol, cluster);
+        while (dir_read(&dir, &child)) {
+            if ((uint8_t)child.entry.filename[0] != 0x2E) { // skip . & .. entries
+                collect_tree(vol, &child, freed);
+            }
+        }
+        dir_close(&dir);
+    }
+    collect_chain(vol, cluster, freed);
+}
+
+/**
+ * Function:  remove_tree
+ * --------------------
+ * @brief remove an entry from the image, with everything below it if it is
+ *        a directory, and free its clusters.
+ *
+ * @param vol: the disk.
+ * @param e: the entry.
+ *
+ */
+void remove_tree(volume_t *vol, const dir_entry_t *e) {
+    uint8_t *freed = emalloc(vol->fat_size / 8 + 1);
+    int cluster;
+
+    memset(freed, 0, vol->fat_size / 8 + 1);
+    collect_tree(vol, e, freed);
+    for (cluster = 2; cluster < vol->fat_size; cluster++) {
+        if (BIT_TEST(freed, cluster)) {
+            vol_set_fat(vol, cluster, 0x000);
+        }
+    }
+    free(freed);
+    dir_remove(vol, e);
+}
+
+/**
+ * Function:  copy_file
+ * --------------------
+ * @brief store a host file in a new chain of clusters and fill in its entry.
+ *
+ * @param vol: the disk.
+ * @param host_path: the host file.
+ * @param st: the host file's status.
+ * @param entry: the entry to fill in; its name is left alone.
+ *
+ * @return 0 on success, -1 if there is no room or the copy failed.
+ *
+ */
+int copy_file(volume_t *vol, const char *host_path, const struct stat *st, entry_t *entry) {
+    int clusters_needed = st->st_size / vol->cluster_size + (st->st_size % vol->cluster_size != 0);
+    uint16_t *chain;
+    int fd, ret;
+
+    if ((fd = open(host_path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((chain = vol_alloc_chain(vol, clusters_needed)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    ret = file_write(vol, fd, chain, 0, st->st_size, 0, 0);
+    close(fd);
+    if (ret != 0) {
+        vol_free_chain(vol, clusters_needed > 0 ? chain[0] : 0);
+        free(chain);
+        return -1;
+    }
+
+    // a new entry is stamped as created now; a replaced file keeps its creation time
+    entry->size = st->st_size;
+    entry->cluster = clusters_needed > 0 ? chain[0] : 0;
+    dos_stamp_entry(entry, st, entry->create_date == 0);
+    free(chain);
+    return 0;
+}
+
+/**
+ * Function:  same_file
+ * --------------------
+ * @brief check if an image file is up to date with a host file, by its size
+ *        and modification time.
+ *
+ */
+int same_file(const dir_entry_t *e, const struct stat *st) {
+    uint16_t date, time;
+
+    dos_from_timespec(&st->st_mtim, &date, &time, NULL);
+    return !(e->entry.attributes & 0x10) && e->entry.size == st->st_size &&
+           e->entry.last_modified_date == date && e->entry.last_modified_time == time;
+}
+
+/**
+ * Function:  sync_dir
+ * --------------------
+ * @brief make an image directory hold the same files as a host directory.
+ *        Image entries the host doesn't have are removed first, to make room;
+ *        then new and changed files are copied and subdirectories are synced.
+ *
+ * @param sync: the run.
+ * @param host_path: the host directory.
+ * @param dir_cluster: the image directory, 0 for the root directory, -1 if it
+ *                     doesn't exist because this is a dry run.
+ * @param image_path: the path of the image directory, for the messages.
+ *
+ * @return 0 on success, -1 if a change could not be made.
+ *
+ */
+int sync_dir(sync_t *sync, const char *host_path, int dir_cluster, const char *image_path) {
+    volume_t *vol = sync->vol;
+    dir_entry_t *entries = NULL;
+    int count = 0, capacity = 0;
+    char path[PATH_MAX], child_path[PATH_MAX];
+    struct dirent **names;
+    int n, i, k, ret = 0;
+
+    // the image side
+    if (dir_cluster >= 0) {
+        dir_t dir;
+        dir_open(&dir, vol, dir_cluster);
+        for (;;) {
+            if (count == capacity) {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                dir_entry_t *grown = emalloc(capacity * sizeof(dir_entry_t));
+                memcpy(grown, entries, count * sizeof(dir_entry_t));
+                free(entries);
+                entries = grown;
+            }
+            if (!dir_read(&dir, &entries[count])) {
+                break;
+            }
+            if ((uint8_t)entries[count].entry.filename[0] != 0x2E && !(entries[count].entry.attributes & 0x08)) {
+                count++; // skip . & .. entries and the volume label
+            }
+        }
+        dir_close(&dir);
+    }
+
+    // the host side, in name order so runs are repeatable
+    if ((n = scandir(host_path, &names, NULL, alphasort)) < 0) {
+        printf("%s: Directory not found.\n", host_path);
+        free(entries);
+        return -1;
+    }
+    host_entry_t *host = emalloc((n + 1) * sizeof(host_entry_t));
+    char *seen = emalloc(count + 1);
+    memset(seen, 0, count + 1);
+    int host_count = 0;
+    for (i = 0; i < n; i++) {
+        host_entry_t *h = &host[host_count];
+        h->name = names[i]->d_name;
+        snprintf(path, sizeof(path), "%s/%s", host_path, h->name);
+        if (strcmp(h->name, ".") == 0 || strcmp(h->name, "..") == 0 || stat(path, &h->st) != 0 ||
+            !(S_ISREG(h->st.st_mode) || S_ISDIR(h->st.st_mode))) {
+            continue;
+        }
+        h->match = -1;
+        for (k = 0; k < count; k++) {
+            if (!seen[k] && dir_match(&entries[k], h->name)) {
+                h->match = k;
+                seen[k] = 1;
+                break;
+            }
+        }
+        host_count++;
+    }
+
+    // what only the image has goes first
+    for (k = 0; k < count; k++) {
+        if (!seen[k]) {
+            printf("delete %s%s\n", image_path, entries[k].name);
+            sync->changes++;
+            if (!sync->dry_run) {
+                remove_tree(vol, &entries[k]);
+            }
+        }
+    }
+
+    for (i = 0; i < host_count && ret == 0; i++) {
+        host_entry_t *h = &host[i];
+        dir_entry_t *e = h->match >= 0 ? &entries[h->match] : NULL;
+        snprintf(path, sizeof(path), "%s/%s", host_path, h->name);
+        snprintf(child_path, sizeof(child_path), "%s%s/", image_path, h->name);
+
+        if (S_ISDIR(h->st.st_mode)) {
+            if (e != NULL && (e->entry.attributes & 0x10)) {
+                ret = sync_dir(sync, path, e->entry.cluster, child_path);
+                continue;
+            }
+            printf("mkdir %s%s\n", image_path, h->name);
+            sync->changes++;
+            int cluster = -1;
+            if (!sync->dry_run) {
+                entry_t entry = {0};
+                if (e != NULL) {
+                    remove_tree(vol, e);
+                }
+                dos_stamp_entry(&entry, &h->st, 1);
+                if (dir_cluster < 0 || (cluster = dir_mkdir(vol, dir_cluster, h->name, &entry)) == 0) {
+                    printf("%s%s: No room for the directory.\n", image_path, h->name);
+                    ret = -1;
+                    continue;
+                }
+            }
+            ret = sync_dir(sync, path, cluster, child_path);
+            continue;
+        }
+
+        if (e != NULL && same_file(e, &h->st)) {
+            continue;
+        }
+        printf("%s %s%s\n", e != NULL ? "update" : "put", image_path, h->name);
+        sync->changes++;
+        if (sync->dry_run) {
+            continue;
+        }
+
+        if (e != NULL && !(e->entry.attributes & 0x10)) {
+            // the file gets a new chain; its entry and name stay where they are, and
+            // the old chain is only freed once the new one holds the data
+            entry_t entry = e->entry;
+            if (copy_file(vol, path, &h->st, &entry) != 0) {
+                printf("%s%s: Failed to copy the file into the disk image.\n", image_path, h->name);
+                ret = -1;
+                continue;
+            }
+            vol_free_chain(vol, e->entry.cluster);
+            vol_write(vol, e->address, &entry, sizeof(entry_t));
+            continue;
+        }
+
+        entry_t entry = {0};
+        if (e != NULL) {
+            remove_tree(vol, e);    // a directory on the image, a file on the host
+        }
+        if (copy_file(vol, path, &h->st, &entry) != 0) {
+            printf("%s%s: Failed to copy the file into the disk image.\n", image_path, h->name);
+            ret = -1;
+        } else if (dir_add(vol, dir_cluster, h->name, &entry, 0) != 0) {
+            vol_free_chain(vol, entry.cluster);
+            printf("%s%s: The directory is full.\n", image_path, h->name);
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(host);
+    free(seen);
+    free(entries);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    sync_t sync = {0};
+
+    if (argc == 4 && strcmp(argv[1], "-n") == 0) {
+        sync.dry_run = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "usage: disksync [-n] <disk.img> <host dir>\n");
+        exit(-1);
+    }
+
+    if ((sync.vol = vol_open(argv[1], !sync.dry_run)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        exit(-1);
+    }
+
+    int ret = sync_dir(&sync, argv[2], 0, "");
+
+    // everything changed so far reaches the disk at once, even after a failure
+    if (vol_close(sync.vol) != 0) {
+        printf("Failed to write the changes to the disk image.\n");
+        exit(-1);
+    }
+    if (sync.changes == 0) {
+        printf("The disk image is up to date.\n");
+    }
+    return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,54 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "zimage.h"
+
+int main(int argc, char *argv[]) {
+    int decompress = argc == 4 && strcmp(argv[1], "-d") == 0;
+    int src_fd, dst_fd, ret;
+    struct stat st;
+
+    if (argc != 3 && !decompress) {
+        fprintf(stderr, "usage: diskzip [-d] <input> <output>\n");
+        exit(-1);
+    }
+    const char *input = argv[argc - 2];
+    const char *output = argv[argc - 1];
+
+    if ((src_fd = open(input, O_RDONLY)) < 0 || fstat(src_fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s\n", input);
+        exit(-1);
+    }
+    if (zimage_detect(src_fd) != decompress) {
+        printf("%s is %s compressed image.\n", input, decompress ? "not a" : "already a");
+        exit(-1);
+    }
+    // never overwrite an existing image
+    if ((dst_fd = open(output, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        printf("%s already exists.\n", output);
+        exit(-1);
+    }
+
+    if (decompress) {
+        zimage_t *z = zimage_open(src_fd);
+        ret = z != NULL ? zimage_decompress(z, dst_fd) : -1;
+        if (z != NULL) {
+            zimage_close(z);
+        }
+    } else {
+        ret = zimage_compress(src_fd, dst_fd, st.st_size);
+    }
+
+    if (ret != 0 || fsync(dst_fd) != 0) {
+        printf("Failed to write %s\n", output);
+        close(dst_fd);
+        unlink(output);
+        exit(-1);
+    }
+    close(dst_fd);
+    close(src_fd);
+    return 0;
+}
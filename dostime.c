@@ -0,0 +1,223 @@
+#include "dostime.h"
+
+/*
+ * Days before the first of each month, in a common and in a leap year.
+ */
+static const uint16_t month_start[2][13] = {
+    {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},
+    {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366},
+};
+
+/*
+ * "00" to "99", so a two digit field is written with one lookup.
+ */
+static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * The UTC offset of the last 15 minutes looked up. Offsets only change on
+ * quarter hours, so entries written close together share one localtime_r.
+ */
+static __thread int offset_valid = 0;
+static __thread time_t offset_quarter;
+static __thread long offset_seconds;
+
+static long utc_offset(time_t t) {
+    time_t quarter = t / 900;
+
+    if (!offset_valid || quarter != offset_quarter) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        offset_seconds = tm.tm_gmtoff;
+        offset_quarter = quarter;
+        offset_valid = 1;
+    }
+    return offset_seconds;
+}
+
+static int is_leap(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+/**
+ * Function:  days_before_year
+ * --------------------
+ * @brief count the days from 1970/01/01 to the first day of a year.
+ *
+ */
+static long days_before_year(int year) {
+    long y = year - 1;
+    return 365L * (year - 1970) + (y / 4 - y / 100 + y / 400) - 477;
+}
+
+/**
+ * Function:  dos_from_timespec
+ * --------------------
+ * @brief convert a host time to the DOS date and time of a directory entry,
+ *        in local time. Times outside 1980 to 2107 are clamped to the ends.
+ *
+ * @param ts: the host time.
+ * @param date: set to yyyyyyym mmmddddd, years from 1980.
+ * @param time: set to hhhhhmmm mmmsssss, seconds halved.
+ * @param centis: set to the hundredths of a second the halved seconds
+ *                drop, 0 to 199, if not NULL.
+ *
+ */
+void dos_from_timespec(const struct timespec *ts, uint16_t *date, uint16_t *time, uint8_t *centis) {
+    long local = ts->tv_sec + utc_offset(ts->tv_sec);
+    long days = local / 86400, seconds = local % 86400;
+    int year, leap, month;
+
+    if (seconds < 0) {
+        seconds += 86400;
+        days--;
+    }
+    if (days < days_before_year(DOS_YEAR_MIN)) {
+        *date = (1 << 5) | 1;
+        *time = 0;
+        if (centis != NULL) {
+            *centis = 0;
+        }
+        return;
+    }
+    year = 1970 + days / 366;
+    while (days_before_year(year + 1) <= days) {
+        year++;
+    }
+    if (year > DOS_YEAR_MAX) {
+        *date = ((DOS_YEAR_MAX - DOS_YEAR_MIN) << 9) | (12 << 5) | 31;
+        *time = (23 << 11) | (59 << 5) | 29;
+        if (centis != NULL) {
+            *centis = 199;
+        }
+        return;
+    }
+
+    int yday = days - days_before_year(year);
+    leap = is_leap(year);
+    for (month = 0; yday >= month_start[leap][month + 1]; month++)
+        ;
+    *date = ((year - DOS_YEAR_MIN) << 9) | ((month + 1) << 5) | (yday - month_start[leap][month] + 1);
+    *time = (seconds / 3600) << 11 | (seconds / 60 % 60) << 5 | (seconds % 60) / 2;
+    if (centis != NULL) {
+        *centis = (seconds % 2) * 100 + ts->tv_nsec / 10000000;
+    }
+}
+
+/**
+ * Function:  dos_to_timespec
+ * --------------------
+ * @brief convert the DOS date and time of a directory entry, in local time,
+ *        to a host time. Out of range fields are clamped.
+ *
+ * @param date: yyyyyyym mmmddddd, years from 1980.
+ * @param time: hhhhhmmm mmmsssss, seconds halved.
+ * @param centis: hundredths of a second on top of the halved seconds, 0 if
+ *                the entry doesn't have them.
+ * @param ts: set to the host time.
+ *
+ */
+void dos_to_timespec(uint16_t date, uint16_t time, uint8_t centis, struct timespec *ts) {
+    int year = DOS_YEAR_MIN + (date >> 9);
+    int month = (date >> 5) & 0x0F;
+    int day = date & 0x1F;
+    int leap = is_leap(year);
+
+    if (month < 1) {
+        month = 1;
+    } else if (month > 12) {
+        month = 12;
+    }
+    if (day < 1) {
+        day = 1;
+    }
+    if (centis > 199) {
+        centis = 199;
+    }
+    long local = (days_before_year(year) + month_start[leap][month - 1] + day - 1) * 86400L +
+                 (time >> 11) * 3600L + ((time >> 5) & 0x3F) * 60L + (time & 0x1F) * 2L + centis / 100;
+
+    // the offset is looked up at the guessed UTC time, which is right unless
+    // the local time falls in the hour a DST change skips or repeats
+    ts->tv_sec = local - utc_offset(local - utc_offset(local));
+    ts->tv_nsec = (centis % 100) * 10000000L;
+}
+
+/**
+ * Function:  dos_stamp_entry
+ * --------------------
+ * @brief fill in the timestamps of a directory entry from a host file: the
+ *        modification time and access date, and with created the creation
+ *        time too, which is taken from the modification time since the host
+ *        copy is what the file was created from.
+ *
+ * @param entry: the entry.
+ * @param st: the host file's status.
+ * @param created: 1 to set the creation time as well.
+ *
+ */
+void dos_stamp_entry(entry_t *entry, const struct stat *st, int created) {
+    uint16_t date, time;
+    uint8_t centis;
+
+    dos_from_timespec(&st->st_mtim, &date, &time, &centis);
+    entry->last_modified_date = date;
+    entry->last_modified_time = time;
+    if (created) {
+        entry->create_date = date;
+        entry->create_time = time;
+        entry->create_time_us = centis;
+    }
+    dos_from_timespec(&st->st_atim, &date, &time, NULL);
+    entry->last_access_date = date;
+}
+
+/**
+ * Function:  dos_format_date
+ * --------------------
+ * @brief write a DOS date as yyyy/mm/dd.
+ *
+ * @param date: the DOS date.
+ * @param out: at least 11 bytes.
+ *
+ * @return out.
+ *
+ */
+char *dos_format_date(uint16_t date, char *out) {
+    int year = DOS_YEAR_MIN + (date >> 9);
+
+    out[0] = digit_pairs[year / 100 * 2];
+    out[1] = digit_pairs[year / 100 * 2 + 1];
+    out[2] = digit_pairs[year % 100 * 2];
+    out[3] = digit_pairs[year % 100 * 2 + 1];
+    out[4] = '/';
+    out[5] = digit_pairs[((date >> 5) & 0x0F) * 2];
+    out[6] = digit_pairs[((date >> 5) & 0x0F) * 2 + 1];
+    out[7] = '/';
+    out[8] = digit_pairs[(date & 0x1F) * 2];
+    out[9] = digit_pairs[(date & 0x1F) * 2 + 1];
+    out[10] = '\0';
+    return out;
+}
+
+/**
+ * Function:  dos_format_time
+ * --------------------
+ * @brief write a DOS time as hh:mm.
+ *
+ * @param time: the DOS time.
+ * @param out: at least 6 bytes.
+ *
+ * @return out.
+ *
+ */
+char *dos_format_time(uint16_t time, char *out) {
+    int hour = time >> 11, minute = (time >> 5) & 0x3F;
+
+    out[0] = digit_pairs[hour * 2];
+    out[1] = digit_pairs[hour * 2 + 1];
+    out[2] = ':';
+    out[3] = digit_pairs[minute % 100 * 2];
+    out[4] = digit_pairs[minute % 100 * 2 + 1];
+    out[5] = '\0';
+    return out;
+}
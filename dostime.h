@@ -0,0 +1,17 @@
+#ifndef _DOSTIME_H_
+#define _DOSTIME_H_
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "sfs.h"
+
+#define DOS_YEAR_MIN 1980        /* The first year a DOS date can hold. */
+#define DOS_YEAR_MAX 2107        /* The last year a DOS date can hold. */
+
+void dos_from_timespec(const struct timespec *ts, uint16_t *date, uint16_t *time, uint8_t *centis);
+void dos_to_timespec(uint16_t date, uint16_t time, uint8_t centis, struct timespec *ts);
+void dos_stamp_entry(entry_t *entry, const struct stat *st, int created);
+char *dos_format_date(uint16_t date, char *out);
+char *dos_format_time(uint16_t time, char *out);
+
+#endif
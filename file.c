@@ -0,0 +1,802 @@
+#define _GNU_SOURCE              // splice and F_SETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "emalloc.h"
+#include "file.h"
+
+#define BATCH_FILES 256          /* Files queued before the queue is drained, which bounds the open descriptors. */
+#define STREAM_PIECE (1024 * 1024)  /* Bytes of clusters a stream reserves at a time. */
+#define STREAM_PIPE  (1024 * 1024)  /* Pipe buffer asked for, so a stream moves in big steps. */
+
+/*
+ * The copy of one file queued by file_queue, planned down to its extents.
+ */
+typedef struct {
+    int       fd;                /* A duplicate of the local file's descriptor. */
+    extent_t  *extents;
+    int       count;
+    int       flags;
+} job_t;
+
+/*
+ * The copies queued for the volume being batched, and the workers draining them.
+ */
+static struct {
+    volume_t  *vol;              /* The volume batched, NULL when not batching. */
+    int       threads;
+    job_t     jobs[BATCH_FILES];
+    int       count;
+    int       next;              /* The next job to hand to a worker. */
+    int       failed;            /* The first error a job returned, 0 if none. */
+    pthread_mutex_t lock;
+} batch = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int drain(void);
+
+/**
+ * Function:  file_extents
+ * --------------------
+ * @brief map a byte range of a file onto its chain of clusters. Physically
+ *        contiguous clusters are merged into one extent.
+ *
+ * @param vol: the disk.
+ * @param chain: the clusters of the file.
+ * @param start: the first byte of the range, which comes from the start of the local file.
+ * @param length: the number of bytes in the range.
+ * @param count: set to the number of extents returned.
+ *
+ * @return An array of extents mapping the local file to the disk image.
+ */
+extent_t *file_extents(volume_t *vol, const uint16_t *chain, uint32_t start, uint32_t length, int *count) {
+    uint32_t cluster_size = vol->cluster_size;
+    extent_t *extents = emalloc((length / cluster_size + 2) * sizeof(extent_t));
+    uint32_t pos = start, end = start + length;
+    int n = 0;
+
+    while (pos < end) {
+        uint32_t within = pos % cluster_size;
+        off_t address = vol_cluster_offset(vol, chain[pos / cluster_size]) + within;
+        uint32_t piece = end - pos < cluster_size - within ? end - pos : cluster_size - within;
+
+        if (n > 0 && extents[n - 1].dst_offset + extents[n - 1].length == address) {
+            extents[n - 1].length += piece;     // continues the previous run
+        } else {
+            extents[n].src_offset = pos - start;
+            extents[n].dst_offset = address;
+            extents[n].length = piece;
+            n++;
+        }
+        pos += piece;
+    }
+    *count = n;
+    return extents;
+}
+
+/**
+ * Function:  file_chain_extents
+ * --------------------
+ * @brief follow the FAT chain of a file and merge physically contiguous
+ *        clusters into extents, to copy the file out of the disk.
+ *
+ * @param vol: the disk.
+ * @param first_cluster: the first logical cluster of the file.
+ * @param total_size: total size of the file to be copied.
+ * @param count: set to the number of extents returned.
+ *
+ * @return An array of extents mapping the disk image to the local file.
+ */
+extent_t *file_chain_extents(volume_t *vol, uint16_t first_cluster, uint32_t total_size, int *count) {
+    uint32_t cluster_size = vol->cluster_size;
+    int max_extents = total_size / cluster_size + 1;
+    extent_t *extents = emalloc(max_extents * sizeof(extent_t));
+    uint16_t cluster = first_cluster;
+    uint32_t copied = 0;
+    int n = 0;
+
+    while (copied < total_size && cluster >= 2 && cluster < vol->fat_size) {
+        off_t address = vol_cluster_offset(vol, cluster);
+        uint32_t length = total_size - copied < cluster_size ? total_size - copied : cluster_size;
+
+        if (n > 0 && extents[n - 1].src_offset + extents[n - 1].length == address) {
+            extents[n - 1].length += length;    // continues the previous run
+        } else {
+            extents[n].src_offset = address;
+            extents[n].dst_offset = copied;
+            extents[n].length = length;
+            n++;
+        }
+        copied += length;
+        if (n == max_extents) {
+            break;  // chain longer than the file says, stop at the file size
+        }
+        cluster = vol_get_fat(vol, cluster);
+    }
+    *count = n;
+    return extents;
+}
+
+/**
+ * Function:  read_back
+ * --------------------
+ * @brief read back bytes just written and compare their CRC32C with the
+ *        CRC32C of the bytes still in the buffer, which is then overwritten.
+ *
+ * @param vol: the disk, if the bytes went to it; NULL if they went to fd.
+ * @param fd: the local file, if the bytes went to it.
+ * @param buf: the bytes written.
+ * @param length: the number of bytes.
+ * @param offset: where they were written.
+ *
+ * @return 0 if they match, XFER_MISMATCH if not, -1 on a failed read.
+ */
+static int read_back(volume_t *vol, int fd, char *buf, uint32_t length, off_t offset) {
+    uint32_t written = crc32c(0, buf, length);
+
+    if ((vol != NULL ? vol_read(vol, buf, length, offset) : pread(fd, buf, length, offset)) != length) {
+        return -1;
+    }
+    return crc32c(0, buf, length) == written ? 0 : XFER_MISMATCH;
+}
+
+/**
+ * Function:  extents_span
+ * --------------------
+ * @brief get the span of the disk that a set of extents covers. The span is
+ *        locked for a copy as one range, rather than a lock per extent, so
+ *        the copy is whole against a writer and two tools locking can't
+ *        deadlock on the order they take their ranges in.
+ *
+ * @param extents: the runs.
+ * @param count: the number of extents.
+ * @param on_disk: 0 if the disk side of the extents is src_offset, 1 if dst_offset.
+ * @param first: set to the first byte of the span.
+ *
+ * @return The number of bytes in the span.
+ *
+ */
+static off_t extents_span(const extent_t *extents, int count, int on_disk, off_t *first) {
+    off_t last = 0;
+    int i;
+
+    *first = 0;
+    for (i = 0; i < count; i++) {
+        off_t offset = on_disk ? extents[i].dst_offset : extents[i].src_offset;
+        if (i == 0 || offset < *first) {
+            *first = offset;
+        }
+        if (i == 0 || offset + extents[i].length > last) {
+            last = offset + extents[i].length;
+        }
+    }
+    return last - *first;
+}
+
+/**
+ * Function:  read_extents
+ * --------------------
+ * @brief copy extents of the disk out to a local file for file_read.
+ *
+ */
+static int read_extents(volume_t *vol, int fd, const extent_t *extents, int count, off_t readahead, int flags) {
+    char *buf;
+    int i, ret;
+
+    if (vol->direct) {
+        return xfer_extents(vol->fd, fd, extents, count, readahead, flags);
+    }
+
+    buf = emalloc(XFER_CHUNK);
+    for (i = 0; i < count; i++) {
+        uint32_t done, k;
+        for (done = 0; done < extents[i].length; done += XFER_CHUNK) {
+            uint32_t length = extents[i].length - done < XFER_CHUNK ? extents[i].length - done : XFER_CHUNK;
+            if (vol_read(vol, buf, length, extents[i].src_offset + done) != length) {
+                free(buf);
+                return -1;
+            }
+            for (k = 0; (flags & XFER_SPARSE) && k < length && buf[k] == 0; k++)
+                ;
+            if ((flags & XFER_SPARSE) && k == length) {
+                continue; // the destination is fresh, so a hole reads as these zeros
+            }
+            if (pwrite(fd, buf, length, extents[i].dst_offset + done) != length) {
+                free(buf);
+                return -1;
+            }
+            if ((flags & XFER_VERIFY) && (ret = read_back(NULL, fd, buf, length, extents[i].dst_offset + done)) != 0) {
+                free(buf);
+                return ret;
+            }
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/**
+ * Function:  file_read
+ * --------------------
+ * @brief copy extents of the disk out to a local file. A raw image goes
+ *        through the transfer engine; a compressed image or an overlay is
+ *        read a chunk at a time, leaving blocks of zeros unwritten with
+ *        XFER_SPARSE. The extents are share-locked against a writer for
+ *        the copy.
+ *
+ * @param vol: the disk.
+ * @param fd: the local file.
+ * @param extents: the runs to copy, from disk offsets to file offsets.
+ * @param count: the number of extents.
+ * @param readahead: how far ahead to hint a raw image, 0 for no hints.
+ * @param flags: XFER_SPARSE, XFER_VERIFY or 0.
+ *
+ * @return 0 on success, -1 on a read or write error, XFER_MISMATCH if the
+ *         local file reads back differently.
+ */
+int file_read(volume_t *vol, int fd, const extent_t *extents, int count, off_t readahead, int flags) {
+    off_t first, length = extents_span(extents, count, 0, &first);
+    int ret;
+
+    // the queued copies may be the very clusters read here
+    if (batch.vol == vol && drain() != 0) {
+        return -1;
+    }
+    vol_lock(vol, F_RDLCK, first, length);
+    ret = read_extents(vol, fd, extents, count, readahead, flags);
+    vol_lock(vol, F_UNLCK, first, length);
+    return ret;
+}
+
+/**
+ * Function:  drop_identical
+ * --------------------
+ * @brief compare the local file with what the disk already holds, cluster by
+ *        cluster, and keep only the clusters that differ.
+ *
+ * @param vol: the disk.
+ * @param fd: the local file.
+ * @param extents: the extents to be written; freed.
+ * @param count: the number of extents, updated.
+ *
+ * @return The extents that still need writing.
+ */
+static extent_t *drop_identical(volume_t *vol, int fd, extent_t *extents, int *count) {
+    uint32_t cluster_size = vol->cluster_size;
+    char *local = emalloc(XFER_CHUNK);
+    char *stored = emalloc(XFER_CHUNK);
+    int total = 0, i, n = 0;
+
+    for (i = 0; i < *count; i++) {
+        total += extents[i].length / cluster_size + 1;
+    }
+    extent_t *changed = emalloc(total * sizeof(extent_t));
+
+    for (i = 0; i < *count; i++) {
+        uint32_t done, k;
+        for (done = 0; done < extents[i].length; done += XFER_CHUNK) {
+            uint32_t length = extents[i].length - done < XFER_CHUNK ? extents[i].length - done : XFER_CHUNK;
+            off_t src = extents[i].src_offset + done, dst = extents[i].dst_offset + done;
+            // a short read counts as a difference, so the data is written
+            int same = pread(fd, local, length, src) == length &&
+                       vol_read(vol, stored, length, dst) == length;
+
+            for (k = 0; k < length; k += cluster_size) {
+                uint32_t piece = length - k < cluster_size ? length - k : cluster_size;
+                if (same && memcmp(local + k, stored + k, piece) == 0) {
+                    continue;
+                }
+                if (n > 0 && changed[n - 1].src_offset + changed[n - 1].length == src + k &&
+                    changed[n - 1].dst_offset + changed[n - 1].length == dst + k) {
+                    changed[n - 1].length += piece;
+                } else {
+                    changed[n].src_offset = src + k;
+                    changed[n].dst_offset = dst + k;
+                    changed[n].length = piece;
+                    n++;
+                }
+            }
+        }
+    }
+    free(local);
+    free(stored);
+    free(extents);
+    *count = n;
+    return changed;
+}
+
+/**
+ * Function:  write_extents
+ * --------------------
+ * @brief copy a local file into extents of the disk for file_write.
+ *
+ */
+static int write_extents(volume_t *vol, int fd, const extent_t *extents, int n, int flags) {
+    if (vol->direct) {
+        return xfer_extents(fd, vol->fd, extents, n, 0, flags & XFER_VERIFY);
+    }
+
+    char *buf = emalloc(XFER_CHUNK);
+    int i, ret = 0;
+    for (i = 0; i < n && ret == 0; i++) {
+        uint32_t done;
+        for (done = 0; done < extents[i].length; done += XFER_CHUNK) {
+            uint32_t length = extents[i].length - done < XFER_CHUNK ? extents[i].length - done : XFER_CHUNK;
+            if (pread(fd, buf, length, extents[i].src_offset + done) != length ||
+                vol_write_data(vol, buf, length, extents[i].dst_offset + done) != length) {
+                ret = -1;
+                break;
+            }
+            if ((flags & XFER_VERIFY) && (ret = read_back(vol, fd, buf, length, extents[i].dst_offset + done)) != 0) {
+                break;
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Function:  file_write
+ * --------------------
+ * @brief store the data of a local file in its chain of clusters. Physically
+ *        contiguous clusters are merged into one extent before copying; an
+ *        overlay takes the extents a chunk at a time. The clusters are
+ *        locked against readers while they are written.
+ *
+ * @param vol: the disk.
+ * @param fd: the local file, read from its start.
+ * @param chain: the clusters of the file.
+ * @param start: where the data goes in the file, 0 unless it is appended.
+ * @param total_size: the number of bytes to store.
+ * @param compare: 1 to skip clusters the disk already holds the same data for.
+ * @param flags: XFER_VERIFY to read the clusters back and compare checksums, or 0.
+ *
+ * @return 0 on success, -1 if the copy failed, XFER_MISMATCH if the disk
+ *         reads back differently.
+ */
+int file_write(volume_t *vol, int fd, const uint16_t *chain, uint32_t start, uint32_t total_size, int compare,
+               int flags) {
+    int n, ret;
+
+    // an update may rewrite clusters a queued copy still has to fill
+    if (batch.vol == vol && drain() != 0) {
+        return -1;
+    }
+    extent_t *extents = file_extents(vol, chain, start, total_size, &n);
+    off_t first, length = extents_span(extents, n, 1, &first);
+
+    // the compare reads the clusters too, so it goes under the lock
+    vol_lock(vol, F_WRLCK, first, length);
+    if (compare) {
+        extents = drop_identical(vol, fd, extents, &n);
+    }
+    ret = write_extents(vol, fd, extents, n, flags);
+    vol_lock(vol, F_UNLCK, first, length);
+    free(extents);
+    return ret;
+}
+
+/**
+ * Function:  drain_worker
+ * --------------------
+ * @brief run queued copies until there are none left. Every job writes its
+ *        own clusters under drain's lock, so the workers only share the job
+ *        counter.
+ *
+ */
+static void *drain_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&batch.lock);
+        job_t *job = batch.next < batch.count ? &batch.jobs[batch.next++] : NULL;
+        pthread_mutex_unlock(&batch.lock);
+        if (job == NULL) {
+            return NULL;
+        }
+
+        int ret = write_extents(batch.vol, job->fd, job->extents, job->count, job->flags);
+        if (ret != 0) {
+            pthread_mutex_lock(&batch.lock);
+            if (batch.failed == 0) {
+                batch.failed = ret;
+            }
+            pthread_mutex_unlock(&batch.lock);
+        }
+    }
+}
+
+/**
+ * Function:  drain
+ * --------------------
+ * @brief run every queued copy on a pool of threads and empty the queue. A
+ *        compressed image or an overlay is written by one thread, since its
+ *        chunks and bitmap are shared state. The workers' locks would all
+ *        belong to the one descriptor of the image, so one unlock could drop
+ *        another job's range; this thread locks the span of every job
+ *        instead, until the pool is done.
+ *
+ * @return 0 on success, -1 or XFER_MISMATCH if a copy failed.
+ *
+ */
+static int drain(void) {
+    int threads = batch.vol->direct ? batch.threads : 1;
+    pthread_t *workers;
+    off_t first = 0, end = 0;
+    int i, started = 0, ret;
+
+    if (batch.count == 0) {
+        return 0;
+    }
+    for (i = 0; i < batch.count; i++) {
+        off_t job_first, job_length = extents_span(batch.jobs[i].extents, batch.jobs[i].count, 1, &job_first);
+        if (job_length == 0) {
+            continue;
+        }
+        if (end == 0 || job_first < first) {
+            first = job_first;
+        }
+        if (job_first + job_length > end) {
+            end = job_first + job_length;
+        }
+    }
+    vol_lock(batch.vol, F_WRLCK, first, end - first);
+    workers = emalloc(threads * sizeof(pthread_t));
+    for (i = 1; i < threads && i < batch.count; i++) {
+        if (pthread_create(&workers[started], NULL, drain_worker, NULL) == 0) {
+            started++;
+        }
+    }
+    drain_worker(NULL);     // this thread works too
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    vol_lock(batch.vol, F_UNLCK, first, end - first);
+
+    for (i = 0; i < batch.count; i++) {
+        close(batch.jobs[i].fd);
+        free(batch.jobs[i].extents);
+    }
+    ret = batch.failed;
+    batch.count = batch.next = batch.failed = 0;
+    return ret;
+}
+
+/**
+ * Function:  file_batch
+ * --------------------
+ * @brief start or end a batch of new files on a volume. While batching,
+ *        file_queue only plans each copy; the data is written by a pool of
+ *        threads when the queue fills, before any other read or write of
+ *        file data, and when the batch ends.
+ *
+ * @param vol: the disk.
+ * @param threads: the number of threads copying, 0 to end the batch.
+ *
+ * @return 0 on success, -1 or XFER_MISMATCH if a queued copy failed when
+ *         the batch ended.
+ *
+ */
+int file_batch(volume_t *vol, int threads) {
+    int ret = 0;
+
+    if (batch.vol == vol) {
+        ret = drain();
+        batch.vol = NULL;
+    }
+    if (threads > 0) {
+        batch.vol = vol;
+        batch.threads = threads;
+    }
+    return ret;
+}
+
+/**
+ * Function:  file_queue
+ * --------------------
+ * @brief store the data of a new local file in its chain of clusters, now or,
+ *        while batching, once the queue is drained. The chain must be the
+ *        file's alone, as a fresh one from vol_alloc_chain is.
+ *
+ * @param vol: the disk.
+ * @param fd: the local file, read from its start; it may be closed on return.
+ * @param chain: the clusters of the file.
+ * @param total_size: the number of bytes to store.
+ * @param flags: XFER_VERIFY to read the clusters back and compare checksums, or 0.
+ *
+ * @return 0 on success, -1 if the copy, or a queued copy drained to make
+ *         room, failed, XFER_MISMATCH if the disk reads back differently.
+ */
+int file_queue(volume_t *vol, int fd, const uint16_t *chain, uint32_t total_size, int flags) {
+    job_t *job;
+    int ret;
+
+    if (batch.vol != vol) {
+        return file_write(vol, fd, chain, 0, total_size, 0, flags);
+    }
+    if (batch.count == BATCH_FILES && (ret = drain()) != 0) {
+        return ret;
+    }
+    job = &batch.jobs[batch.count];
+    if ((job->fd = dup(fd)) < 0) {
+        return -1;
+    }
+    job->extents = file_extents(vol, chain, 0, total_size, &job->count);
+    job->flags = flags;
+    batch.count++;
+    return 0;
+}
+
+/**
+ * Function:  stream_pipe
+ * --------------------
+ * @brief grow the buffer of a pipe so a stream moves through it in big
+ *        steps. The kernel may cap the size; a smaller buffer still works.
+ *
+ * @return 1 if fd is a pipe, 0 if not.
+ *
+ */
+static int stream_pipe(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        return 0;
+    }
+    if (fcntl(fd, F_GETPIPE_SZ) < STREAM_PIPE) {
+        fcntl(fd, F_SETPIPE_SZ, STREAM_PIPE);
+    }
+    return 1;
+}
+
+/**
+ * Function:  stream_fill
+ * --------------------
+ * @brief fill a run of clusters from a stream. A pipe into a raw image is
+ *        spliced, so the data never comes up to user space; anything else
+ *        is read into buf and written through the volume.
+ *
+ * @param vol: the disk.
+ * @param fd: the stream.
+ * @param offset: where the run starts in the image.
+ * @param length: the number of bytes in the run.
+ * @param buf: XFER_CHUNK bytes of scratch space.
+ * @param splicing: 1 to splice.
+ * @param flags: XFER_VERIFY to read the bytes back and compare checksums, or 0.
+ *
+ * @return The number of bytes stored, less than length only at the end of
+ *         the stream, -1 on an error, XFER_MISMATCH if the disk reads back
+ *         differently.
+ */
+static ssize_t stream_fill(volume_t *vol, int fd, off_t offset, uint32_t length, char *buf, int splicing,
+                           int flags) {
+    uint32_t done = 0;
+    int ret;
+
+    while (done < length) {
+        ssize_t n;
+        if (splicing) {
+            loff_t at = offset + done;
+            n = splice(fd, NULL, vol->fd, &at, length - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = read(fd, buf, length - done < XFER_CHUNK ? length - done : XFER_CHUNK);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0 ? (ssize_t)done : -1;
+        }
+        if (!splicing) {
+            if (vol_write_data(vol, buf, n, offset + done) != n) {
+                return -1;
+            }
+            if ((flags & XFER_VERIFY) && (ret = read_back(vol, fd, buf, n, offset + done)) != 0) {
+                return ret;
+            }
+        }
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Function:  file_write_stream
+ * --------------------
+ * @brief store a stream of unknown length, such as a pipe, in a new chain of
+ *        clusters. Clusters are reserved STREAM_PIECE bytes at a time as the
+ *        data comes in, and the ones left over at the end are freed again.
+ *        The new chain is only reachable once the caller adds its entry.
+ *
+ * @param vol: the disk.
+ * @param fd: the stream, read until it ends.
+ * @param first_cluster: set to the first cluster of the chain, 0 for an empty stream.
+ * @param size: set to the number of bytes stored.
+ * @param flags: XFER_VERIFY to read the clusters back and compare checksums, or 0.
+ *
+ * @return 0 on success, -1 on a read or write error, XFER_MISMATCH if the
+ *         disk reads back differently, FILE_FULL if the disk fills up first.
+ *         On an error the partial chain is freed again.
+ */
+int file_write_stream(volume_t *vol, int fd, uint16_t *first_cluster, uint32_t *size, int flags) {
+    uint32_t cluster_size = vol->cluster_size;
+    int splicing = stream_pipe(fd) && vol->direct && !(flags & XFER_VERIFY);
+    char *buf = emalloc(XFER_CHUNK);
+    uint16_t tail = 0;
+    int ended = 0, ret = 0;
+
+    // the queued copies go first, since they may need clusters freed here
+    if (batch.vol == vol && drain() != 0) {
+        free(buf);
+        return -1;
+    }
+    *first_cluster = 0;
+    *size = 0;
+    while (!ended && ret == 0) {
+        int want = STREAM_PIECE / cluster_size > 0 ? STREAM_PIECE / cluster_size : 1;
+        int spare = vol_free_clusters(vol), n, i;
+
+        want = want < spare ? want : spare;
+        if (want == 0) {
+            // full: that is only fine if the stream is over too
+            ssize_t probe;
+            while ((probe = read(fd, buf, 1)) < 0 && errno == EINTR)
+                ;
+            ret = probe == 0 ? 0 : probe > 0 ? FILE_FULL : -1;
+            break;
+        }
+        uint16_t *piece = vol_alloc_chain(vol, want);
+        if (tail != 0) {
+            vol_set_fat(vol, tail, piece[0]);
+        } else {
+            *first_cluster = piece[0];
+        }
+
+        extent_t *extents = file_extents(vol, piece, 0, want * cluster_size, &n);
+        off_t first, length = extents_span(extents, n, 1, &first);
+        uint32_t got = 0;
+        vol_lock(vol, F_WRLCK, first, length);
+        for (i = 0; i < n && !ended; i++) {
+            ssize_t stored = stream_fill(vol, fd, extents[i].dst_offset, extents[i].length, buf, splicing, flags);
+            if (stored < 0) {
+                ret = stored;
+                break;
+            }
+            got += stored;
+            ended = (uint32_t)stored < extents[i].length;
+        }
+        vol_lock(vol, F_UNLCK, first, length);
+        free(extents);
+
+        // give back the clusters the stream didn't reach
+        int used = got / cluster_size + (got % cluster_size != 0);
+        if (ret == 0 && used < want) {
+            if (used > 0) {
+                vol_set_fat(vol, piece[used - 1], 0xFFF);
+            } else if (tail != 0) {
+                vol_set_fat(vol, tail, 0xFFF);
+            } else {
+                *first_cluster = 0;
+            }
+            vol_free_chain(vol, piece[used]);
+        }
+        tail = used > 0 ? piece[used - 1] : tail;
+        *size += got;
+        free(piece);
+    }
+    free(buf);
+    if (ret != 0) {
+        vol_free_chain(vol, *first_cluster);
+        *first_cluster = 0;
+        *size = 0;
+    }
+    return ret;
+}
+
+/**
+ * Function:  stream_write
+ * --------------------
+ * @brief write all the bytes to a stream, however the writes are split.
+ *
+ */
+static int stream_write(int fd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buf, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function:  stream_drain
+ * --------------------
+ * @brief send a run of the disk to a stream. A raw image is spliced into a
+ *        pipe; anything else is read into buf and written.
+ *
+ */
+static int stream_drain(volume_t *vol, int fd, off_t offset, uint32_t length, char *buf, int splicing) {
+    uint32_t done = 0;
+
+    while (done < length) {
+        uint32_t step = length - done < XFER_CHUNK ? length - done : XFER_CHUNK;
+        if (splicing) {
+            loff_t at = offset + done;
+            ssize_t n = splice(vol->fd, &at, fd, NULL, length - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+            done += n;
+            continue;
+        }
+        if (vol_read(vol, buf, step, offset + done) != step || stream_write(fd, buf, step) != 0) {
+            return -1;
+        }
+        done += step;
+    }
+    return 0;
+}
+
+/**
+ * Function:  file_read_stream
+ * --------------------
+ * @brief send a file of the disk to a stream, such as a pipe, in file
+ *        order. The extents are hinted to the kernel a readahead window
+ *        ahead of the copy, and bytes the chain is too short to hold are
+ *        sent as zeros. The extents are share-locked against a writer for
+ *        the copy.
+ *
+ * @param vol: the disk.
+ * @param fd: the stream.
+ * @param extents: the runs of the file in file order, as file_chain_extents gives them.
+ * @param count: the number of extents.
+ * @param size: the size of the file.
+ * @param readahead: how far ahead to hint a raw image, 0 for no hints.
+ *
+ * @return 0 on success, -1 on a read or write error.
+ */
+int file_read_stream(volume_t *vol, int fd, const extent_t *extents, int count, uint32_t size, off_t readahead) {
+    int splicing = stream_pipe(fd) && vol->direct;
+    off_t first, length = extents_span(extents, count, 0, &first);
+    char *buf = emalloc(XFER_CHUNK);
+    off_t sent = 0;
+    int i, hinted = 0, ret = 0;
+
+    if (batch.vol == vol && drain() != 0) {
+        free(buf);
+        return -1;
+    }
+    vol_lock(vol, F_RDLCK, first, length);
+    for (i = 0; i < count && ret == 0; i++) {
+        for (; vol->direct && readahead > 0 && hinted < count &&
+               extents[hinted].dst_offset < extents[i].dst_offset + readahead; hinted++) {
+            posix_fadvise(vol->fd, extents[hinted].src_offset, extents[hinted].length, POSIX_FADV_WILLNEED);
+        }
+        ret = stream_drain(vol, fd, extents[i].src_offset, extents[i].length, buf, splicing);
+        sent = extents[i].dst_offset + extents[i].length;
+    }
+    vol_lock(vol, F_UNLCK, first, length);
+
+    memset(buf, 0, XFER_CHUNK);
+    while (ret == 0 && sent < size) {
+        uint32_t step = size - sent < XFER_CHUNK ? size - sent : XFER_CHUNK;
+        ret = stream_write(fd, buf, step);
+        sent += step;
+    }
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+#include <stdint.h>
+#include "volume.h"
+#include "xfer.h"
+
+#define FILE_FULL (-3)           /* The disk filled up before a stream ended. */
+
+extent_t *file_chain_extents(volume_t *vol, uint16_t first_cluster, uint32_t total_size, int *count);
+extent_t *file_extents(volume_t *vol, const uint16_t *chain, uint32_t start, uint32_t length, int *count);
+int file_read(volume_t *vol, int fd, const extent_t *extents, int count, off_t readahead, int flags);
+int file_write(volume_t *vol, int fd, const uint16_t *chain, uint32_t start, uint32_t total_size, int compare,
+               int flags);
+int file_batch(volume_t *vol, int threads);
+int file_queue(volume_t *vol, int fd, const uint16_t *chain, uint32_t total_size, int flags);
+int file_write_stream(volume_t *vol, int fd, uint16_t *first_cluster, uint32_t *size, int flags);
+int file_read_stream(volume_t *vol, int fd, const extent_t *extents, int count, uint32_t size, off_t readahead);
+
+#endif
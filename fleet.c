@@ -0,0 +1,251 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "fleet.h"
+
+#define FLEET_WINDOW 4           /* Results that may wait for printing, per thread. */
+
+/*
+ * State shared by the workers of one scan.
+ */
+typedef struct {
+    char      **images;
+    int       count;
+    scan_fn   scan;
+    int       ordered;
+    int       window;            /* Jobs that may run ahead of the next result to print. */
+    FILE      *out;
+    int       next_job;          /* The next image to hand out. */
+    int       next_print;        /* The next image to print in ordered mode. */
+    char      **results;         /* Finished results waiting for their turn. */
+    char      *done;             /* Set once results[i] is filled in. */
+    pthread_mutex_t lock;
+    pthread_cond_t  room;        /* Signalled when the reorder window moves. */
+} fleet_t;
+
+/**
+ * Function:  fleet_parse
+ * --------------------
+ * @brief parse the fleet options in front of the image arguments:
+ *        -j <threads>, --unordered and --json.
+ *
+ * @param argc, argv: the arguments of the tool.
+ * @param opts: the options to fill in.
+ *
+ * @return The index of the first image argument, or -1 on a bad option.
+ *
+ */
+int fleet_parse(int argc, char *argv[], fleet_opts_t *opts) {
+    int i;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    opts->threads = cpus > 0 ? cpus : 1;
+    opts->ordered = 1;
+    opts->json = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts->threads = atoi(argv[++i]);
+            if (opts->threads < 1) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--unordered") == 0) {
+            opts->ordered = 0;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            opts->json = 1;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+static int by_name(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/**
+ * Function:  fleet_collect
+ * --------------------
+ * @brief expand the image arguments. A directory stands for every regular
+ *        file directly inside it, in name order.
+ *
+ * @param args: the image and directory arguments.
+ * @param count: the number of arguments.
+ * @param total: set to the number of images returned.
+ *
+ * @return The image paths.
+ *
+ */
+char **fleet_collect(char *args[], int count, int *total) {
+    int capacity = count + 16, n = 0, i, j;
+    char **images = emalloc(capacity * sizeof(char *));
+    struct stat st;
+
+    for (i = 0; i < count; i++) {
+        struct dirent **names;
+        int entries;
+
+        if (stat(args[i], &st) != 0 || !S_ISDIR(st.st_mode) ||
+            (entries = scandir(args[i], &names, NULL, by_name)) < 0) {
+            // not a directory: let the scan report what is wrong with it
+            if (n == capacity) {
+                capacity *= 2;
+                images = realloc(images, capacity * sizeof(char *));
+            }
+            images[n++] = strdup(args[i]);
+            continue;
+        }
+        for (j = 0; j < entries; j++) {
+            char *path = emalloc(strlen(args[i]) + strlen(names[j]->d_name) + 2);
+            sprintf(path, "%s/%s", args[i], names[j]->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                if (n == capacity) {
+                    capacity *= 2;
+                    images = realloc(images, capacity * sizeof(char *));
+                }
+                images[n++] = path;
+            } else {
+                free(path);
+            }
+            free(names[j]);
+        }
+        free(names);
+    }
+    if (images == NULL) {
+        printf("Failed to malloc.\n");
+        exit(-1);
+    }
+    *total = n;
+    return images;
+}
+
+static void emit(fleet_t *fleet, char *result) {
+    if (result != NULL) {
+        fputs(result, fleet->out);
+        fputc('\n', fleet->out);
+        free(result);
+    }
+}
+
+/**
+ * Function:  worker
+ * --------------------
+ * @brief take images off the shared list and scan them. Each worker has at most
+ *        one image open, and in ordered mode no worker starts more than the
+ *        reorder window ahead of the next result to print.
+ *
+ */
+static void *worker(void *arg) {
+    fleet_t *fleet = arg;
+
+    pthread_mutex_lock(&fleet->lock);
+    for (;;) {
+        while (fleet->ordered && fleet->next_job < fleet->count &&
+               fleet->next_job >= fleet->next_print + fleet->window) {
+            pthread_cond_wait(&fleet->room, &fleet->lock);
+        }
+        if (fleet->next_job >= fleet->count) {
+            break;
+        }
+        int job = fleet->next_job++;
+        pthread_mutex_unlock(&fleet->lock);
+
+        char *result = fleet->scan(fleet->images[job]);
+
+        pthread_mutex_lock(&fleet->lock);
+        if (!fleet->ordered) {
+            emit(fleet, result);
+            continue;
+        }
+        fleet->results[job] = result;
+        fleet->done[job] = 1;
+        while (fleet->next_print < fleet->count && fleet->done[fleet->next_print]) {
+            emit(fleet, fleet->results[fleet->next_print]);
+            fleet->next_print++;
+        }
+        pthread_cond_broadcast(&fleet->room);
+    }
+    pthread_mutex_unlock(&fleet->lock);
+    return NULL;
+}
+
+/**
+ * Function:  fleet_run
+ * --------------------
+ * @brief scan every image on a pool of threads and stream the result lines.
+ *
+ * @param images: the image paths.
+ * @param count: the number of images.
+ * @param scan: the function scanning one image.
+ * @param opts: the thread count and output order.
+ * @param out: where the result lines go.
+ *
+ * @return 0 once every image has been scanned.
+ *
+ */
+int fleet_run(char **images, int count, scan_fn scan, fleet_opts_t *opts, FILE *out) {
+    fleet_t fleet;
+    pthread_t *threads;
+    int i, started = 0;
+
+    fleet.images = images;
+    fleet.count = count;
+    fleet.scan = scan;
+    fleet.ordered = opts->ordered;
+    fleet.window = opts->threads * FLEET_WINDOW;
+    fleet.out = out;
+    fleet.next_job = 0;
+    fleet.next_print = 0;
+    fleet.results = emalloc((count + 1) * sizeof(char *));
+    fleet.done = emalloc(count + 1);
+    memset(fleet.done, 0, count + 1);
+    pthread_mutex_init(&fleet.lock, NULL);
+    pthread_cond_init(&fleet.room, NULL);
+
+    threads = emalloc(opts->threads * sizeof(pthread_t));
+    for (i = 0; i < opts->threads && i < count; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &fleet) == 0) {
+            started++;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (started == 0 && count > 0) {
+        worker(&fleet);     // no threads available, scan on this one
+    }
+
+    pthread_cond_destroy(&fleet.room);
+    pthread_mutex_destroy(&fleet.lock);
+    free(threads);
+    free(fleet.results);
+    free(fleet.done);
+    fflush(out);
+    return 0;
+}
+
+/**
+ * Function:  json_string
+ * --------------------
+ * @brief print a string as a quoted JSON string.
+ *
+ */
+void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7F) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,24 @@
+#ifndef _FLEET_H_
+#define _FLEET_H_
+#include <stdio.h>
+
+/*
+ * Options of a scan over many disk images.
+ */
+typedef struct {
+    int       threads;           /* The number of worker threads. */
+    int       ordered;           /* 1 to print results in argument order. */
+    int       json;              /* 1 to print one JSON line per image. */
+} fleet_opts_t;
+
+/*
+ * Scans one image and returns its result line (without newline), or NULL.
+ */
+typedef char *(*scan_fn)(const char *image);
+
+int fleet_parse(int argc, char *argv[], fleet_opts_t *opts);
+char **fleet_collect(char *args[], int count, int *total);
+int fleet_run(char **images, int count, scan_fn scan, fleet_opts_t *opts, FILE *out);
+void json_string(FILE *out, const char *s);
+
+#endif
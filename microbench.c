@@ -0,0 +1,435 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dir.h"
+#include "dostime.h"
+#include "emalloc.h"
+#include "sfs.h"
+#include "volume.h"
+
+#define INPUTS      4096         /* Inputs per kernel, cycled through by the timed loop. */
+#define REPS        15           /* Timed repetitions of each kernel. */
+#define REP_NS      20000000.0   /* The least time one repetition should take. */
+#define PAGED_FAT   "1024"       /* The FAT budget of the paged volume: 2 of the 9 FAT sectors. */
+
+/*
+ * What the kernels work on. Each setup fills in the inputs for one case,
+ * random or worst; the run functions only read them.
+ */
+typedef struct {
+    volume_t  *vol;              /* The FAT loaded whole. */
+    volume_t  *paged;            /* The same image with its FAT paged. */
+    volume_t  *target;           /* The volume the FAT kernels use for this case. */
+    uint16_t  clusters[INPUTS];
+    uint16_t  values[INPUTS];
+    char      names[INPUTS][DIR_NAME_MAX + 1];
+    dir_entry_t *entries;        /* The entries of the root directory. */
+    int       entry_count;
+    struct timespec times[INPUTS];
+    uint16_t  dates[INPUTS];
+    uint16_t  clock[INPUTS];
+} ctx_t;
+
+/*
+ * A kernel: what is timed and how its inputs are made.
+ */
+typedef struct {
+    const char *name;
+    const char *unit;            /* What one op is. */
+    void      (*setup)(ctx_t *c, int worst);
+    uint64_t  (*run)(ctx_t *c, uint64_t ops);  /* Returns a sum of the results, so they can't be dropped. */
+} kernel_t;
+
+static volatile uint64_t sink;
+static unsigned seed = 1;
+
+static unsigned next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/**
+ * Function:  make_image
+ * --------------------
+ * @brief write a blank 1.44MB FAT12 image to a temporary file.
+ *
+ * @return The path of the image.
+ *
+ */
+char *make_image(void) {
+    static char path[] = "/tmp/microbench.XXXXXX";
+    boot_t boot;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        exit(-1);
+    }
+    memset(&boot, 0, sizeof(boot));
+    memcpy(boot.name, "MICROBEN", 8);
+    boot.bytes_per_sector = 512;
+    boot.sectors_per_cluster = 1;
+    boot.reserved_sectors = 1;
+    boot.fats = 2;
+    boot.root_entries = 224;
+    boot.total_sectors = 2880;
+    boot.media_descriptor = 0xF0;
+    boot.sectors_per_fat = 9;
+    boot.sectors_per_track = 18;
+    boot.heads = 2;
+    boot.sig = 0xAA55;
+    if (ftruncate(fd, 2880 * 512) != 0 || pwrite(fd, &boot, sizeof(boot), 0) != sizeof(boot) ||
+        pwrite(fd, "\xF0\xFF\xFF", 3, 512) != 3 || pwrite(fd, "\xF0\xFF\xFF", 3, 512 * 10) != 3) {
+        perror(path);
+        exit(-1);
+    }
+    close(fd);
+    return path;
+}
+
+/**
+ * Function:  fill_fat
+ * --------------------
+ * @brief give every cluster of both volumes a value: a random mix of free
+ *        and used, or all used but the last, which makes a search for a free
+ *        cluster walk the whole FAT.
+ *
+ */
+void fill_fat(ctx_t *c, int worst) {
+    int i;
+
+    for (i = 2; i < c->vol->fat_size; i++) {
+        uint16_t value = worst ? (i == c->vol->fat_size - 1 ? 0 : 0xFFF) : (next_random() & 1 ? 0 : 0xFFF);
+        vol_set_fat(c->vol, i, value);
+        vol_set_fat(c->paged, i, value);
+    }
+}
+
+/*
+ * FAT entries: random indices into the FAT held in memory, or into the
+ * paged FAT, where most lookups miss its two cached sectors.
+ */
+void setup_fat(ctx_t *c, int worst) {
+    int i;
+
+    fill_fat(c, 0);
+    c->target = worst ? c->paged : c->vol;
+    for (i = 0; i < INPUTS; i++) {
+        c->clusters[i] = 2 + next_random() % (c->vol->fat_size - 2);
+        c->values[i] = next_random() & 0xFFF;
+    }
+}
+
+uint64_t run_get_fat(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < ops; i++) {
+        sum += vol_get_fat(c->target, c->clusters[i % INPUTS]);
+    }
+    return sum;
+}
+
+uint64_t run_set_fat(ctx_t *c, uint64_t ops) {
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        vol_set_fat(c->target, c->clusters[i % INPUTS], c->values[i % INPUTS]);
+    }
+    return ops;
+}
+
+/*
+ * Free clusters: a half free FAT in memory, or the same through the paged FAT.
+ */
+void setup_free(ctx_t *c, int worst) {
+    fill_fat(c, 0);
+    c->target = worst ? c->paged : c->vol;
+}
+
+uint64_t run_free_clusters(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < ops; i++) {
+        sum += vol_free_clusters(c->target);
+    }
+    return sum;
+}
+
+/*
+ * The first free cluster: a random FAT, or a full one with the last cluster free.
+ */
+void setup_find_free(ctx_t *c, int worst) {
+    fill_fat(c, worst);
+    c->target = c->vol;
+}
+
+uint64_t run_find_free(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < ops; i++) {
+        sum += vol_find_free(c->target, c->clusters[i % INPUTS] & 0xFF);
+    }
+    return sum;
+}
+
+/**
+ * Function:  random_name
+ * --------------------
+ * @brief make a random name: an 8.3 one, or a long one of the given length.
+ *
+ */
+void random_name(char *out, int length) {
+    static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 _-";
+    int i;
+
+    if (length == 0) {
+        for (i = 0; i < 8; i++) {
+            out[i] = letters[next_random() % 36];
+        }
+        memcpy(out + 8, ".TXT", 5);
+        return;
+    }
+    for (i = 0; i < length; i++) {
+        out[i] = letters[next_random() % (sizeof(letters) - 1)];
+    }
+    out[0] = 'L';   // never a leading blank
+    out[length - 1] = 'Z';
+    out[length] = '\0';
+}
+
+/**
+ * Function:  fill_root
+ * --------------------
+ * @brief empty the root directory and fill it with new files: random 8.3
+ *        and long names, or as many of the longest names as fit. The
+ *        entries are then read back for the kernels that match names.
+ *
+ */
+void fill_root(ctx_t *c, int worst) {
+    char *zeros = emalloc(c->vol->bytes_per_sector);
+    dir_entry_t e;
+    dir_t dir;
+    uint32_t i;
+
+    memset(zeros, 0, c->vol->bytes_per_sector);
+    for (i = 0; i < c->vol->root_sectors; i++) {
+        vol_write(c->vol, (off_t)(c->vol->root_sector + i) * c->vol->bytes_per_sector, zeros,
+                  c->vol->bytes_per_sector);
+    }
+    free(zeros);
+    for (i = 0; ; i++) {
+        char name[DIR_NAME_MAX + 1];
+        entry_t entry = {0};
+        random_name(name, worst ? DIR_NAME_MAX : (next_random() & 1 ? 0 : 8 + next_random() % 24));
+        if (dir_add(c->vol, 0, name, &entry, 0) != 0) {
+            break;  // the root directory is full
+        }
+    }
+
+    free(c->entries);
+    c->entries = emalloc(c->vol->boot.root_entries * sizeof(dir_entry_t));
+    c->entry_count = 0;
+    dir_open(&dir, c->vol, 0);
+    while (dir_read(&dir, &e)) {
+        c->entries[c->entry_count++] = e;
+    }
+    dir_close(&dir);
+}
+
+uint64_t run_dir_scan(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, done = 0;
+    dir_entry_t e;
+    dir_t dir;
+
+    while (done < ops) {
+        dir_open(&dir, c->vol, 0);
+        while (dir_read(&dir, &e)) {
+            sum += e.entry.attributes;
+            done++;
+        }
+        dir_close(&dir);
+    }
+    return sum;
+}
+
+/*
+ * Name matching: names no entry has, or each entry's own name in another
+ * case, which is compared in full.
+ */
+void setup_match(ctx_t *c, int worst) {
+    int i;
+
+    fill_root(c, worst);
+    for (i = 0; i < INPUTS; i++) {
+        const dir_entry_t *e = &c->entries[i % c->entry_count];
+        if (worst) {
+            char *p;
+            strcpy(c->names[i], e->name);
+            for (p = c->names[i]; *p != '\0'; p++) {
+                *p ^= (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') ? 0x20 : 0;
+            }
+        } else {
+            random_name(c->names[i], next_random() & 1 ? 0 : 8 + next_random() % 24);
+        }
+    }
+}
+
+uint64_t run_dir_match(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < ops; i++) {
+        sum += dir_match(&c->entries[i % c->entry_count], c->names[i % INPUTS]);
+    }
+    return sum;
+}
+
+/*
+ * Dates and times: random times from 1980 to 2107, or times a quarter hour
+ * apart, so every conversion misses the cached UTC offset.
+ */
+void setup_time(ctx_t *c, int worst) {
+    time_t start = 315532800 + 86400 * 3;   // 1980/01/04
+    int i;
+
+    for (i = 0; i < INPUTS; i++) {
+        c->times[i].tv_sec = worst ? start + (time_t)i * 901 : start + (time_t)(next_random() % 4000000000u);
+        c->times[i].tv_nsec = next_random() % 1000000000;
+        dos_from_timespec(&c->times[i], &c->dates[i], &c->clock[i], NULL);
+    }
+}
+
+uint64_t run_from_timespec(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+    uint16_t date, time;
+
+    for (i = 0; i < ops; i++) {
+        dos_from_timespec(&c->times[i % INPUTS], &date, &time, NULL);
+        sum += date + time;
+    }
+    return sum;
+}
+
+uint64_t run_to_timespec(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+    struct timespec ts;
+
+    for (i = 0; i < ops; i++) {
+        dos_to_timespec(c->dates[i % INPUTS], c->clock[i % INPUTS], 0, &ts);
+        sum += ts.tv_sec;
+    }
+    return sum;
+}
+
+uint64_t run_format_date(ctx_t *c, uint64_t ops) {
+    uint64_t sum = 0, i;
+    char date[11], time[6];
+
+    for (i = 0; i < ops; i++) {
+        sum += dos_format_date(c->dates[i % INPUTS], date)[9] + dos_format_time(c->clock[i % INPUTS], time)[4];
+    }
+    return sum;
+}
+
+static const kernel_t kernels[] = {
+    {"get_fat",        "entry",   setup_fat,       run_get_fat},
+    {"set_fat",        "entry",   setup_fat,       run_set_fat},
+    {"free_clusters",  "FAT",     setup_free,      run_free_clusters},
+    {"find_free",      "search",  setup_find_free, run_find_free},
+    {"dir_match",      "compare", setup_match,     run_dir_match},
+    {"dir_scan",       "entry",   fill_root,       run_dir_scan},
+    {"from_timespec",  "time",    setup_time,      run_from_timespec},
+    {"to_timespec",    "time",    setup_time,      run_to_timespec},
+    {"format_date",    "time",    setup_time,      run_format_date},
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function:  measure
+ * --------------------
+ * @brief time a kernel on one case: the op count is doubled until one run
+ *        takes REP_NS, then REPS runs of that count are timed.
+ *
+ */
+void measure(ctx_t *c, const kernel_t *k, int worst) {
+    double per_op[REPS], mean = 0, spread = 0;
+    uint64_t ops = 1;
+    int i;
+
+    k->setup(c, worst);
+    for (;;) {
+        double start = now_ns();
+        sink += k->run(c, ops);
+        if (now_ns() - start >= REP_NS || ops >= (uint64_t)1 << 40) {
+            break;
+        }
+        ops *= 2;
+    }
+    for (i = 0; i < REPS; i++) {
+        double start = now_ns();
+        sink += k->run(c, ops);
+        per_op[i] = (now_ns() - start) / ops;
+        mean += per_op[i] / REPS;
+    }
+    for (i = 0; i < REPS; i++) {
+        spread += (per_op[i] - mean) * (per_op[i] - mean) / REPS;
+    }
+    qsort(per_op, REPS, sizeof(double), by_value);
+    printf("%-14s %-6s %10.2f ns/%-7s %10.2f  +-%5.1f%%  %10.2f M%s/s\n", k->name, worst ? "worst" : "random",
+           per_op[REPS / 2], k->unit, per_op[0], mean > 0 ? 100 * sqrt(spread) / mean : 0.0, 1e3 / per_op[REPS / 2],
+           k->unit);
+}
+
+int main(int argc, char *argv[]) {
+    ctx_t *c = emalloc(sizeof(ctx_t));
+    size_t i;
+    int k;
+
+    // both volumes write to the one scratch image
+    setenv("SFS_LOCK", "0", 1);
+    memset(c, 0, sizeof(ctx_t));
+    char *path = make_image();
+    c->vol = vol_open(path, 1);
+    setenv("SFS_FAT_BUDGET", PAGED_FAT, 1);
+    c->paged = vol_open(path, 1);
+    unsetenv("SFS_FAT_BUDGET");
+    if (c->vol == NULL || c->paged == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        unlink(path);
+        exit(-1);
+    }
+
+    printf("%-14s %-6s %10s %-10s %10s %9s %16s\n", "kernel", "input", "median", "", "min", "spread", "throughput");
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        // the names given pick the kernels to run, all of them if none are given
+        for (k = 1; k < argc && strcmp(argv[k], kernels[i].name) != 0; k++)
+            ;
+        if (argc > 1 && k == argc) {
+            continue;
+        }
+        measure(c, &kernels[i], 0);
+        measure(c, &kernels[i], 1);
+    }
+
+    vol_close(c->paged);
+    vol_close(c->vol);
+    unlink(path);
+    free(c->entries);
+    free(c);
+    return 0;
+}
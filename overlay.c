@@ -0,0 +1,314 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "overlay.h"
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+/**
+ * Function:  overlay_detect
+ * --------------------
+ * @brief check if a file is an overlay.
+ *
+ * @return 1 if it starts with the overlay magic, 0 if not.
+ *
+ */
+int overlay_detect(int fd) {
+    char magic[8];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, OVERLAY_MAGIC, 8) == 0;
+}
+
+/**
+ * Function:  overlay_create
+ * --------------------
+ * @brief make an empty overlay on a base image. Only the header and an
+ *        empty bitmap are written; the rest of the delta file is a hole.
+ *
+ * @param base: the base image.
+ * @param delta: the new delta file, which must not exist.
+ *
+ * @return 0 on success, -1 if the base can't be read or the delta written.
+ *
+ */
+int overlay_create(const char *base, const char *delta) {
+    overlay_header_t header;
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, ret = 0;
+
+    // the base is found by its absolute path, wherever the overlay is used from
+    if (realpath(base, path) == NULL || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    memcpy(header.magic, OVERLAY_MAGIC, 8);
+    header.sector_count = (st.st_size + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+    header.path_length = strlen(path);
+    header.base_size = st.st_size;
+    header.data_offset = (sizeof(header) + header.path_length + header.sector_count / 8 + 1 + OVERLAY_SECTOR - 1) /
+                         OVERLAY_SECTOR * OVERLAY_SECTOR;
+
+    if ((fd = open(delta, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        return -1;
+    }
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(fd, path, header.path_length, sizeof(header)) != header.path_length ||
+        ftruncate(fd, header.data_offset + header.base_size) != 0) {
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Function:  overlay_open
+ * --------------------
+ * @brief open an overlay and its base image.
+ *
+ * @param fd: the delta file, which stays open; opened for writing if the
+ *            overlay is to be written.
+ *
+ * @return The open overlay, or NULL if it is damaged or the base image is
+ *         missing or changed size.
+ *
+ */
+overlay_t *overlay_open(int fd) {
+    overlay_header_t header;
+    char path[PATH_MAX];
+    struct stat st;
+    overlay_t *o;
+    int base_fd;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, OVERLAY_MAGIC, 8) != 0 ||
+        header.path_length >= sizeof(path) ||
+        pread(fd, path, header.path_length, sizeof(header)) != header.path_length) {
+        return NULL;
+    }
+    path[header.path_length] = '\0';
+    if ((base_fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (fstat(base_fd, &st) != 0 || (uint64_t)st.st_size != header.base_size) {
+        close(base_fd);
+        return NULL;
+    }
+
+    o = emalloc(sizeof(overlay_t));
+    o->fd = fd;
+    o->base_fd = base_fd;
+    o->base_path = emalloc(header.path_length + 1);
+    memcpy(o->base_path, path, header.path_length + 1);
+    o->header = header;
+    o->bitmap = emalloc(header.sector_count / 8 + 1);
+    o->bitmap_dirty = 0;
+    o->sector = emalloc(OVERLAY_SECTOR);
+    if (pread(fd, o->bitmap, header.sector_count / 8 + 1, sizeof(header) + header.path_length) !=
+        header.sector_count / 8 + 1) {
+        overlay_close(o);
+        return NULL;
+    }
+    return o;
+}
+
+/**
+ * Function:  overlay_pread
+ * --------------------
+ * @brief read bytes of the image as the overlay sees it. Runs of sectors on
+ *        the same side take one read each. Same contract as pread.
+ *
+ * @param source: the overlay, an overlay_t.
+ *
+ */
+ssize_t overlay_pread(void *source, void *buf, size_t length, off_t offset) {
+    overlay_t *o = source;
+    size_t done = 0;
+
+    if ((uint64_t)offset >= o->header.base_size) {
+        return 0;
+    }
+    if (offset + length > o->header.base_size) {
+        length = o->header.base_size - offset;
+    }
+    while (done < length) {
+        uint64_t pos = offset + done;
+        int in_delta = BIT_TEST(o->bitmap, pos / OVERLAY_SECTOR) != 0;
+        uint64_t end = (pos / OVERLAY_SECTOR + 1) * OVERLAY_SECTOR;
+
+        // extend the run while the next sectors are on the same side
+        while (end < offset + length && (BIT_TEST(o->bitmap, end / OVERLAY_SECTOR) != 0) == in_delta) {
+            end += OVERLAY_SECTOR;
+        }
+        size_t piece = (end < offset + length ? end : offset + length) - pos;
+        ssize_t got = in_delta ? pread(o->fd, (char *)buf + done, piece, o->header.data_offset + pos) :
+                                 pread(o->base_fd, (char *)buf + done, piece, pos);
+        if (got <= 0) {
+            return got < 0 ? -1 : (ssize_t)done;
+        }
+        done += got;
+    }
+    return done;
+}
+
+/**
+ * Function:  copy_up
+ * --------------------
+ * @brief copy a sector from the base to the delta before part of it is
+ *        written, unless the delta holds it already or the write covers it.
+ *
+ * @return 0 on success, -1 on a read or write error.
+ *
+ */
+static int copy_up(overlay_t *o, uint32_t sector, off_t offset, size_t length) {
+    off_t start = (off_t)sector * OVERLAY_SECTOR;
+    ssize_t got;
+
+    if (BIT_TEST(o->bitmap, sector) || (start >= offset && start + OVERLAY_SECTOR <= offset + (off_t)length)) {
+        return 0;
+    }
+    if ((got = pread(o->base_fd, o->sector, OVERLAY_SECTOR, start)) < 0) {
+        return -1;
+    }
+    memset(o->sector + got, 0, OVERLAY_SECTOR - got);
+    return pwrite(o->fd, o->sector, OVERLAY_SECTOR, o->header.data_offset + start) == OVERLAY_SECTOR ? 0 : -1;
+}
+
+/**
+ * Function:  overlay_pwrite
+ * --------------------
+ * @brief write bytes of the image to the delta file. Same contract as
+ *        pwrite; writes past the end of the image are dropped.
+ *
+ * @param source: the overlay, an overlay_t.
+ *
+ */
+ssize_t overlay_pwrite(void *source, const void *buf, size_t length, off_t offset) {
+    overlay_t *o = source;
+    size_t done = 0;
+    uint32_t first, last, sector;
+
+    if ((uint64_t)offset >= o->header.base_size || length == 0) {
+        return 0;
+    }
+    if (offset + length > o->header.base_size) {
+        length = o->header.base_size - offset;
+    }
+    first = offset / OVERLAY_SECTOR;
+    last = (offset + length - 1) / OVERLAY_SECTOR;
+    // only the sectors at either end can be written in part
+    if (copy_up(o, first, offset, length) != 0 || (last != first && copy_up(o, last, offset, length) != 0)) {
+        return -1;
+    }
+
+    while (done < length) {
+        ssize_t put = pwrite(o->fd, (const char *)buf + done, length - done, o->header.data_offset + offset + done);
+        if (put <= 0) {
+            return -1;
+        }
+        done += put;
+    }
+    for (sector = first; sector <= last; sector++) {
+        BIT_SET(o->bitmap, sector);
+    }
+    o->bitmap_dirty = 1;
+    return done;
+}
+
+/**
+ * Function:  overlay_sync
+ * --------------------
+ * @brief write the bitmap to the delta file, after the sectors it points at.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int overlay_sync(overlay_t *o) {
+    size_t size = o->header.sector_count / 8 + 1;
+
+    if (!o->bitmap_dirty) {
+        return 0;
+    }
+    if (pwrite(o->fd, o->bitmap, size, sizeof(overlay_header_t) + o->header.path_length) != (ssize_t)size) {
+        return -1;
+    }
+    o->bitmap_dirty = 0;
+    return 0;
+}
+
+/**
+ * Function:  overlay_merge
+ * --------------------
+ * @brief write every sector the delta holds to another image, e.g. the base
+ *        itself or a copy of it. Runs of held sectors take one copy each.
+ *
+ * @param dst_fd: the image to write to.
+ *
+ * @return The number of sectors written, or -1 on a read or write error.
+ *
+ */
+int overlay_merge(overlay_t *o, int dst_fd) {
+    char *buf = emalloc(64 * OVERLAY_SECTOR);
+    uint32_t sector = 0, count = 0;
+
+    while (sector < o->header.sector_count) {
+        uint32_t run = 0;
+        while (sector + run < o->header.sector_count && run < 64 && BIT_TEST(o->bitmap, sector + run)) {
+            run++;
+        }
+        if (run == 0) {
+            sector++;
+            continue;
+        }
+        off_t start = (off_t)sector * OVERLAY_SECTOR;
+        size_t length = (uint64_t)start + run * OVERLAY_SECTOR > o->header.base_size ?
+                        o->header.base_size - start : run * OVERLAY_SECTOR;
+        if (pread(o->fd, buf, length, o->header.data_offset + start) != (ssize_t)length ||
+            pwrite(dst_fd, buf, length, start) != (ssize_t)length) {
+            free(buf);
+            return -1;
+        }
+        sector += run;
+        count += run;
+    }
+    free(buf);
+    return count;
+}
+
+/**
+ * Function:  overlay_reset
+ * --------------------
+ * @brief empty the overlay once its sectors are merged into the base: clear
+ *        the bitmap and give the sectors' space back.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int overlay_reset(overlay_t *o) {
+    memset(o->bitmap, 0, o->header.sector_count / 8 + 1);
+    o->bitmap_dirty = 1;
+    if (overlay_sync(o) != 0 || ftruncate(o->fd, o->header.data_offset) != 0 ||
+        ftruncate(o->fd, o->header.data_offset + o->header.base_size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function:  overlay_close
+ * --------------------
+ * @brief release an overlay and close its base image. The delta file is
+ *        left open.
+ *
+ */
+void overlay_close(overlay_t *o) {
+    close(o->base_fd);
+    free(o->base_path);
+    free(o->bitmap);
+    free(o->sector);
+    free(o);
+}
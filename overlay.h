@@ -0,0 +1,47 @@
+#ifndef _OVERLAY_H_
+#define _OVERLAY_H_
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Header of a copy-on-write overlay. The base image is never written; every
+ * sector written through the overlay goes to the delta file instead, and a
+ * bit per sector says which sectors the delta holds. The header is followed
+ * by the base image path, the bitmap and then, at data_offset, a sparse copy
+ * of the image where only the written sectors take space.
+ */
+typedef struct {
+    char      magic[8];          /* OVERLAY_MAGIC. */
+    uint32_t  sector_count;      /* Sectors in the base image. */
+    uint32_t  path_length;       /* Bytes in the base image path. */
+    uint64_t  base_size;         /* Bytes in the base image when the overlay was made. */
+    uint64_t  data_offset;       /* Where the sectors start in the delta file. */
+} __attribute__ ((packed)) overlay_header_t;
+
+#define OVERLAY_MAGIC   "SFSDELT1"
+#define OVERLAY_SECTOR  512      /* Bytes tracked by each bit of the bitmap. */
+
+/*
+ * An open overlay.
+ */
+typedef struct {
+    int       fd;                /* The delta file. */
+    int       base_fd;           /* The base image, read-only. */
+    char      *base_path;        /* The base image's absolute path. */
+    overlay_header_t header;
+    uint8_t   *bitmap;           /* One bit per sector held by the delta. */
+    int       bitmap_dirty;      /* Set if the bitmap changed since it was written. */
+    char      *sector;           /* Room for a sector being copied up. */
+} overlay_t;
+
+int overlay_detect(int fd);
+int overlay_create(const char *base, const char *delta);
+overlay_t *overlay_open(int fd);
+ssize_t overlay_pread(void *source, void *buf, size_t length, off_t offset);
+ssize_t overlay_pwrite(void *source, const void *buf, size_t length, off_t offset);
+int overlay_sync(overlay_t *o);
+int overlay_merge(overlay_t *o, int dst_fd);
+int overlay_reset(overlay_t *o);
+void overlay_close(overlay_t *o);
+
+#endif
@@ -0,0 +1,74 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include "readahead.h"
+
+/**
+ * Function:  readahead_window
+ * --------------------
+ * @brief get the number of clusters to hint ahead of the reader. The window
+ *        is taken from SFS_READAHEAD; 0 turns the hints off.
+ *
+ * @return The readahead window in clusters.
+ *
+ */
+int readahead_window(void) {
+    const char *value = getenv("SFS_READAHEAD");
+    int window;
+
+    if (value == NULL || *value == '\0') {
+        return READAHEAD_DEFAULT;
+    }
+    window = atoi(value);
+    return window < 0 ? 0 : window;
+}
+
+/**
+ * Function:  readahead_init
+ * --------------------
+ * @brief start an empty set of hints for a file.
+ *
+ * @param ra: the hints to initialize.
+ * @param fd: the file the hints are for.
+ *
+ */
+void readahead_init(readahead_t *ra, int fd) {
+    ra->fd = fd;
+    ra->offset = 0;
+    ra->length = 0;
+}
+
+/**
+ * Function:  readahead_flush
+ * --------------------
+ * @brief tell the kernel about the pending range.
+ *
+ * @param ra: the pending hints.
+ *
+ */
+void readahead_flush(readahead_t *ra) {
+    if (ra->length > 0) {
+        posix_fadvise(ra->fd, ra->offset, ra->length, POSIX_FADV_WILLNEED);
+    }
+    ra->length = 0;
+}
+
+/**
+ * Function:  readahead_add
+ * --------------------
+ * @brief add a byte range that will be read soon. A range that directly follows
+ *        the pending one extends it, anything else flushes the pending one first.
+ *
+ * @param ra: the pending hints.
+ * @param offset: the start of the range.
+ * @param length: the length of the range.
+ *
+ */
+void readahead_add(readahead_t *ra, off_t offset, off_t length) {
+    if (ra->length > 0 && ra->offset + ra->length == offset) {
+        ra->length += length;
+        return;
+    }
+    readahead_flush(ra);
+    ra->offset = offset;
+    ra->length = length;
+}
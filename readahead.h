@@ -0,0 +1,23 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Pending readahead hint. Byte ranges added back to back are merged so
+ * a chain of contiguous clusters costs one posix_fadvise call.
+ */
+typedef struct {
+    int       fd;                /* The file the hints are for. */
+    off_t     offset;            /* Start of the pending range. */
+    off_t     length;            /* Length of the pending range, 0 if none. */
+} readahead_t;
+
+#define READAHEAD_DEFAULT 64     /* Clusters hinted ahead unless SFS_READAHEAD says otherwise. */
+
+int readahead_window(void);
+void readahead_init(readahead_t *ra, int fd);
+void readahead_add(readahead_t *ra, off_t offset, off_t length);
+void readahead_flush(readahead_t *ra);
+
+#endif
@@ -0,0 +1,209 @@
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "file.h"
+#include "volume.h"
+
+#define SCRIPT_ARGS 64           /* The most words a script line can have. */
+
+int diskinfo_main(int argc, char *argv[]);
+int disklist_main(int argc, char *argv[]);
+int diskget_main(int argc, char *argv[]);
+int diskput_main(int argc, char *argv[]);
+
+/*
+ * A tool linked into the sfs binary, run by its name.
+ */
+typedef struct {
+    const char *name;
+    int       (*main)(int argc, char *argv[]);
+} tool_t;
+
+static const tool_t tools[] = {
+    {"diskinfo", diskinfo_main},
+    {"disklist", disklist_main},
+    {"diskget", diskget_main},
+    {"diskput", diskput_main},
+};
+
+/**
+ * Function:  find_tool
+ * --------------------
+ * @brief look up a tool by its name, with or without the "disk" in front.
+ *
+ * @return The tool, or NULL if there is none of that name.
+ *
+ */
+const tool_t *find_tool(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+        if (strcmp(name, tools[i].name) == 0 || strcmp(name, tools[i].name + 4) == 0) {
+            return &tools[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function:  split_line
+ * --------------------
+ * @brief split a script line into words in place. Words are separated by
+ *        blanks; double quotes keep blanks in a word, e.g. a long file name,
+ *        and a # outside quotes starts a comment.
+ *
+ * @param line: the line, changed in place.
+ * @param words: set to the words.
+ *
+ * @return The number of words, or -1 if a quote isn't closed or there are
+ *         too many words.
+ *
+ */
+int split_line(char *line, char **words) {
+    char *in = line, *out = line;
+    int count = 0;
+
+    for (;;) {
+        while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+            in++;
+        }
+        if (*in == '\0' || *in == '#') {
+            return count;
+        }
+        if (count == SCRIPT_ARGS - 2) {
+            return -1;
+        }
+        words[count++] = out;
+        while (*in != '\0' && *in != ' ' && *in != '\t' && *in != '\r' && *in != '\n') {
+            if (*in != '"') {
+                *out++ = *in++;
+                continue;
+            }
+            for (in++; *in != '"'; ) {
+                if (*in == '\0') {
+                    return -1;
+                }
+                *out++ = *in++;
+            }
+            in++;
+        }
+        // the terminator may overwrite the blank just read past, never a later word
+        if (*in != '\0') {
+            in++;
+        }
+        *out++ = '\0';
+    }
+}
+
+/**
+ * Function:  run_script
+ * --------------------
+ * @brief run the commands of a script read from stdin against one disk image.
+ *        The image is opened and its FAT loaded once; every command works on
+ *        that volume, and all changes are flushed together at the end. A
+ *        line is a tool and its arguments without the image, e.g.
+ *        put SUB1 "a long name.txt". The first command that fails ends the
+ *        script without the flush, as when that tool fails on its own.
+ *        The puts of new files are batched: each allocates its clusters and
+ *        directory slot in turn, and their data is copied by a pool of
+ *        threads before the flush, or before another command reads or
+ *        rewrites file data.
+ *
+ * @param image: the disk image.
+ * @param threads: the number of threads copying the data of new files.
+ *
+ * @return 0 if every command succeeded, -1 if not.
+ *
+ */
+int run_script(char *image, int threads) {
+    char *line = NULL, *words[SCRIPT_ARGS], *argv[SCRIPT_ARGS + 1];
+    size_t size = 0;
+    volume_t *vol;
+    int number = 0;
+
+    if ((vol = vol_mount(image)) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", image);
+        return -1;
+    }
+    file_batch(vol, threads);
+    while (getline(&line, &size, stdin) >= 0) {
+        int count = split_line(line, words), argc = 0, i = 1;
+        const tool_t *tool;
+
+        number++;
+        if (count == 0) {
+            continue;
+        }
+        if (count < 0 || (tool = find_tool(words[0])) == NULL) {
+            fprintf(stderr, "line %d: %s\n", number, count < 0 ? "Unclosed quote or too many words." :
+                                                                 "Unknown command.");
+            exit(-1);
+        }
+
+        // stdin holds the script, so a put can't read a file from it
+        if (tool->main == diskput_main && strcmp(words[count - 1], "-") == 0) {
+            fprintf(stderr, "line %d: put - reads stdin, which is the script.\n", number);
+            exit(-1);
+        }
+
+        // the fleet options and extra images read the images from disk, not this volume
+        if ((tool->main == diskinfo_main || tool->main == disklist_main) && count > 1) {
+            fprintf(stderr, "line %d: %s takes no arguments in a script.\n", number, words[0]);
+            exit(-1);
+        }
+
+        // the tools take their options first, then the image
+        argv[argc++] = (char *)tool->name;
+        for (; i < count && words[i][0] == '-'; i++) {
+            argv[argc++] = words[i];
+        }
+        argv[argc++] = image;
+        for (; i < count; i++) {
+            argv[argc++] = words[i];
+        }
+        argv[argc] = NULL;
+        fflush(stdout);
+        if (tool->main(argc, argv) != 0) {
+            fprintf(stderr, "line %d: %s failed.\n", number, words[0]);
+            exit(-1);
+        }
+    }
+    free(line);
+    if (file_batch(vol, 0) != 0) {
+        printf("Failed to write the files into the disk image.\n");
+        exit(-1);
+    }
+    if (vol_unmount(vol) != 0) {
+        printf("Failed to write the changes to the disk image.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const tool_t *tool = find_tool(basename(argv[0]));
+
+    // run as diskinfo, disklist, diskget or diskput through a link
+    if (tool != NULL) {
+        return tool->main(argc, argv);
+    }
+
+    // the data of new files is copied on as many threads as there are cores, unless -j says
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 5 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0) {
+        threads = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        return run_script(argv[2], threads > 0 ? threads : 1) == 0 ? 0 : -1;
+    }
+    if (argc < 2 || (tool = find_tool(argv[1])) == NULL) {
+        fprintf(stderr, "usage: sfs <info|list|get|put> <arguments of the tool>\n"
+                        "       sfs [-j threads] -s <disk.img> < script\n");
+        exit(-1);
+    }
+    return tool->main(argc - 1, argv + 1);
+}
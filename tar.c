@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "tar.h"
+
+#define TAR_NUMBER_MAX 077777777777ULL  /* The largest number a 12-byte field holds. */
+
+#define PAX_PATH  0x01           /* Records of an extended header that override the ustar fields. */
+#define PAX_SIZE  0x02
+#define PAX_MTIME 0x04
+
+/**
+ * Function:  tar_write_full
+ * --------------------
+ * @brief write all the bytes to a stream, however the writes are split.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int tar_write_full(int fd, const void *buf, size_t length) {
+    const char *p = buf;
+
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function:  tar_read_full
+ * --------------------
+ * @brief read exactly length bytes from a stream.
+ *
+ * @return 0 on success, -1 on a read error or if the stream ends first.
+ *
+ */
+int tar_read_full(int fd, void *buf, size_t length) {
+    char *p = buf;
+
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function:  tar_skip
+ * --------------------
+ * @brief read past bytes of a stream, which can't seek.
+ *
+ * @return 0 on success, -1 on a read error or if the stream ends first.
+ *
+ */
+int tar_skip(int fd, uint64_t length) {
+    char buf[TAR_BLOCK * 16];
+
+    while (length > 0) {
+        size_t n = length < sizeof(buf) ? length : sizeof(buf);
+        if (tar_read_full(fd, buf, n) != 0) {
+            return -1;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function:  tar_write_padding
+ * --------------------
+ * @brief write the zeros that fill the last block of a member's data.
+ *
+ * @param size: the number of data bytes written.
+ *
+ */
+int tar_write_padding(int fd, uint64_t size) {
+    static const char zeros[TAR_BLOCK];
+
+    return size % TAR_BLOCK == 0 ? 0 : tar_write_full(fd, zeros, TAR_BLOCK - size % TAR_BLOCK);
+}
+
+/**
+ * Function:  tar_write_end
+ * --------------------
+ * @brief write the two zero blocks that end an archive.
+ *
+ */
+int tar_write_end(int fd) {
+    static const char zeros[TAR_BLOCK * 2];
+
+    return tar_write_full(fd, zeros, sizeof(zeros));
+}
+
+/**
+ * Function:  write_block
+ * --------------------
+ * @brief fill in the numbers, magic and checksum of a header and write it.
+ *
+ */
+static int write_block(int fd, tar_header_t *h, char type, uint64_t size, time_t mtime) {
+    const unsigned char *p = (const unsigned char *)h;
+    unsigned sum = 0;
+    size_t i;
+
+    snprintf(h->mode, sizeof(h->mode), "%07o", type == TAR_DIR ? 0755 : 0644);
+    snprintf(h->uid, sizeof(h->uid), "%07o", 0);
+    snprintf(h->gid, sizeof(h->gid), "%07o", 0);
+    // 11 octal digits hold any FAT file size and any DOS date
+    snprintf(h->size, sizeof(h->size), "%011llo", (unsigned long long)size & TAR_NUMBER_MAX);
+    snprintf(h->mtime, sizeof(h->mtime), "%011llo", (unsigned long long)(mtime > 0 ? mtime : 0) & TAR_NUMBER_MAX);
+    h->type = type;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    memset(h->checksum, ' ', sizeof(h->checksum));
+    for (i = 0; i < sizeof(tar_header_t); i++) {
+        sum += p[i];
+    }
+    snprintf(h->checksum, sizeof(h->checksum), "%06o", sum);
+    return tar_write_full(fd, h, sizeof(tar_header_t));
+}
+
+/**
+ * Function:  tar_write_header
+ * --------------------
+ * @brief write the header of a member. A path that fits neither the name
+ *        field nor a split between prefix and name goes in a pax extended
+ *        header in front.
+ *
+ * @param fd: the archive.
+ * @param path: the path in the archive; a directory's ends in '/'.
+ * @param type: TAR_FILE or TAR_DIR.
+ * @param size: the number of data bytes that follow, 0 for a directory.
+ * @param mtime: the modification time.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int tar_write_header(int fd, const char *path, char type, uint64_t size, time_t mtime) {
+    size_t length = strlen(path), i;
+    tar_header_t h;
+
+    memset(&h, 0, sizeof(h));
+    if (length <= sizeof(h.name)) {
+        memcpy(h.name, path, length);
+        return write_block(fd, &h, type, size, mtime);
+    }
+    // split at the last '/' that leaves both parts short enough, walking back from the end
+    for (i = length - 1; i > 0; i--) {
+        if (path[i] == '/' && i <= sizeof(h.prefix) && length - i - 1 <= sizeof(h.name) && length - i - 1 > 0) {
+            memcpy(h.prefix, path, i);
+            memcpy(h.name, path + i + 1, length - i - 1);
+            return write_block(fd, &h, type, size, mtime);
+        }
+    }
+
+    // "<length> path=<path>\n", where the length counts its own digits
+    size_t record = length + strlen(" path=\n"), total = record + 1;
+    while (total != record + snprintf(NULL, 0, "%zu", total)) {
+        total = record + snprintf(NULL, 0, "%zu", total);
+    }
+    char *data = emalloc(total + 1);
+    snprintf(data, total + 1, "%zu path=%s\n", total, path);
+
+    tar_header_t x;
+    memset(&x, 0, sizeof(x));
+    snprintf(x.name, sizeof(x.name), "PaxHeaders/%.80s", strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path);
+    int ret = write_block(fd, &x, 'x', total, mtime) != 0 || tar_write_full(fd, data, total) != 0 ||
+              tar_write_padding(fd, total) != 0 ? -1 : 0;
+    free(data);
+    if (ret != 0) {
+        return -1;
+    }
+    memcpy(h.name, path + length - sizeof(h.name), sizeof(h.name));  // the tail, for readers without pax
+    return write_block(fd, &h, type, size, mtime);
+}
+
+/**
+ * Function:  parse_octal
+ * --------------------
+ * @brief read an octal number field, which may end in a NUL or a blank.
+ *
+ */
+static uint64_t parse_octal(const char *field, size_t width) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    while (i < width && field[i] == ' ') {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+/**
+ * Function:  apply_pax
+ * --------------------
+ * @brief apply the path, size and mtime records of a pax extended header to
+ *        the member that follows it.
+ *
+ * @param data: the records, NUL-terminated.
+ * @param length: the number of bytes of records.
+ * @param out: the member.
+ * @param found: PAX_PATH, PAX_SIZE and PAX_MTIME set for the records found.
+ *
+ */
+static void apply_pax(char *data, size_t length, tar_entry_t *out, int *found) {
+    size_t at = 0;
+
+    while (at < length) {
+        char *end, *key = NULL;
+        size_t record = strtoul(data + at, &end, 10);
+        if (record == 0 || at + record > length || *end != ' ') {
+            return;
+        }
+        key = end + 1;
+        data[at + record - 1] = '\0';   // the newline ends the value
+        if (strncmp(key, "path=", 5) == 0 && strlen(key + 5) < sizeof(out->path)) {
+            strcpy(out->path, key + 5);
+            *found |= PAX_PATH;
+        } else if (strncmp(key, "size=", 5) == 0) {
+            out->size = strtoull(key + 5, NULL, 10);
+            *found |= PAX_SIZE;
+        } else if (strncmp(key, "mtime=", 6) == 0) {
+            out->mtime = strtoll(key + 6, NULL, 10);
+            *found |= PAX_MTIME;
+        }
+        at += record;
+    }
+}
+
+/**
+ * Function:  tar_read_header
+ * --------------------
+ * @brief read the header of the next member of an archive. pax extended
+ *        headers and GNU long names are applied to the member after them.
+ *
+ * @param fd: the archive, at a header.
+ * @param out: the member; its data follows in the stream.
+ *
+ * @return 1 if a member was read, 0 at the end of the archive, -1 if the
+ *         stream is cut short or a header is damaged.
+ *
+ */
+int tar_read_header(int fd, tar_entry_t *out) {
+    int found = 0;
+    tar_header_t h;
+
+    for (;;) {
+        const unsigned char *p = (const unsigned char *)&h;
+        unsigned sum = 0, stored;
+        size_t i;
+
+        if (tar_read_full(fd, &h, sizeof(h)) != 0) {
+            return -1;
+        }
+        for (i = 0; i < sizeof(h); i++) {
+            sum += i >= offsetof(tar_header_t, checksum) && i < offsetof(tar_header_t, type) ? ' ' : p[i];
+        }
+        if (sum == ' ' * sizeof(h.checksum)) {
+            return 0;   // a zero block ends the archive
+        }
+        stored = parse_octal(h.checksum, sizeof(h.checksum));
+        if (stored != sum) {
+            return -1;
+        }
+
+        uint64_t size = parse_octal(h.size, sizeof(h.size));
+        if (h.type == 'x' || h.type == 'L') {
+            // the data says what the next member is called
+            uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+            if (size >= TAR_PATH_MAX * 4) {
+                return -1;
+            }
+            char *data = emalloc(padded + 1);
+            if (tar_read_full(fd, data, padded) != 0) {
+                free(data);
+                return -1;
+            }
+            data[size] = '\0';
+            if (h.type == 'L') {
+                snprintf(out->path, sizeof(out->path), "%s", data);
+                found |= PAX_PATH;
+            } else {
+                apply_pax(data, size, out, &found);
+            }
+            free(data);
+            continue;
+        }
+        if (h.type == 'g') {
+            if (tar_skip(fd, (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (!(found & PAX_PATH)) {
+            size_t prefix = strnlen(h.prefix, sizeof(h.prefix)), name = strnlen(h.name, sizeof(h.name));
+            out->path[0] = '\0';
+            if (prefix > 0 && memcmp(h.magic, "ustar", 5) == 0) {
+                memcpy(out->path, h.prefix, prefix);
+                out->path[prefix++] = '/';
+            } else {
+                prefix = 0;
+            }
+            memcpy(out->path + prefix, h.name, name);
+            out->path[prefix + name] = '\0';
+        }
+        out->type = h.type == '\0' || h.type == '7' ? TAR_FILE : h.type;
+        if (!(found & PAX_SIZE)) {
+            out->size = size;
+        }
+        if (!(found & PAX_MTIME)) {
+            out->mtime = parse_octal(h.mtime, sizeof(h.mtime));
+        }
+        return 1;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef _TAR_H_
+#define _TAR_H_
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define TAR_BLOCK     512        /* Headers and data are padded to blocks of this size. */
+#define TAR_PATH_MAX  4096       /* The longest path read from an extended header. */
+
+#define TAR_FILE      '0'
+#define TAR_DIR       '5'
+
+/*
+ * A POSIX ustar header block.
+ */
+typedef struct {
+    char      name[100];         /* The path, or its last part if prefix is used. */
+    char      mode[8];           /* Octal numbers are NUL-terminated ASCII. */
+    char      uid[8];
+    char      gid[8];
+    char      size[12];
+    char      mtime[12];
+    char      checksum[8];       /* The sum of the header bytes, with this field as blanks. */
+    char      type;              /* TAR_FILE, TAR_DIR, ... */
+    char      linkname[100];
+    char      magic[6];          /* "ustar" */
+    char      version[2];        /* "00" */
+    char      uname[32];
+    char      gname[32];
+    char      devmajor[8];
+    char      devminor[8];
+    char      prefix[155];       /* The leading directories of a path too long for name. */
+    char      _pad[12];
+} __attribute__ ((packed)) tar_header_t;
+
+/*
+ * A member of an archive as read back, with any extended header applied.
+ */
+typedef struct {
+    char      path[TAR_PATH_MAX];
+    char      type;
+    uint64_t  size;              /* Bytes of data following the header. */
+    time_t    mtime;
+} tar_entry_t;
+
+int tar_write_header(int fd, const char *path, char type, uint64_t size, time_t mtime);
+int tar_write_padding(int fd, uint64_t size);
+int tar_write_end(int fd);
+int tar_read_header(int fd, tar_entry_t *out);
+int tar_read_full(int fd, void *buf, size_t length);
+int tar_skip(int fd, uint64_t length);
+int tar_write_full(int fd, const void *buf, size_t length);
+
+#endif
@@ -0,0 +1,762 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emalloc.h"
+#include "readahead.h"
+#include "volume.h"
+
+/*
+ * The volume held open by vol_mount. Opening its path again returns it, and
+ * closing it leaves it open, so a batch of commands shares one FAT load and
+ * one flush.
+ */
+static volume_t *mounted = NULL;
+static char *mounted_path = NULL;
+
+// open file description locks belong to the open image, not the process, so
+// closing another descriptor of the same file doesn't drop them
+#ifdef F_OFD_SETLKW
+#define LOCK_WAIT F_OFD_SETLKW
+#else
+#define LOCK_WAIT F_SETLKW
+#endif
+
+/**
+ * Function:  cache_capacity
+ * --------------------
+ * @brief get the number of sectors to cache, from SFS_CACHE if set.
+ *
+ */
+static int cache_capacity(void) {
+    const char *value = getenv("SFS_CACHE");
+    if (value == NULL || atoi(value) < 1) {
+        return CACHE_DEFAULT;
+    }
+    return atoi(value);
+}
+
+/**
+ * Function:  fat_budget
+ * --------------------
+ * @brief get the number of bytes the FAT may take in memory, from
+ *        SFS_FAT_BUDGET if set. A bigger FAT is paged through a cache of
+ *        that size instead of being loaded whole.
+ *
+ */
+static uint32_t fat_budget(void) {
+    const char *value = getenv("SFS_FAT_BUDGET");
+    if (value == NULL || atoi(value) < 1) {
+        return FAT_BUDGET_DEFAULT;
+    }
+    return atoi(value);
+}
+
+/**
+ * Function:  locking
+ * --------------------
+ * @brief check if readers and writers of an image should coordinate through
+ *        locks, which SFS_LOCK=0 turns off.
+ *
+ */
+static int locking(void) {
+    const char *value = getenv("SFS_LOCK");
+    return value == NULL || strcmp(value, "0") != 0;
+}
+
+/**
+ * Function:  metadata_length
+ * --------------------
+ * @brief get the number of bytes from the start of the image to the data
+ *        area: the boot sector, the FAT copies and the root directory.
+ *
+ */
+static off_t metadata_length(volume_t *vol) {
+    return (off_t)vol->data_sector * vol->bytes_per_sector;
+}
+
+/**
+ * Function:  read_hook
+ * --------------------
+ * @brief read sectors for a cache through the compressed image or the overlay.
+ *
+ */
+static ssize_t read_hook(void *source, void *buf, size_t length, off_t offset) {
+    return vol_read(source, buf, length, offset);
+}
+
+/**
+ * Function:  write_hook
+ * --------------------
+ * @brief write back a sector of a cache. Readers see the metadata as it was
+ *        when they opened the image, so the first write back waits for them
+ *        to finish and takes the metadata lock, which the next flush lets go
+ *        once the rest of the changes are on the disk. A reader never sees a
+ *        directory entry whose FAT chain is still only in memory.
+ *
+ */
+static ssize_t write_hook(void *source, const void *buf, size_t length, off_t offset) {
+    volume_t *vol = source;
+
+    if (!vol->committing) {
+        vol->committing = vol_lock(vol, F_WRLCK, 0, metadata_length(vol)) == 0;
+    }
+    return vol_write_data(vol, buf, length, offset);
+}
+
+/**
+ * Function:  set_hooks
+ * --------------------
+ * @brief send a cache's reads through the compressed image or the overlay, if
+ *        the volume is one, and its writes through the metadata lock.
+ *
+ */
+static void set_hooks(volume_t *vol, cache_t *cache) {
+    if (!vol->direct) {
+        cache->read = read_hook;
+    }
+    if (vol->writable) {
+        cache->write = write_hook;
+    }
+    cache->source = vol;
+}
+
+/**
+ * Function:  vol_open
+ * --------------------
+ * @brief open a disk image, read its boot sector and load the first FAT.
+ *        A compressed image is read through its chunks and can't be written;
+ *        an overlay is read through its base and written to its delta file.
+ *        A reader holds a shared lock on the metadata until it closes the
+ *        volume; a writer holds the writer lock, so there is one at a time,
+ *        and locks the metadata only to write it. Either waits for the lock.
+ *
+ * @param path: the disk image.
+ * @param writable: 1 to open it for writing as well.
+ *
+ * @return The open volume, or NULL if the image can't be opened, isn't FAT12,
+ *         is compressed and writable was asked for, or is an overlay whose
+ *         base is gone.
+ *
+ */
+volume_t *vol_open(const char *path, int writable) {
+    volume_t *vol;
+    int fd, i;
+    boot_t boot;
+
+    if (mounted != NULL && strcmp(path, mounted_path) == 0) {
+        return !writable || mounted->writable ? mounted : NULL;
+    }
+    if ((fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0) {
+        return NULL;
+    }
+    vol = emalloc(sizeof(volume_t));
+    vol->fd = fd;
+    vol->writable = writable;
+    vol->locking = locking();
+    vol->committing = 0;
+    vol->zimage = NULL;
+    vol->overlay = NULL;
+    if (zimage_detect(fd) && (writable || (vol->zimage = zimage_open(fd)) == NULL)) {
+        close(fd);
+        free(vol);
+        return NULL;
+    }
+    if (overlay_detect(fd) && (vol->overlay = overlay_open(fd)) == NULL) {
+        close(fd);
+        free(vol);
+        return NULL;
+    }
+    vol->direct = vol->zimage == NULL && vol->overlay == NULL;
+
+    if (vol_read(vol, &boot, sizeof(boot), 0) != sizeof(boot) || boot.bytes_per_sector < 512 ||
+        (boot.bytes_per_sector & (boot.bytes_per_sector - 1)) != 0 || boot.sectors_per_cluster == 0 ||
+        boot.fats == 0 || boot.sectors_per_fat == 0) {
+        if (vol->zimage != NULL) {
+            zimage_close(vol->zimage);
+        }
+        if (vol->overlay != NULL) {
+            overlay_close(vol->overlay);
+        }
+        close(fd);
+        free(vol);
+        return NULL;
+    }
+    vol->boot = boot;
+    vol->bytes_per_sector = boot.bytes_per_sector;
+    vol->cluster_size = boot.bytes_per_sector * boot.sectors_per_cluster;
+    vol->total_sectors = boot.total_sectors != 0 ? boot.total_sectors : boot.total_sectors2;
+    vol->fat_sector = boot.reserved_sectors;
+    vol->root_sector = boot.reserved_sectors + boot.fats * boot.sectors_per_fat;
+    vol->root_sectors = (boot.root_entries * sizeof(entry_t) + boot.bytes_per_sector - 1) / boot.bytes_per_sector;
+    vol->data_sector = vol->root_sector + vol->root_sectors;
+    vol->fat_size = (vol->total_sectors - vol->data_sector) / boot.sectors_per_cluster + 2;
+
+    // a file system without locks, e.g. some network mounts, is used without them
+    if (vol_lock(vol, writable ? F_WRLCK : F_RDLCK, writable ? LOCK_WRITER : 0,
+                 writable ? 1 : metadata_length(vol)) != 0) {
+        vol->locking = 0;
+    }
+    vol->cache = cache_create(fd, boot.bytes_per_sector, cache_capacity());
+    set_hooks(vol, vol->cache);
+
+    // an entry may not point past what the FAT can hold
+    if (vol->fat_size > boot.sectors_per_fat * boot.bytes_per_sector * 2 / 3) {
+        vol->fat_size = boot.sectors_per_fat * boot.bytes_per_sector * 2 / 3;
+    }
+
+    vol->fat_dirty = emalloc(boot.sectors_per_fat);
+    memset(vol->fat_dirty, 0, boot.sectors_per_fat);
+    vol->fat_table = NULL;
+    vol->fat_cache = NULL;
+
+    // a FAT over the budget is read a page at a time, when it is used
+    if ((uint32_t)boot.sectors_per_fat * boot.bytes_per_sector > fat_budget()) {
+        vol->fat_cache = cache_create(fd, boot.bytes_per_sector, fat_budget() / boot.bytes_per_sector);
+        set_hooks(vol, vol->fat_cache);
+        return vol;
+    }
+
+    /* read a FAT copy through the cache */
+    vol->fat_table = emalloc(boot.sectors_per_fat * boot.bytes_per_sector);
+    for (i = 0; i < boot.sectors_per_fat; i++) {
+        memcpy(vol->fat_table + i * boot.bytes_per_sector, vol_read_sector(vol, vol->fat_sector + i),
+               boot.bytes_per_sector);
+    }
+    return vol;
+}
+
+/**
+ * Function:  write_metadata
+ * --------------------
+ * @brief write the changed FAT sectors and the dirty cache sectors for vol_flush.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+static int write_metadata(volume_t *vol) {
+    int i, k;
+
+    for (i = 0; i < vol->boot.sectors_per_fat; i++) {
+        if (!vol->fat_dirty[i]) {
+            continue;
+        }
+        // a paged FAT holds the first copy in its own cache already
+        const char *page = vol->fat_cache != NULL ? cache_read(vol->fat_cache, vol->fat_sector + i) :
+                                                    (const char *)vol->fat_table + i * vol->bytes_per_sector;
+        for (k = vol->fat_cache != NULL ? 1 : 0; k < vol->boot.fats; k++) {
+            if (cache_write(vol->cache, vol->fat_sector + k * vol->boot.sectors_per_fat + i, 0, page,
+                            vol->bytes_per_sector) != 0) {
+                return -1;
+            }
+        }
+        vol->fat_dirty[i] = 0;
+    }
+    if ((vol->fat_cache != NULL && cache_flush(vol->fat_cache) != 0) || cache_flush(vol->cache) != 0) {
+        return -1;
+    }
+    // the overlay bitmap goes last, once the sectors it points at are written
+    return vol->overlay != NULL ? overlay_sync(vol->overlay) : 0;
+}
+
+/**
+ * Function:  vol_flush
+ * --------------------
+ * @brief write the changed FAT sectors to every FAT copy, then every dirty
+ *        sector in the cache to the disk. The metadata is locked for the
+ *        whole flush, and from any write back before it, so a reader opens
+ *        the image before the changes or after all of them.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int vol_flush(volume_t *vol) {
+    int ret;
+
+    if (!vol->committing) {
+        vol->committing = vol_lock(vol, F_WRLCK, 0, metadata_length(vol)) == 0;
+    }
+    ret = write_metadata(vol);
+    if (vol->committing) {
+        vol_lock(vol, F_UNLCK, 0, metadata_length(vol));
+        vol->committing = 0;
+    }
+    return ret;
+}
+
+/**
+ * Function:  vol_close
+ * --------------------
+ * @brief flush and close the volume. Set SFS_CACHE_STATS to print the cache counters.
+ *        A mounted volume is left open until it is unmounted.
+ *
+ * @return 0 on success, -1 if the flush failed.
+ *
+ */
+int vol_close(volume_t *vol) {
+    if (vol == mounted) {
+        return 0;
+    }
+    int ret = vol->writable ? vol_flush(vol) : 0;
+
+    if (getenv("SFS_CACHE_STATS") != NULL) {
+        cache_stats(vol->cache, stderr);
+        if (vol->fat_cache != NULL) {
+            fprintf(stderr, "FAT ");
+            cache_stats(vol->fat_cache, stderr);
+        }
+    }
+    cache_destroy(vol->cache);
+    if (vol->fat_cache != NULL) {
+        cache_destroy(vol->fat_cache);
+    }
+    if (vol->zimage != NULL) {
+        zimage_close(vol->zimage);
+    }
+    if (vol->overlay != NULL) {
+        overlay_close(vol->overlay);
+    }
+    close(vol->fd);
+    free(vol->fat_table);
+    free(vol->fat_dirty);
+    free(vol);
+    return ret;
+}
+
+/**
+ * Function:  vol_mount
+ * --------------------
+ * @brief open a disk image and keep it open for the commands that follow.
+ *        Until it is unmounted, vol_open of the same path returns it and
+ *        vol_close leaves it alone. It is opened for writing if it can be.
+ *
+ * @param path: the disk image.
+ *
+ * @return The mounted volume, or NULL if the image can't be opened.
+ *
+ */
+volume_t *vol_mount(const char *path) {
+    volume_t *vol;
+
+    if ((vol = vol_open(path, 1)) == NULL && (vol = vol_open(path, 0)) == NULL) {
+        return NULL;
+    }
+    mounted_path = emalloc(strlen(path) + 1);
+    strcpy(mounted_path, path);
+    mounted = vol;
+    return vol;
+}
+
+/**
+ * Function:  vol_unmount
+ * --------------------
+ * @brief flush and close the mounted volume.
+ *
+ * @return 0 on success, -1 if the flush failed.
+ *
+ */
+int vol_unmount(volume_t *vol) {
+    mounted = NULL;
+    free(mounted_path);
+    mounted_path = NULL;
+    return vol_close(vol);
+}
+
+/**
+ * Function:  fat_byte
+ * --------------------
+ * @brief get a byte of the first FAT, from memory or from its page. A page
+ *        that isn't cached is read with the pages after it, since chains
+ *        and scans mostly walk the FAT forwards.
+ *
+ */
+static uint8_t fat_byte(volume_t *vol, uint32_t j) {
+    uint32_t page = j / vol->bytes_per_sector;
+
+    if (vol->fat_table != NULL) {
+        return vol->fat_table[j];
+    }
+    if (!cache_has(vol->fat_cache, vol->fat_sector + page)) {
+        uint32_t left = vol->boot.sectors_per_fat - page;
+        cache_prefetch(vol->fat_cache, vol->fat_sector + page, left < CACHE_PREFETCH ? left : CACHE_PREFETCH);
+    }
+    return (uint8_t)cache_read(vol->fat_cache, vol->fat_sector + page)[j % vol->bytes_per_sector];
+}
+
+/**
+ * Function:  set_fat_byte
+ * --------------------
+ * @brief change a byte of the first FAT and mark its sector for every FAT
+ *        copy on flush.
+ *
+ */
+static void set_fat_byte(volume_t *vol, uint32_t j, uint8_t value) {
+    uint32_t page = j / vol->bytes_per_sector;
+
+    if (vol->fat_table != NULL) {
+        vol->fat_table[j] = value;
+    } else if (cache_write(vol->fat_cache, vol->fat_sector + page, j % vol->bytes_per_sector, &value, 1) != 0) {
+        fprintf(stderr, "Failed to write back a FAT sector\n");
+        exit(-1);
+    }
+    vol->fat_dirty[page] = 1;
+}
+
+/**
+ * Function:  vol_get_fat
+ * --------------------
+ * @brief get the value of the FAT entry.
+ *
+ * @param i The index of the FAT entry.
+ *
+ * @return The value of the FAT entry, 0xFFF (end of chain) for an index past the FAT.
+ *
+ */
+uint16_t vol_get_fat(volume_t *vol, uint16_t i) {
+    uint32_t j;
+
+    if (i >= vol->fat_size) {
+        return 0xFFF;
+    }
+    if (i & 0x01) {     // odd
+        j = (1 + i * 3) / 2;
+        return ((fat_byte(vol, j - 1) & 0xF0) >> 4) + (fat_byte(vol, j) << 4);
+    } else {            // even
+        j = i * 3 / 2;
+        return ((fat_byte(vol, j + 1) & 0x0F) << 8) + fat_byte(vol, j);
+    }
+}
+
+/**
+ * Function:  vol_set_fat
+ * --------------------
+ * @brief update the FAT entry. The change is written to every FAT copy on flush.
+ *        Freeing a cluster drops its sectors from the cache: file data is
+ *        written past the cache, so a dirty directory sector left there
+ *        would land on the data of the cluster's next owner.
+ *
+ * @param i The index of the FAT entry to be updated.
+ * @param new_val the new value of the FAT entry
+ *
+ */
+void vol_set_fat(volume_t *vol, uint16_t i, uint16_t new_val) {
+    uint32_t j;
+
+    if (i >= vol->fat_size) {
+        return;
+    }
+    new_val = new_val & 0xFFF;
+    if (i & 0x01) {     // odd
+        j = (1 + i * 3) / 2;
+        set_fat_byte(vol, j, (new_val >> 4) & 0xFF);
+        set_fat_byte(vol, j - 1, ((new_val & 0x0F) << 4) | (fat_byte(vol, j - 1) & 0x0F));
+    } else {            // even
+        j = i * 3 / 2;
+        set_fat_byte(vol, j, new_val & 0xFF);
+        set_fat_byte(vol, j + 1, ((new_val >> 8) & 0x0F) | (fat_byte(vol, j + 1) & 0xF0));
+    }
+    if (new_val == 0 && i >= 2) {
+        cache_discard(vol->cache, vol_cluster_sector(vol, i), vol->boot.sectors_per_cluster);
+    }
+}
+
+/**
+ * Function:  vol_free_clusters
+ * --------------------
+ * @brief get the number of unused clusters by looking at the FAT entries.
+ *
+ */
+int vol_free_clusters(volume_t *vol) {
+    int i, free_clusters = 0;
+
+    // the first two entries in FAT are reserved
+    for (i = 2; i < vol->fat_size; i++) {
+        if (vol_get_fat(vol, i) == 0) {
+            // 0x000 in an FAT entry means unused
+            free_clusters += 1;
+        }
+    }
+    return free_clusters;
+}
+
+/**
+ * Function:  vol_find_free
+ * --------------------
+ * @brief get the first unused cluster at or after a given one.
+ *
+ * @param start: the first cluster to look at.
+ *
+ * @return The free cluster, or 0 if there is none at or after start.
+ *
+ */
+uint16_t vol_find_free(volume_t *vol, uint16_t start) {
+    uint16_t cluster;
+
+    for (cluster = start < 2 ? 2 : start; cluster < vol->fat_size; cluster++) {
+        if (vol_get_fat(vol, cluster) == 0) {
+            return cluster;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function:  vol_alloc_chain
+ * --------------------
+ * @brief reserve free clusters and link them into a chain in the FAT.
+ *
+ * @param count: the number of clusters to reserve.
+ *
+ * @return The clusters of the chain in order, or NULL if there aren't enough
+ *         free clusters.
+ *
+ */
+uint16_t *vol_alloc_chain(volume_t *vol, int count) {
+    uint16_t *chain;
+    uint16_t cluster = 2;
+    int i;
+
+    if (count > vol_free_clusters(vol)) {
+        return NULL;
+    }
+    chain = emalloc((count + 1) * sizeof(uint16_t));
+    for (i = 0; i < count; i++) {
+        cluster = vol_find_free(vol, cluster);
+        chain[i] = cluster;
+        if (i > 0) {
+            vol_set_fat(vol, chain[i - 1], cluster);
+        }
+        vol_set_fat(vol, cluster, 0xFFF);   // end of chain until the next link is made
+        cluster++;
+    }
+    return chain;
+}
+
+/**
+ * Function:  vol_free_chain
+ * --------------------
+ * @brief mark every cluster of a chain unused. A chain that loops is freed
+ *        up to the cluster where it comes back.
+ *
+ * @param cluster: the first cluster of the chain.
+ *
+ */
+void vol_free_chain(volume_t *vol, uint16_t cluster) {
+    while (cluster >= 2 && cluster < vol->fat_size) {
+        uint16_t next = vol_get_fat(vol, cluster);
+        if (next == 0) {
+            return; // already free, the loop closed here
+        }
+        vol_set_fat(vol, cluster, 0x000);
+        cluster = next;
+    }
+}
+
+/**
+ * Function:  vol_cluster_sector
+ * --------------------
+ * @brief get the first sector of a cluster in the data area.
+ *
+ */
+uint32_t vol_cluster_sector(volume_t *vol, uint16_t cluster) {
+    return vol->data_sector + (uint32_t)(cluster - 2) * vol->boot.sectors_per_cluster;
+}
+
+/**
+ * Function:  vol_cluster_offset
+ * --------------------
+ * @brief get the byte offset of a cluster in the disk image.
+ *
+ */
+off_t vol_cluster_offset(volume_t *vol, uint16_t cluster) {
+    return (off_t)vol_cluster_sector(vol, cluster) * vol->bytes_per_sector;
+}
+
+/**
+ * Function:  vol_dir_start
+ * --------------------
+ * @brief get the first sector of a directory.
+ *
+ * @param dir_cluster: the first cluster of the directory, 0 for the root directory.
+ *
+ */
+uint32_t vol_dir_start(volume_t *vol, uint16_t dir_cluster) {
+    return dir_cluster == 0 ? vol->root_sector : vol_cluster_sector(vol, dir_cluster);
+}
+
+/**
+ * Function:  vol_dir_next
+ * --------------------
+ * @brief get the sector of a directory that follows the given one, following
+ *        the FAT chain at the end of each cluster.
+ *
+ * @param dir_cluster: the cluster holding sector, 0 for the root directory.
+ *                     Updated when the walk moves on to the next cluster.
+ * @param sector: the current sector.
+ *
+ * @return The next sector, or 0 at the end of the directory.
+ *
+ */
+uint32_t vol_dir_next(volume_t *vol, uint16_t *dir_cluster, uint32_t sector) {
+    uint16_t next;
+
+    sector++;
+    if (*dir_cluster == 0) { // root directory
+        return sector < vol->data_sector ? sector : 0;
+    }
+    if ((sector - vol->data_sector) % vol->boot.sectors_per_cluster != 0) {
+        return sector;
+    }
+    next = vol_get_fat(vol, *dir_cluster);
+    if (next < 2 || next >= 0x0FF8) {
+        return 0; // no more clusters
+    }
+    *dir_cluster = next;
+    return vol_cluster_sector(vol, next);
+}
+
+/**
+ * Function:  vol_hint_dir
+ * --------------------
+ * @brief tell the kernel which sectors of a directory will be read next. The
+ *        FAT gives the chain order, which the kernel's readahead can't guess.
+ *
+ * @param dir_cluster: the cluster to start hinting from, 0 for the root directory.
+ * @param window: the number of clusters to hint.
+ *
+ */
+void vol_hint_dir(volume_t *vol, uint16_t dir_cluster, int window) {
+    readahead_t ra;
+    int i;
+
+    if (window == 0 || !vol->direct) {
+        return; // offsets in a compressed image or an overlay aren't offsets in one file
+    }
+    readahead_init(&ra, vol->fd);
+    if (dir_cluster == 0) { // root directory
+        readahead_add(&ra, (off_t)vol->root_sector * vol->bytes_per_sector,
+                      (off_t)vol->root_sectors * vol->bytes_per_sector);
+    }
+    for (i = 0; i < window && dir_cluster >= 2 && dir_cluster < 0x0FF8; i++) {
+        readahead_add(&ra, vol_cluster_offset(vol, dir_cluster), vol->cluster_size);
+        dir_cluster = vol_get_fat(vol, dir_cluster);
+    }
+    readahead_flush(&ra);
+}
+
+/**
+ * Function:  vol_read_sector
+ * --------------------
+ * @brief read a metadata sector through the cache.
+ *
+ * @return The sector contents, valid until the next call into the volume.
+ *
+ */
+const char *vol_read_sector(volume_t *vol, uint32_t sector) {
+    return cache_read(vol->cache, sector);
+}
+
+/**
+ * Function:  vol_read
+ * --------------------
+ * @brief read bytes of the disk, bypassing the cache. Same contract as pread;
+ *        a compressed image only inflates the chunks the bytes are in, and an
+ *        overlay reads each sector from the delta or the base.
+ *
+ * @param buf: where the bytes go.
+ * @param length: the number of bytes.
+ * @param offset: the byte offset in the disk image.
+ *
+ */
+ssize_t vol_read(volume_t *vol, void *buf, size_t length, off_t offset) {
+    if (vol->zimage != NULL) {
+        return zimage_pread(vol->zimage, buf, length, offset);
+    }
+    if (vol->overlay != NULL) {
+        return overlay_pread(vol->overlay, buf, length, offset);
+    }
+    return pread(vol->fd, buf, length, offset);
+}
+
+/**
+ * Function:  vol_write_data
+ * --------------------
+ * @brief write file data to the disk, bypassing the cache. Same contract as
+ *        pwrite; an overlay takes the bytes in its delta file.
+ *
+ * @param buf: the bytes.
+ * @param length: the number of bytes.
+ * @param offset: the byte offset in the disk image.
+ *
+ */
+ssize_t vol_write_data(volume_t *vol, const void *buf, size_t length, off_t offset) {
+    if (vol->overlay != NULL) {
+        return overlay_pwrite(vol->overlay, buf, length, offset);
+    }
+    return pwrite(vol->fd, buf, length, offset);
+}
+
+/**
+ * Function:  vol_write
+ * --------------------
+ * @brief change metadata bytes of the disk through the cache. The change is
+ *        written back on flush.
+ *
+ * @param address: the byte offset in the disk image.
+ * @param data: the new bytes.
+ * @param length: the number of bytes.
+ *
+ * @return 0 on success, -1 on a write error.
+ *
+ */
+int vol_write(volume_t *vol, off_t address, const void *data, uint32_t length) {
+    const char *p = data;
+
+    while (length > 0) {
+        uint32_t sector = address / vol->bytes_per_sector;
+        uint32_t offset = address % vol->bytes_per_sector;
+        uint32_t n = vol->bytes_per_sector - offset < length ? vol->bytes_per_sector - offset : length;
+        if (cache_write(vol->cache, sector, offset, p, n) != 0) {
+            return -1;
+        }
+        address += n;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Function:  vol_lock
+ * --------------------
+ * @brief lock or unlock a byte range of the disk image against the other
+ *        tools using it, waiting for a conflicting lock to go. Locks are
+ *        advisory: only tools of this package take them.
+ *
+ * @param type: F_RDLCK to share the range, F_WRLCK to hold it alone, or F_UNLCK.
+ * @param start: the byte offset in the disk image.
+ * @param length: the number of bytes.
+ *
+ * @return 0 on success or if locking is off, -1 if the lock can't be taken.
+ *
+ */
+int vol_lock(volume_t *vol, int type, off_t start, off_t length) {
+    struct flock lock = {0};
+
+    if (!vol->locking || length == 0) {
+        return 0; // a length of 0 would lock to the end of the file and beyond
+    }
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = length;
+    while (fcntl(vol->fd, LOCK_WAIT, &lock) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _VOLUME_H_
+#define _VOLUME_H_
+#include <stdint.h>
+#include <sys/types.h>
+#include "cache.h"
+#include "overlay.h"
+#include "sfs.h"
+#include "zimage.h"
+
+#define FAT_BUDGET_DEFAULT (1024 * 1024)  /* Bytes a FAT may take in memory unless SFS_FAT_BUDGET says otherwise. */
+#define LOCK_WRITER ((off_t)1 << 62)      /* A byte past any image, locked by the one writer of an image. */
+
+/*
+ * An open disk image: its geometry, a memory copy of the FAT and the sector
+ * cache that every directory and FAT access goes through.
+ */
+typedef struct {
+    int       fd;                /* The disk image. */
+    int       writable;          /* Set if the image was opened for writing. */
+    int       locking;           /* Set if the image is locked against the other tools using it. */
+    int       committing;        /* Set from the first write back until the flush ends. */
+    int       direct;            /* Set if the image is a plain file, read and written through fd. */
+    boot_t    boot;              /* The boot sector. */
+    uint32_t  bytes_per_sector;
+    uint32_t  cluster_size;      /* The number of bytes per cluster. */
+    uint32_t  total_sectors;
+    uint32_t  fat_sector;        /* The first sector of the first FAT. */
+    uint32_t  root_sector;       /* The first sector of the root directory. */
+    uint32_t  root_sectors;      /* The number of sectors in the root directory. */
+    uint32_t  data_sector;       /* The first sector of the data area (cluster 2). */
+    uint16_t  fat_size;          /* The number of FAT entries, including the two reserved ones. */
+    uint8_t   *fat_table;        /* Memory copy of the first FAT, NULL if it is paged. */
+    uint8_t   *fat_dirty;        /* One flag per FAT sector changed since the last flush. */
+    cache_t   *cache;
+    cache_t   *fat_cache;        /* Pages of the first FAT, if it is too big to load whole. */
+    zimage_t  *zimage;           /* Set if the image is compressed, which makes it read-only. */
+    overlay_t *overlay;          /* Set if the image is an overlay on a read-only base. */
+} volume_t;
+
+volume_t *vol_open(const char *path, int writable);
+int vol_flush(volume_t *vol);
+int vol_close(volume_t *vol);
+volume_t *vol_mount(const char *path);
+int vol_unmount(volume_t *vol);
+
+uint16_t vol_get_fat(volume_t *vol, uint16_t i);
+void vol_set_fat(volume_t *vol, uint16_t i, uint16_t new_val);
+int vol_free_clusters(volume_t *vol);
+uint16_t vol_find_free(volume_t *vol, uint16_t start);
+uint16_t *vol_alloc_chain(volume_t *vol, int count);
+void vol_free_chain(volume_t *vol, uint16_t cluster);
+
+uint32_t vol_cluster_sector(volume_t *vol, uint16_t cluster);
+off_t vol_cluster_offset(volume_t *vol, uint16_t cluster);
+uint32_t vol_dir_start(volume_t *vol, uint16_t dir_cluster);
+uint32_t vol_dir_next(volume_t *vol, uint16_t *dir_cluster, uint32_t sector);
+void vol_hint_dir(volume_t *vol, uint16_t dir_cluster, int window);
+
+const char *vol_read_sector(volume_t *vol, uint32_t sector);
+ssize_t vol_read(volume_t *vol, void *buf, size_t length, off_t offset);
+ssize_t vol_write_data(volume_t *vol, const void *buf, size_t length, off_t offset);
+int vol_write(volume_t *vol, off_t address, const void *data, uint32_t length);
+int vol_lock(volume_t *vol, int type, off_t start, off_t length);
+
+#endif
@@ -0,0 +1,592 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "emalloc.h"
+#include "readahead.h"
+#include "xfer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#else
+#define HAVE_URING 0
+#endif
+
+/*
+ * Readahead state of the source: how far past the copy position it is hinted.
+ */
+typedef struct {
+    readahead_t ra;
+    off_t     window;            /* Bytes to keep hinted ahead of the copy, 0 for none. */
+    int       ext;               /* The next extent to hint. */
+    uint32_t  done;              /* Bytes of that extent already hinted. */
+    off_t     hinted;            /* Total bytes hinted so far. */
+} hint_t;
+
+static void hint_init(hint_t *hint, int fd, off_t window) {
+    readahead_init(&hint->ra, fd);
+    hint->window = window;
+    hint->ext = 0;
+    hint->done = 0;
+    hint->hinted = 0;
+}
+
+/**
+ * Function:  hint_ahead
+ * --------------------
+ * @brief keep the source hinted up to one window past the copy position. The
+ *        window is refilled once it is half consumed to batch the fadvise calls.
+ *
+ * @param hint: the readahead state.
+ * @param extents, count: the runs being copied.
+ * @param copied: the number of bytes queued for copying so far.
+ *
+ */
+static void hint_ahead(hint_t *hint, const extent_t *extents, int count, off_t copied) {
+    if (hint->window == 0 || hint->hinted >= copied + hint->window / 2) {
+        return;
+    }
+    while (hint->ext < count && hint->hinted < copied + hint->window) {
+        off_t want = copied + hint->window - hint->hinted;
+        uint32_t n = extents[hint->ext].length - hint->done;
+        if (want < n) {
+            n = want;
+        }
+        readahead_add(&hint->ra, extents[hint->ext].src_offset + hint->done, n);
+        hint->done += n;
+        hint->hinted += n;
+        if (hint->done == extents[hint->ext].length) {
+            hint->ext++;
+            hint->done = 0;
+        }
+    }
+    readahead_flush(&hint->ra);
+}
+
+/**
+ * Function:  block_is_zero
+ * --------------------
+ * @brief check whether a block holds only zero bytes, 64 bytes per step with SSE2.
+ *
+ * @param buf: the block.
+ * @param length: the number of bytes in the block.
+ *
+ * @return 1 if every byte is zero, 0 otherwise.
+ *
+ */
+static int block_is_zero(const char *buf, size_t length) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= length; i += 64) {
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            return 0;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int write_all(int dst_fd, const char *buf, size_t length, off_t dst_offset) {
+    while (length > 0) {
+        ssize_t put = pwrite(dst_fd, buf, length, dst_offset);
+        if (put <= 0) {
+            return -1;
+        }
+        buf += put;
+        dst_offset += put;
+        length -= put;
+    }
+    return 0;
+}
+
+/**
+ * Function:  write_data
+ * --------------------
+ * @brief write a buffer to the destination. With XFER_SPARSE, blocks of the
+ *        destination that would only receive zeros are skipped and stay holes.
+ *
+ * @param dst_fd: the destination file.
+ * @param buf: the data.
+ * @param length: the number of bytes.
+ * @param dst_offset: where the data goes in the destination.
+ * @param flags: XFER_SPARSE or 0.
+ *
+ * @return 0 on success, -1 on a failed write.
+ *
+ */
+static int write_data(int dst_fd, const char *buf, size_t length, off_t dst_offset, int flags) {
+    size_t done = 0;
+
+    if (!(flags & XFER_SPARSE)) {
+        return write_all(dst_fd, buf, length, dst_offset);
+    }
+    while (done < length) {
+        // the first block may start in the middle of a destination block
+        size_t n = XFER_HOLE - (dst_offset + done) % XFER_HOLE;
+        if (n > length - done) {
+            n = length - done;
+        }
+        if (block_is_zero(buf + done, n)) {
+            done += n;
+            continue;
+        }
+        // write the whole run of non-zero blocks at once
+        size_t run = n;
+        while (done + run < length) {
+            size_t m = length - done - run < XFER_HOLE ? length - done - run : XFER_HOLE;
+            if (block_is_zero(buf + done + run, m)) {
+                break;
+            }
+            run += m;
+        }
+        if (write_all(dst_fd, buf + done, run, dst_offset + done) != 0) {
+            return -1;
+        }
+        done += run;
+    }
+    return 0;
+}
+
+/**
+ * Function:  verify_chunk
+ * --------------------
+ * @brief read back a chunk just written and compare its CRC32C with the
+ *        CRC32C of the data still in the buffer, which is then overwritten.
+ *
+ * @param dst_fd: the destination file.
+ * @param buf: the data written; reused for the read back.
+ * @param length: the number of bytes.
+ * @param dst_offset: where the data went in the destination.
+ *
+ * @return 0 if they match, XFER_MISMATCH if not, -1 on a failed read.
+ *
+ */
+static int verify_chunk(int dst_fd, char *buf, size_t length, off_t dst_offset) {
+    uint32_t written = crc32c(0, buf, length);
+
+    if (pread(dst_fd, buf, length, dst_offset) != (ssize_t)length) {
+        return -1;
+    }
+    return crc32c(0, buf, length) == written ? 0 : XFER_MISMATCH;
+}
+
+/**
+ * Function:  copy_sync
+ * --------------------
+ * @brief copy one run of bytes with pread/pwrite.
+ *
+ * @param src_fd, dst_fd: the source and destination files.
+ * @param src_offset, dst_offset: where the run starts in each file.
+ * @param length: the number of bytes to copy.
+ * @param buf: a scratch buffer of at least XFER_CHUNK bytes.
+ * @param flags: XFER_SPARSE, XFER_VERIFY or 0.
+ *
+ * @return 0 on success, -1 on a failed or short read/write, XFER_MISMATCH
+ *         if a chunk read back differs.
+ *
+ */
+static int copy_sync(int src_fd, int dst_fd, off_t src_offset, off_t dst_offset, size_t length, char *buf, int flags) {
+    int ret;
+
+    while (length > 0) {
+        size_t n = length < XFER_CHUNK ? length : XFER_CHUNK;
+        ssize_t got = pread(src_fd, buf, n, src_offset);
+        if (got <= 0) {
+            return -1;
+        }
+        if (write_data(dst_fd, buf, got, dst_offset, flags) != 0) {
+            return -1;
+        }
+        if ((flags & XFER_VERIFY) && (ret = verify_chunk(dst_fd, buf, got, dst_offset)) != 0) {
+            return ret;
+        }
+        src_offset += got;
+        dst_offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+/**
+ * Function:  xfer_sync
+ * --------------------
+ * @brief copy every extent with pread/pwrite, one after another.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ *
+ */
+static int xfer_sync(int src_fd, int dst_fd, const extent_t *extents, int count, off_t readahead, int flags) {
+    char *buf = emalloc(XFER_CHUNK);
+    hint_t hint;
+    off_t copied = 0;
+    int i, ret = 0;
+
+    hint_init(&hint, src_fd, readahead);
+    for (i = 0; i < count && ret == 0; i++) {
+        hint_ahead(&hint, extents, count, copied);
+        copied += extents[i].length;
+        ret = copy_sync(src_fd, dst_fd, extents[i].src_offset, extents[i].dst_offset, extents[i].length, buf, flags);
+    }
+    free(buf);
+    return ret;
+}
+
+#if HAVE_URING
+
+/*
+ * The mapped submission and completion rings of one io_uring instance.
+ */
+typedef struct {
+    int       fd;
+    unsigned  *sq_head;
+    unsigned  *sq_tail;
+    unsigned  *sq_mask;
+    unsigned  *sq_array;
+    unsigned  sq_entries;
+    unsigned  sqe_tail;          /* Local tail, published to *sq_tail on submit. */
+    unsigned  *cq_head;
+    unsigned  *cq_tail;
+    unsigned  *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void      *sq_map;
+    size_t    sq_map_size;
+    void      *cq_map;
+    size_t    cq_map_size;
+    size_t    sqes_size;
+} ring_t;
+
+/*
+ * One chunk travelling through the ring as a linked read -> write pair.
+ */
+typedef struct {
+    off_t     src_offset;
+    off_t     dst_offset;
+    uint32_t  length;
+    int       pending;           /* Completions still expected for this slot. */
+    int       failed;            /* Set if either half came back short or failed. */
+} slot_t;
+
+static int ring_setup(ring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_map + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_teardown(ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe *ring_get_sqe(ring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Function:  ring_submit_and_wait
+ * --------------------
+ * @brief publish the queued SQEs and wait for at least one completion.
+ *
+ * @return 0 on success, -1 if io_uring_enter failed.
+ *
+ */
+static int ring_submit_and_wait(ring_t *ring) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Function:  queue_chunk
+ * --------------------
+ * @brief queue a read of the chunk into the slot's buffer, linked to a write of
+ *        the same buffer, so the pair needs no round trip through user space.
+ *        Sparse copies queue the read alone, the data has to be looked at first.
+ *
+ */
+static void queue_chunk(ring_t *ring, int src_fd, int dst_fd, slot_t *slot, int index, char *buf, int fixed, int flags) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring);
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->flags = (flags & XFER_SPARSE) ? 0 : IOSQE_IO_LINK;
+    sqe->fd = src_fd;
+    sqe->off = slot->src_offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = slot->length;
+    sqe->buf_index = fixed ? index : 0;
+    sqe->user_data = (uint64_t)index << 1;
+    slot->pending = 1;
+    slot->failed = 0;
+    if (flags & XFER_SPARSE) {
+        return;
+    }
+
+    sqe = ring_get_sqe(ring);
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = dst_fd;
+    sqe->off = slot->dst_offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = slot->length;
+    sqe->buf_index = fixed ? index : 0;
+    sqe->user_data = ((uint64_t)index << 1) | 1;
+    slot->pending = 2;
+}
+
+/**
+ * Function:  xfer_uring
+ * --------------------
+ * @brief copy the extents with up to XFER_DEPTH linked read/write pairs in flight.
+ *        Chunks that come back short or failed are redone with pread/pwrite.
+ *        With XFER_VERIFY a chunk is checked as soon as its pair completes,
+ *        while the other slots stay in flight.
+ *
+ * @return 0 on success, -1 on an I/O error, XFER_MISMATCH if a chunk read
+ *         back differs, 1 if io_uring could not be set up.
+ *
+ */
+static int xfer_uring(int src_fd, int dst_fd, const extent_t *extents, int count, off_t readahead, int flags) {
+    ring_t ring;
+    hint_t hint;
+    off_t copied = 0;
+    slot_t slots[XFER_DEPTH];
+    struct iovec iov[XFER_DEPTH];
+    char *bufs;
+    int i, fixed, inflight = 0, ret = 0;
+    int ext = 0;
+    uint32_t ext_done = 0;
+
+    if (ring_setup(&ring, XFER_DEPTH * 2) != 0) {
+        return 1;
+    }
+    if (posix_memalign((void **)&bufs, 4096, (size_t)XFER_DEPTH * XFER_CHUNK) != 0) {
+        ring_teardown(&ring);
+        return 1;
+    }
+    for (i = 0; i < XFER_DEPTH; i++) {
+        iov[i].iov_base = bufs + (size_t)i * XFER_CHUNK;
+        iov[i].iov_len = XFER_CHUNK;
+        slots[i].pending = 0;
+    }
+    hint_init(&hint, src_fd, readahead);
+    // registered buffers save a page pin per request, but are optional
+    fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, XFER_DEPTH) == 0;
+
+    while (ext < count || inflight > 0) {
+        // fill every idle slot with the next chunk
+        for (i = 0; i < XFER_DEPTH && ext < count; i++) {
+            if (slots[i].pending != 0) {
+                continue;
+            }
+            uint32_t left = extents[ext].length - ext_done;
+            slots[i].src_offset = extents[ext].src_offset + ext_done;
+            slots[i].dst_offset = extents[ext].dst_offset + ext_done;
+            slots[i].length = left < XFER_CHUNK ? left : XFER_CHUNK;
+            ext_done += slots[i].length;
+            if (ext_done == extents[ext].length) {
+                ext++;
+                ext_done = 0;
+            }
+            if (slots[i].length == 0) {
+                continue;
+            }
+            queue_chunk(&ring, src_fd, dst_fd, &slots[i], i, iov[i].iov_base, fixed, flags);
+            copied += slots[i].length;
+            inflight++;
+        }
+        hint_ahead(&hint, extents, count, copied);
+        if (inflight == 0) {
+            continue;
+        }
+
+        if (ring_submit_and_wait(&ring) != 0) {
+            ret = -1;
+            break;
+        }
+
+        // reap everything that has completed
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data >> 1;
+            slot_t *slot = &slots[index];
+            if (cqe->res != (int32_t)slot->length) {
+                slot->failed = 1;
+            } else if (flags & XFER_SPARSE) {
+                // the read is done, write whatever isn't zero
+                slot->failed = write_data(dst_fd, iov[index].iov_base, slot->length, slot->dst_offset, flags) != 0;
+            }
+            if (--slot->pending == 0) {
+                int r;
+                inflight--;
+                if (slot->failed) {
+                    r = copy_sync(src_fd, dst_fd, slot->src_offset, slot->dst_offset, slot->length,
+                                  iov[index].iov_base, flags);
+                } else {
+                    r = (flags & XFER_VERIFY) ?
+                        verify_chunk(dst_fd, iov[index].iov_base, slot->length, slot->dst_offset) : 0;
+                }
+                if (r != 0 && ret == 0) {
+                    ret = r;
+                }
+            }
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    ring_teardown(&ring);
+    free(bufs);
+    return ret;
+}
+
+#endif
+
+/**
+ * Function:  xfer_backend
+ * --------------------
+ * @brief pick the copy backend. SFS_IO=sync forces pread/pwrite, otherwise
+ *        io_uring is used whenever the kernel offers it.
+ *
+ * @return XFER_URING or XFER_SYNC.
+ *
+ */
+int xfer_backend(void) {
+    const char *choice = getenv("SFS_IO");
+
+    if (choice != NULL && strcmp(choice, "sync") == 0) {
+        return XFER_SYNC;
+    }
+    return HAVE_URING ? XFER_URING : XFER_SYNC;
+}
+
+/**
+ * Function:  xfer_extents
+ * --------------------
+ * @brief copy a list of extents from one file to another, falling back to
+ *        pread/pwrite when io_uring is unavailable.
+ *
+ * @param src_fd: the file to read from.
+ * @param dst_fd: the file to write to.
+ * @param extents: the runs to copy.
+ * @param count: the number of runs.
+ * @param readahead: the number of source bytes to hint ahead of the copy,
+ *                   0 to leave readahead to the kernel.
+ * @param flags: XFER_SPARSE to leave all-zero blocks of a freshly created
+ *               destination unwritten, XFER_VERIFY to read every chunk back
+ *               and compare checksums, 0 to write every byte unchecked.
+ *
+ * @return 0 on success, -1 on an I/O error, XFER_MISMATCH if a chunk read
+ *         back differs from what was written.
+ *
+ */
+int xfer_extents(int src_fd, int dst_fd, const extent_t *extents, int count, off_t readahead, int flags) {
+#if HAVE_URING
+    if (xfer_backend() == XFER_URING) {
+        int ret = xfer_uring(src_fd, dst_fd, extents, count, readahead, flags);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+#endif
+    return xfer_sync(src_fd, dst_fd, extents, count, readahead, flags);
+}
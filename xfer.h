@@ -0,0 +1,31 @@
+#ifndef _XFER_H_
+#define _XFER_H_
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A run of contiguous bytes copied from one file to another.
+ */
+typedef struct {
+    off_t     src_offset;        /* Byte offset of the run in the source file. */
+    off_t     dst_offset;        /* Byte offset of the run in the destination file. */
+    uint32_t  length;            /* The number of bytes in the run. */
+} extent_t;
+
+#define XFER_CHUNK  (64 * 1024)  /* Largest single read/write issued by the engine. */
+#define XFER_DEPTH  8            /* Number of chunks kept in flight by io_uring. */
+
+#define XFER_HOLE   4096         /* Granularity of the holes left by XFER_SPARSE. */
+
+#define XFER_SPARSE 0x01         /* Leave all-zero blocks of a fresh destination unwritten. */
+#define XFER_VERIFY 0x02         /* Read every chunk back once written and compare CRC32Cs. */
+
+#define XFER_MISMATCH (-2)       /* A chunk read back differs from what was written. */
+
+#define XFER_SYNC   0            /* pread/pwrite backend. */
+#define XFER_URING  1            /* io_uring backend. */
+
+int xfer_backend(void);
+int xfer_extents(int src_fd, int dst_fd, const extent_t *extents, int count, off_t readahead, int flags);
+
+#endif
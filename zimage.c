@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "emalloc.h"
+#include "zimage.h"
+
+/**
+ * Function:  zimage_detect
+ * --------------------
+ * @brief check if a file is a compressed image.
+ *
+ * @param fd: the file.
+ *
+ * @return 1 if it starts with the compressed image magic, 0 if not.
+ *
+ */
+int zimage_detect(int fd) {
+    char magic[8];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, ZIMAGE_MAGIC, 8) == 0;
+}
+
+/**
+ * Function:  zimage_open
+ * --------------------
+ * @brief read the header and chunk index of a compressed image.
+ *
+ * @param fd: the compressed image, which stays open.
+ *
+ * @return The open image, or NULL if the header or index is invalid.
+ *
+ */
+zimage_t *zimage_open(int fd) {
+    zimage_header_t header;
+    zimage_t *z;
+    uint32_t i;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, ZIMAGE_MAGIC, 8) != 0 ||
+        header.chunk_size == 0 || (uint64_t)header.chunk_count * header.chunk_size < header.image_size) {
+        return NULL;
+    }
+
+    z = emalloc(sizeof(zimage_t));
+    z->fd = fd;
+    z->header = header;
+    z->index = emalloc((header.chunk_count + 1) * sizeof(uint64_t));
+    if (pread(fd, z->index, (header.chunk_count + 1) * sizeof(uint64_t), sizeof(header)) !=
+        (ssize_t)((header.chunk_count + 1) * sizeof(uint64_t))) {
+        free(z->index);
+        free(z);
+        return NULL;
+    }
+    for (i = 0; i < header.chunk_count; i++) {
+        if (z->index[i + 1] < z->index[i]) {
+            free(z->index);
+            free(z);
+            return NULL;
+        }
+    }
+    z->chunk = emalloc(compressBound(header.chunk_size));
+    z->slots = emalloc((size_t)ZIMAGE_SLOTS * header.chunk_size);
+    for (i = 0; i < ZIMAGE_SLOTS; i++) {
+        z->slot_chunk[i] = -1;
+    }
+    return z;
+}
+
+/**
+ * Function:  load_chunk
+ * --------------------
+ * @brief get the raw data of a chunk, inflating it unless it is still in
+ *        its slot. Chunk n always goes to slot n % ZIMAGE_SLOTS.
+ *
+ * @return The raw chunk, or NULL if it can't be read or inflated.
+ *
+ */
+static const char *load_chunk(zimage_t *z, uint32_t n) {
+    uint32_t chunk_size = z->header.chunk_size;
+    char *slot = z->slots + (size_t)(n % ZIMAGE_SLOTS) * chunk_size;
+    uint64_t stored = z->index[n + 1] - z->index[n];
+    uLongf length = chunk_size;
+
+    if (z->slot_chunk[n % ZIMAGE_SLOTS] == n) {
+        return slot;
+    }
+    z->slot_chunk[n % ZIMAGE_SLOTS] = -1;
+
+    if (stored == 0) {
+        memset(slot, 0, chunk_size);    // a chunk of zeros takes no space
+    } else if (stored == chunk_size) {
+        if (pread(z->fd, slot, chunk_size, z->index[n]) != chunk_size) {
+            return NULL;
+        }
+    } else {
+        if (stored > compressBound(chunk_size) || pread(z->fd, z->chunk, stored, z->index[n]) != (ssize_t)stored ||
+            uncompress((Bytef *)slot, &length, (Bytef *)z->chunk, stored) != Z_OK) {
+            return NULL;
+        }
+        memset(slot + length, 0, chunk_size - length);
+    }
+    z->slot_chunk[n % ZIMAGE_SLOTS] = n;
+    return slot;
+}
+
+/**
+ * Function:  zimage_pread
+ * --------------------
+ * @brief read raw bytes of a compressed image, inflating only the chunks
+ *        they are in. Same contract as pread.
+ *
+ * @param source: the compressed image, a zimage_t.
+ * @param buf: where the bytes go.
+ * @param length: the number of bytes.
+ * @param offset: the raw offset of the first byte.
+ *
+ * @return The number of bytes read, short at the end of the image, or -1
+ *         if a chunk is damaged.
+ *
+ */
+ssize_t zimage_pread(void *source, void *buf, size_t length, off_t offset) {
+    zimage_t *z = source;
+    uint32_t chunk_size = z->header.chunk_size;
+    size_t done = 0;
+
+    if ((uint64_t)offset >= z->header.image_size) {
+        return 0;
+    }
+    if (offset + length > z->header.image_size) {
+        length = z->header.image_size - offset;
+    }
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t within = pos % chunk_size;
+        size_t piece = length - done < chunk_size - within ? length - done : chunk_size - within;
+        const char *chunk = load_chunk(z, pos / chunk_size);
+
+        if (chunk == NULL) {
+            return -1;
+        }
+        memcpy((char *)buf + done, chunk + within, piece);
+        done += piece;
+    }
+    return done;
+}
+
+/**
+ * Function:  zimage_close
+ * --------------------
+ * @brief release a compressed image. Its file is left open.
+ *
+ */
+void zimage_close(zimage_t *z) {
+    free(z->index);
+    free(z->chunk);
+    free(z->slots);
+    free(z);
+}
+
+/**
+ * Function:  read_all
+ * --------------------
+ * @brief read until the buffer is full or the file ends.
+ *
+ * @return The number of bytes read, or -1 on a read error.
+ *
+ */
+static ssize_t read_all(int fd, char *buf, size_t length, off_t offset) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t got = pread(fd, buf + done, length - done, offset + done);
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+/**
+ * Function:  zimage_compress
+ * --------------------
+ * @brief write a raw image out as a compressed image with ZIMAGE_CHUNK
+ *        chunks. Chunks of zeros are stored empty.
+ *
+ * @param src_fd: the raw image.
+ * @param dst_fd: the compressed image, written from its start.
+ * @param image_size: the number of raw bytes.
+ *
+ * @return 0 on success, -1 on a read or write error.
+ *
+ */
+int zimage_compress(int src_fd, int dst_fd, uint64_t image_size) {
+    zimage_header_t header;
+    uint32_t count = (image_size + ZIMAGE_CHUNK - 1) / ZIMAGE_CHUNK;
+    uint64_t *index = emalloc((count + 1) * sizeof(uint64_t));
+    char *raw = emalloc(ZIMAGE_CHUNK);
+    char *packed = emalloc(compressBound(ZIMAGE_CHUNK));
+    uint64_t pos = sizeof(header) + (count + 1) * sizeof(uint64_t);
+    uint32_t i, k;
+    int ret = 0;
+
+    memcpy(header.magic, ZIMAGE_MAGIC, 8);
+    header.chunk_size = ZIMAGE_CHUNK;
+    header.chunk_count = count;
+    header.image_size = image_size;
+
+    for (i = 0; i < count && ret == 0; i++) {
+        ssize_t got = read_all(src_fd, raw, ZIMAGE_CHUNK, (off_t)i * ZIMAGE_CHUNK);
+        uLongf length = compressBound(ZIMAGE_CHUNK);
+        const char *out = packed;
+
+        if (got < 0) {
+            ret = -1;
+            break;
+        }
+        memset(raw + got, 0, ZIMAGE_CHUNK - got);
+        index[i] = pos;
+        for (k = 0; k < ZIMAGE_CHUNK && raw[k] == 0; k++)
+            ;
+        if (k == ZIMAGE_CHUNK) {
+            continue; // all zeros, stored empty
+        }
+        if (compress2((Bytef *)packed, &length, (Bytef *)raw, ZIMAGE_CHUNK, Z_DEFAULT_COMPRESSION) != Z_OK ||
+            length >= ZIMAGE_CHUNK) {
+            out = raw;  // doesn't shrink, stored as it is
+            length = ZIMAGE_CHUNK;
+        }
+        if (pwrite(dst_fd, out, length, pos) != (ssize_t)length) {
+            ret = -1;
+        }
+        pos += length;
+    }
+    index[count] = pos;
+
+    if (ret == 0 && (pwrite(dst_fd, &header, sizeof(header), 0) != sizeof(header) ||
+                     pwrite(dst_fd, index, (count + 1) * sizeof(uint64_t), sizeof(header)) !=
+                     (ssize_t)((count + 1) * sizeof(uint64_t)) || ftruncate(dst_fd, pos) != 0)) {
+        ret = -1;
+    }
+    free(index);
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+/**
+ * Function:  zimage_decompress
+ * --------------------
+ * @brief write a compressed image out as a raw image. Chunks of zeros are
+ *        left as holes.
+ *
+ * @param z: the compressed image.
+ * @param dst_fd: the raw image, written from its start.
+ *
+ * @return 0 on success, -1 on a damaged chunk or a write error.
+ *
+ */
+int zimage_decompress(zimage_t *z, int dst_fd) {
+    uint32_t i;
+
+    for (i = 0; i < z->header.chunk_count; i++) {
+        uint64_t offset = (uint64_t)i * z->header.chunk_size;
+        uint64_t length = z->header.image_size - offset < z->header.chunk_size ?
+                          z->header.image_size - offset : z->header.chunk_size;
+        const char *chunk;
+
+        if (z->index[i + 1] == z->index[i]) {
+            continue;
+        }
+        if ((chunk = load_chunk(z, i)) == NULL || pwrite(dst_fd, chunk, length, offset) != (ssize_t)length) {
+            return -1;
+        }
+    }
+    return ftruncate(dst_fd, z->header.image_size);
+}
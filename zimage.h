@@ -0,0 +1,44 @@
+#ifndef _ZIMAGE_H_
+#define _ZIMAGE_H_
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Header of a compressed disk image. The raw image is cut into chunks of
+ * chunk_size bytes, each compressed on its own, so any byte can be read
+ * by inflating the one chunk holding it. The header is followed by
+ * chunk_count + 1 offsets: chunk i is stored in [index[i], index[i + 1]).
+ * An empty chunk is all zeros, and a chunk as long as its raw data is
+ * stored as it is.
+ */
+typedef struct {
+    char      magic[8];          /* ZIMAGE_MAGIC. */
+    uint32_t  chunk_size;        /* Raw bytes per chunk. */
+    uint32_t  chunk_count;
+    uint64_t  image_size;        /* Raw bytes in the image. */
+} __attribute__ ((packed)) zimage_header_t;
+
+#define ZIMAGE_MAGIC  "SFSZIMG1"
+#define ZIMAGE_CHUNK  (64 * 1024)  /* Chunk size used when compressing. */
+#define ZIMAGE_SLOTS  8            /* Inflated chunks kept in memory. */
+
+/*
+ * An open compressed image.
+ */
+typedef struct {
+    int       fd;
+    zimage_header_t header;
+    uint64_t  *index;            /* Where each chunk is stored, plus the end of the last one. */
+    char      *chunk;            /* Compressed data of the chunk being inflated. */
+    char      *slots;            /* ZIMAGE_SLOTS inflated chunks. */
+    int64_t   slot_chunk[ZIMAGE_SLOTS];  /* The chunk in each slot, -1 if none. */
+} zimage_t;
+
+int zimage_detect(int fd);
+zimage_t *zimage_open(int fd);
+ssize_t zimage_pread(void *source, void *buf, size_t length, off_t offset);
+void zimage_close(zimage_t *z);
+int zimage_compress(int src_fd, int dst_fd, uint64_t image_size);
+int zimage_decompress(zimage_t *z, int dst_fd);
+
+#endif